@@ -1,10 +1,17 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
-#include <sys/time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include "wiringx.h"
+#include "../render/framering.h"
 
 #define COL_DATA 8
 #define COL_CLOCK 9
@@ -13,69 +20,715 @@
 #define ROW_DATA 28
 #define OUT_ENABLE 29
 
-unsigned long long getTimeInMicros() {
-    struct timeval tv;
-    gettimeofday(&tv,NULL);
+// Every pin we drive, what it starts out as, and one more than the highest of them.
+#define PIN_COUNT 6
+#define PIN_LIMIT 32
+static const int pins[PIN_COUNT] = {ROW_DATA, ROW_CLOCK, COL_LATCH, OUT_ENABLE, COL_DATA, COL_CLOCK};
+static const int pinDefaults[PIN_COUNT] = {LOW, LOW, LOW, HIGH, LOW, LOW};
 
-    return (((unsigned long long)tv.tv_sec) * 1000000ULL) + ((unsigned long long)tv.tv_usec);
+// We clock one more row than we have in order to make sure the final line isn't overly bright.
+#define ROWS (FRAME_HEIGHT + 1)
+
+// Where the GPIO banks on the Rock 4's RK3399 are, and where the data register is in each of them.
+#define GPIO_BANKS 5
+#define GPIO_BANK_MAP_SIZE 0x1000
+#define GPIO_SWPORTA_DR 0x00
+static const off_t gpioBankAddresses[GPIO_BANKS] = {0xFF720000, 0xFF730000, 0xFF780000, 0xFF788000, 0xFF790000};
+
+// The most register writes a row can take, which is the data and the clock being in different banks and the
+// data changing every column.
+#define MAX_ROW_WRITES ((FRAME_WIDTH * 3) + 1)
+
+#define DEFAULT_REFRESH_RATE 60.0
+#define DEFAULT_STATS_INTERVAL 10
+
+// How long before a deadline we stop sleeping and start spinning, since waking up from a sleep is only so
+// punctual. Anything shorter than this is spun for outright.
+#define SLEEP_MARGIN_NS 200000ULL
+
+// Histograms are kept in whole microseconds, with everything past the last bucket counted in it.
+#define HISTOGRAM_BUCKETS 1024
+
+typedef struct {
+    unsigned long long counts[HISTOGRAM_BUCKETS];
+    unsigned long long total;
+    unsigned long long min;
+    unsigned long long max;
+} Histogram;
+
+unsigned long long getTimeInNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (((unsigned long long)ts.tv_sec) * 1000000000ULL) + ((unsigned long long)ts.tv_nsec);
 }
 
-int main() {
-    if (nice(-20) == -1) {
-        printf("Couldn't set priority, run me as root!\n");
+unsigned long long getCPUTimeInNanos() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    return (((unsigned long long)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)) * 1000000000ULL) +
+        (((unsigned long long)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec)) * 1000ULL);
+}
+
+// Wait until the given time on CLOCK_MONOTONIC, sleeping for as much of it as we safely can.
+void waitUntil(unsigned long long deadline) {
+    if (deadline > getTimeInNanos() + SLEEP_MARGIN_NS) {
+        struct timespec ts;
+        ts.tv_sec = (deadline - SLEEP_MARGIN_NS) / 1000000000ULL;
+        ts.tv_nsec = (deadline - SLEEP_MARGIN_NS) % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { ; }
+    }
+
+    while (getTimeInNanos() < deadline) { ; }
+}
+
+void histogramAdd(Histogram *histogram, unsigned long long nanos) {
+    unsigned long long micros = nanos / 1000ULL;
+
+    histogram->counts[micros < HISTOGRAM_BUCKETS ? micros : HISTOGRAM_BUCKETS - 1]++;
+    histogram->min = (histogram->total == 0 || micros < histogram->min) ? micros : histogram->min;
+    histogram->max = micros > histogram->max ? micros : histogram->max;
+    histogram->total++;
+}
+
+unsigned long long histogramPercentile(Histogram *histogram, double percent) {
+    unsigned long long wanted = (unsigned long long)((histogram->total * percent) / 100.0);
+    unsigned long long seen = 0;
+
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram->counts[bucket];
+        if (seen > wanted) { return bucket; }
+    }
+
+    return histogram->max;
+}
+
+void histogramPrint(const char *name, Histogram *histogram) {
+    if (histogram->total == 0) { return; }
+
+    printf(
+        "%s: %llu samples, min %lluus, 50%% %lluus, 99%% %lluus, 99.9%% %lluus, max %lluus\n",
+        name, histogram->total, histogram->min,
+        histogramPercentile(histogram, 50.0), histogramPercentile(histogram, 99.0),
+        histogramPercentile(histogram, 99.9), histogram->max
+    );
+}
+
+void histogramWrite(FILE *fp, const char *name, Histogram *histogram) {
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        if (histogram->counts[bucket]) {
+            fprintf(fp, "%s,%d,%llu\n", name, bucket, histogram->counts[bucket]);
+        }
+    }
+}
+
+// Something that can drive our pins. Rows of column data are handed over whenever they change rather than
+// every refresh, so that a backend can turn them into whatever is quickest for it to shift out.
+typedef struct GPIOBackend {
+    const char *name;
+
+    // Get ready to drive the pins, returning 0 if this backend can't be used here. Backends that use wiringX
+    // are set up after wiringX has already set the pins up.
+    int (*setup)(struct GPIOBackend *backend);
+
+    // Set a single pin HIGH or LOW.
+    void (*write)(struct GPIOBackend *backend, int pin, int value);
+
+    // Take a new packed row of column data to be shifted out by shiftRow from now on.
+    void (*prepareRow)(struct GPIOBackend *backend, int row, const uint8_t *bits);
+
+    // Shift a row out to the columns, leaving the column clock LOW.
+    void (*shiftRow)(struct GPIOBackend *backend, int row);
+
+    // Print anything else worth knowing along with our stats, if there is anything.
+    void (*report)(struct GPIOBackend *backend);
+
+    int usesWiringX;
+
+    // Where a backend that records what it does should write that to, if anywhere.
+    const char *output;
+
+    void *state;
+} GPIOBackend;
+
+// The wiringX backend, which goes through the library one pin write at a time.
+typedef struct {
+    uint8_t rows[ROWS][FRAME_ROW_BYTES];
+} WiringXState;
+
+int wiringXBackendSetup(GPIOBackend *backend) {
+    backend->state = calloc(1, sizeof(WiringXState));
+    return backend->state != NULL;
+}
+
+void wiringXBackendWrite(GPIOBackend *backend, int pin, int value) {
+    digitalWrite(pin, value ? HIGH : LOW);
+}
+
+void wiringXBackendPrepareRow(GPIOBackend *backend, int row, const uint8_t *bits) {
+    memcpy(((WiringXState *)backend->state)->rows[row], bits, FRAME_ROW_BYTES);
+}
+
+void wiringXBackendShiftRow(GPIOBackend *backend, int row) {
+    const uint8_t *bits = ((WiringXState *)backend->state)->rows[row];
+
+    for (int col = 0; col < FRAME_WIDTH; col++) {
+        digitalWrite(COL_DATA, ((bits[col >> 3] >> (7 - (col & 7))) & 1) ? HIGH : LOW);
+        digitalWrite(COL_CLOCK, HIGH);
+        digitalWrite(COL_CLOCK, LOW);
+    }
+}
+
+// The register backend, which writes the GPIO data registers directly. Each row is worked out ahead of time
+// as the whole sequence of register values that clocks it out, so that shifting it is nothing but stores.
+typedef struct {
+    uint8_t bank;
+    uint32_t bits;
+} RegisterWrite;
+
+typedef struct {
+    volatile uint32_t *registers[GPIO_BANKS];
+    void *mappings[GPIO_BANKS];
+
+    // What each register was last set to, which bank and bit each pin is, and which bits in each bank are
+    // the column data and clock. Rows only ever hold the column bits, and everything else is filled in from
+    // the register as it is right before they are shifted out, since the banks hold plenty of pins that
+    // aren't ours and somebody else may have changed them since we last looked.
+    uint32_t shadow[GPIO_BANKS];
+    int banks[PIN_LIMIT];
+    uint32_t masks[PIN_LIMIT];
+    uint32_t columnMasks[GPIO_BANKS];
+
+    RegisterWrite writes[ROWS][MAX_ROW_WRITES];
+    int lengths[ROWS];
+} RegisterState;
+
+void registerBackendUnmap(RegisterState *state) {
+    for (int bank = 0; bank < GPIO_BANKS; bank++) {
+        if (state->mappings[bank] != NULL) {
+            munmap(state->mappings[bank], GPIO_BANK_MAP_SIZE);
+        }
+    }
+    free(state);
+}
+
+void registerBackendRead(RegisterState *state, uint32_t *values) {
+    for (int bank = 0; bank < GPIO_BANKS; bank++) {
+        values[bank] = *state->registers[bank];
+    }
+}
+
+int registerBackendSetup(GPIOBackend *backend) {
+    RegisterState *state = (RegisterState *)calloc(1, sizeof(RegisterState));
+    if (state == NULL) { return 0; }
+
+    int fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (fd < 0) {
+        free(state);
+        return 0;
+    }
+
+    for (int bank = 0; bank < GPIO_BANKS; bank++) {
+        void *mapping = mmap(NULL, GPIO_BANK_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, gpioBankAddresses[bank]);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            registerBackendUnmap(state);
+            return 0;
+        }
+
+        state->mappings[bank] = mapping;
+        state->registers[bank] = (volatile uint32_t *)((uint8_t *)mapping + GPIO_SWPORTA_DR);
+    }
+    close(fd);
+
+    // Rather than keep our own copy of how the board's header is wired to the banks, have wiringX flip each
+    // pin and see which bit moves. Anything other than exactly one bit moving means we can't trust this.
+    for (int i = 0; i < PIN_COUNT; i++) {
+        uint32_t before[GPIO_BANKS];
+        uint32_t after[GPIO_BANKS];
+
+        registerBackendRead(state, before);
+        digitalWrite(pins[i], pinDefaults[i] == HIGH ? LOW : HIGH);
+        registerBackendRead(state, after);
+        digitalWrite(pins[i], pinDefaults[i]);
+
+        int found = 0;
+        for (int bank = 0; bank < GPIO_BANKS; bank++) {
+            uint32_t moved = before[bank] ^ after[bank];
+            if (moved == 0) { continue; }
+
+            if (found || (moved & (moved - 1)) != 0) {
+                registerBackendUnmap(state);
+                return 0;
+            }
+
+            state->banks[pins[i]] = bank;
+            state->masks[pins[i]] = moved;
+            found = 1;
+        }
+
+        if (!found) {
+            registerBackendUnmap(state);
+            return 0;
+        }
+    }
+
+    registerBackendRead(state, state->shadow);
+    state->columnMasks[state->banks[COL_DATA]] |= state->masks[COL_DATA];
+    state->columnMasks[state->banks[COL_CLOCK]] |= state->masks[COL_CLOCK];
+
+    backend->state = state;
+    return 1;
+}
+
+void registerBackendWrite(GPIOBackend *backend, int pin, int value) {
+    RegisterState *state = (RegisterState *)backend->state;
+    int bank = state->banks[pin];
+
+    // Read the register back first, the same as wiringX does, so that we only ever change our own pin.
+    uint32_t current = *state->registers[bank];
+    state->shadow[bank] = value ? (current | state->masks[pin]) : (current & ~state->masks[pin]);
+    *state->registers[bank] = state->shadow[bank];
+}
+
+// Move the column data and clock to the given values, adding whatever register writes that takes. The clock
+// goes last when it rises and first when it falls, so that the data is always steady around a rising edge.
+void registerBackendStep(RegisterState *state, int row, uint32_t *columns, int data, int clock, int force) {
+    int dataBank = state->banks[COL_DATA];
+    int clockBank = state->banks[COL_CLOCK];
+
+    uint32_t next[GPIO_BANKS];
+    memcpy(next, columns, sizeof(next));
+    next[dataBank] = data ? (next[dataBank] | state->masks[COL_DATA]) : (next[dataBank] & ~state->masks[COL_DATA]);
+    next[clockBank] = clock ? (next[clockBank] | state->masks[COL_CLOCK]) : (next[clockBank] & ~state->masks[COL_CLOCK]);
+
+    int order[2] = {clock ? dataBank : clockBank, clock ? clockBank : dataBank};
+    for (int i = 0; i < (dataBank == clockBank ? 1 : 2); i++) {
+        int bank = order[i];
+        if (force || next[bank] != columns[bank]) {
+            RegisterWrite *write = &state->writes[row][state->lengths[row]++];
+            write->bank = bank;
+            write->bits = next[bank];
+        }
+    }
+
+    memcpy(columns, next, sizeof(next));
+}
+
+void registerBackendPrepareRow(GPIOBackend *backend, int row, const uint8_t *bits) {
+    RegisterState *state = (RegisterState *)backend->state;
+    uint32_t columns[GPIO_BANKS];
+    memset(columns, 0, sizeof(columns));
+    state->lengths[row] = 0;
+
+    // Nothing is assumed about where the previous row left the data, so the first column always writes.
+    int data = 0;
+    for (int col = 0; col < FRAME_WIDTH; col++) {
+        data = (bits[col >> 3] >> (7 - (col & 7))) & 1;
+        registerBackendStep(state, row, columns, data, 0, col == 0);
+        registerBackendStep(state, row, columns, data, 1, 0);
+    }
+    registerBackendStep(state, row, columns, data, 0, 0);
+}
+
+void registerBackendShiftRow(GPIOBackend *backend, int row) {
+    RegisterState *state = (RegisterState *)backend->state;
+
+    // Only the banks with the column pins in them are written, so only those need reading. Anybody else
+    // changing a pin in them while the row is going out still loses that change, the same as they would if
+    // it landed in the middle of a read-modify-write through wiringX.
+    uint32_t others[GPIO_BANKS];
+    for (int bank = 0; bank < GPIO_BANKS; bank++) {
+        if (state->columnMasks[bank] != 0) {
+            others[bank] = *state->registers[bank] & ~state->columnMasks[bank];
+        }
+    }
+
+    const RegisterWrite *writes = state->writes[row];
+    for (int i = 0; i < state->lengths[row]; i++) {
+        uint32_t value = others[writes[i].bank] | writes[i].bits;
+        *state->registers[writes[i].bank] = value;
+        state->shadow[writes[i].bank] = value;
+    }
+}
+
+// The trace backend, which stands in for the hardware anywhere. It runs the register backend against
+// registers in plain memory, then replays what was written to record every pin toggle and check what a
+// column shift register would have latched against the row it was meant to be. It also plays somebody else
+// who owns a pin in every bank and changes it every refresh, to make sure we never undo that.
+#define TRACE_FOREIGN_PIN 31
+
+typedef struct {
+    RegisterState registers;
+    uint32_t fakeRegisters[GPIO_BANKS];
+    uint32_t seen[GPIO_BANKS];
+
+    uint8_t expected[ROWS][FRAME_ROW_BYTES];
+    uint8_t shifted[FRAME_ROW_BYTES];
+    int shiftedLength;
+    int row;
+
+    unsigned long long refreshes;
+    unsigned long long toggles;
+    unsigned long long writes;
+    unsigned long long latches;
+    unsigned long long mismatches;
+    unsigned long long shiftNanos;
+    unsigned long long foreignLost;
+    int foreign;
+    FILE *output;
+} TraceState;
+
+void traceBackendObserve(TraceState *trace, int bank) {
+    uint32_t value = trace->fakeRegisters[bank];
+    uint32_t moved = value ^ trace->seen[bank];
+    trace->seen[bank] = value;
+    trace->writes++;
+
+    for (int i = 0; i < PIN_COUNT; i++) {
+        int pin = pins[i];
+        if (trace->registers.banks[pin] != bank || !(moved & trace->registers.masks[pin])) { continue; }
+
+        int high = (value & trace->registers.masks[pin]) != 0;
+        trace->toggles++;
+        if (trace->output != NULL) {
+            fprintf(trace->output, "%llu %d %d %d\n", trace->refreshes, trace->row, pin, high);
+        }
+
+        if (pin == COL_CLOCK && high && trace->shiftedLength < FRAME_WIDTH) {
+            int dataBank = trace->registers.banks[COL_DATA];
+            int data = (trace->fakeRegisters[dataBank] & trace->registers.masks[COL_DATA]) != 0;
+            int col = trace->shiftedLength++;
+            trace->shifted[col >> 3] = (uint8_t)((trace->shifted[col >> 3] & ~(0x80 >> (col & 7))) | (data ? (0x80 >> (col & 7)) : 0));
+        } else if (pin == COL_LATCH && high) {
+            trace->latches++;
+            if (trace->shiftedLength != FRAME_WIDTH || memcmp(trace->shifted, trace->expected[trace->row], FRAME_ROW_BYTES) != 0) {
+                trace->mismatches++;
+            }
+            trace->shiftedLength = 0;
+        }
+    }
+}
+
+int traceBackendSetup(GPIOBackend *backend) {
+    TraceState *trace = (TraceState *)calloc(1, sizeof(TraceState));
+    if (trace == NULL) { return 0; }
+
+    if (backend->output != NULL) {
+        trace->output = fopen(backend->output, "w");
+        if (trace->output == NULL) {
+            free(trace);
+            return 0;
+        }
+    }
+
+    // Spread the pins over two banks, so that the column data and clock land in different ones, which is the
+    // most work the register backend ever has to do.
+    RegisterState *state = &trace->registers;
+    for (int i = 0; i < PIN_COUNT; i++) {
+        int bank = pins[i] & 1;
+        state->registers[bank] = &trace->fakeRegisters[bank];
+        state->banks[pins[i]] = bank;
+        state->masks[pins[i]] = 1U << pins[i];
+        state->shadow[bank] |= pinDefaults[i] == HIGH ? state->masks[pins[i]] : 0;
+    }
+    for (int bank = 0; bank < GPIO_BANKS; bank++) {
+        if (state->registers[bank] == NULL) {
+            state->registers[bank] = &trace->fakeRegisters[bank];
+        }
+        trace->fakeRegisters[bank] = state->shadow[bank];
+        trace->seen[bank] = state->shadow[bank];
+    }
+    state->columnMasks[state->banks[COL_DATA]] |= state->masks[COL_DATA];
+    state->columnMasks[state->banks[COL_CLOCK]] |= state->masks[COL_CLOCK];
+
+    backend->state = trace;
+    return 1;
+}
+
+void traceBackendWrite(GPIOBackend *backend, int pin, int value) {
+    TraceState *trace = (TraceState *)backend->state;
+    GPIOBackend registers = *backend;
+    registers.state = &trace->registers;
+
+    registerBackendWrite(&registers, pin, value);
+    traceBackendObserve(trace, trace->registers.banks[pin]);
+}
+
+void traceBackendPrepareRow(GPIOBackend *backend, int row, const uint8_t *bits) {
+    TraceState *trace = (TraceState *)backend->state;
+    GPIOBackend registers = *backend;
+    registers.state = &trace->registers;
+
+    memcpy(trace->expected[row], bits, FRAME_ROW_BYTES);
+    registerBackendPrepareRow(&registers, row, bits);
+}
+
+void traceBackendShiftRow(GPIOBackend *backend, int row) {
+    TraceState *trace = (TraceState *)backend->state;
+    GPIOBackend registers = *backend;
+    registers.state = &trace->registers;
+
+    trace->refreshes += row == 0;
+    trace->row = row;
+
+    // Whatever the other owner last set their pin to should have survived the whole refresh.
+    if (row == 0) {
+        for (int bank = 0; bank < GPIO_BANKS; bank++) {
+            int value = (trace->fakeRegisters[bank] >> TRACE_FOREIGN_PIN) & 1;
+            trace->foreignLost += value != trace->foreign;
+            trace->fakeRegisters[bank] ^= (uint32_t)(value ^ !trace->foreign) << TRACE_FOREIGN_PIN;
+        }
+        trace->foreign = !trace->foreign;
+    }
+
+    // Time the real thing on its own, since replaying it afterwards is much slower than shifting it.
+    uint32_t others[GPIO_BANKS];
+    for (int bank = 0; bank < GPIO_BANKS; bank++) {
+        others[bank] = trace->fakeRegisters[bank] & ~trace->registers.columnMasks[bank];
+    }
+
+    unsigned long long start = getTimeInNanos();
+    registerBackendShiftRow(&registers, row);
+    trace->shiftNanos += getTimeInNanos() - start;
+
+    // The registers only hold where the row ended up, so step back through how it got there.
+    uint32_t ended[GPIO_BANKS];
+    memcpy(ended, trace->fakeRegisters, sizeof(ended));
+    const RegisterWrite *writes = trace->registers.writes[row];
+    for (int i = 0; i < trace->registers.lengths[row]; i++) {
+        trace->fakeRegisters[writes[i].bank] = others[writes[i].bank] | writes[i].bits;
+        traceBackendObserve(trace, writes[i].bank);
+    }
+    memcpy(trace->fakeRegisters, ended, sizeof(ended));
+}
+
+void traceBackendReport(GPIOBackend *backend) {
+    TraceState *trace = (TraceState *)backend->state;
+    double seconds = trace->shiftNanos / 1000000000.0;
+
+    printf(
+        "Trace: %llu register writes, %llu pin toggles, %llu rows latched, %llu wrong, %llu other pins undone, shifting %.1f Mbit/s\n",
+        trace->writes, trace->toggles, trace->latches, trace->mismatches, trace->foreignLost,
+        seconds > 0.0 ? ((trace->latches * (double)FRAME_WIDTH) / seconds) / 1000000.0 : 0.0
+    );
+    if (trace->output != NULL) {
+        fflush(trace->output);
+    }
+}
+
+static GPIOBackend backends[] = {
+    {"registers", registerBackendSetup, registerBackendWrite, registerBackendPrepareRow, registerBackendShiftRow, NULL, 1, NULL, NULL},
+    {"wiringx", wiringXBackendSetup, wiringXBackendWrite, wiringXBackendPrepareRow, wiringXBackendShiftRow, NULL, 1, NULL, NULL},
+    {"trace", traceBackendSetup, traceBackendWrite, traceBackendPrepareRow, traceBackendShiftRow, traceBackendReport, 0, NULL, NULL},
+};
+#define BACKEND_COUNT (sizeof(backends) / sizeof(backends[0]))
+
+GPIOBackend *findBackend(const char *name) {
+    for (size_t i = 0; i < BACKEND_COUNT; i++) {
+        if (strcmp(backends[i].name, name) == 0) {
+            return &backends[i];
+        }
+    }
+
+    return NULL;
+}
+
+void usage(const char *name) {
+    printf("Usage: %s [-b backend] [-r refresh rate] [-p fifo priority] [-c cpu] [-m] [-s stats seconds] [-o histogram file] [-t trace file] [-n refreshes]\n", name);
+    printf("  -b  Drive the pins with registers, which writes the GPIO registers directly and is the default, wiringx,\n");
+    printf("      which goes through wiringX a pin at a time, or trace, which drives nothing but checks and times what\n");
+    printf("      registers would do. Falls back to wiringx when registers can't be used.\n");
+    printf("  -r  Refresh the sign this many times a second, defaulting to %.0f.\n", DEFAULT_REFRESH_RATE);
+    printf("  -p  Run with the SCHED_FIFO real-time policy at this priority instead of just being nice.\n");
+    printf("  -c  Pin ourselves to this CPU.\n");
+    printf("  -m  Lock all of our memory so that we never wait on a page fault.\n");
+    printf("  -s  Print refresh rate, CPU use and timing every this many seconds, defaulting to %d, or 0 for never.\n", DEFAULT_STATS_INTERVAL);
+    printf("  -o  Also write the whole frame and row timing histograms to this file as CSV whenever they are printed.\n");
+    printf("  -t  Have the trace backend write every pin toggle to this file as refresh, row, pin and value.\n");
+    printf("  -n  Exit after this many refreshes, printing stats one last time.\n");
+}
+
+int main(int argc, char *argv[]) {
+    double refreshRate = DEFAULT_REFRESH_RATE;
+    int fifoPriority = 0;
+    int cpu = -1;
+    int lockMemory = 0;
+    int statsInterval = DEFAULT_STATS_INTERVAL;
+    const char *histogramFile = NULL;
+    const char *backendName = NULL;
+    const char *traceFile = NULL;
+    long refreshLimit = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:r:p:c:ms:o:t:n:")) != -1) {
+        switch (opt) {
+            case 'b': backendName = optarg; break;
+            case 'r': refreshRate = atof(optarg); break;
+            case 'p': fifoPriority = atoi(optarg); break;
+            case 'c': cpu = atoi(optarg); break;
+            case 'm': lockMemory = 1; break;
+            case 's': statsInterval = atoi(optarg); break;
+            case 'o': histogramFile = optarg; break;
+            case 't': traceFile = optarg; break;
+            case 'n': refreshLimit = atol(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    GPIOBackend *backend = findBackend(backendName != NULL ? backendName : "registers");
+    if (backend == NULL || refreshLimit < 0 || refreshRate <= 0.0 || statsInterval < 0 || (fifoPriority != 0 && (fifoPriority < sched_get_priority_min(SCHED_FIFO) || fifoPriority > sched_get_priority_max(SCHED_FIFO)))) {
+        usage(argv[0]);
         return 1;
     }
 
-    printf("Initializing GPIO...\n");
-    wiringXSetup("rock4", NULL);
+    backend->output = traceFile;
 
-    pinMode(ROW_DATA, PINMODE_OUTPUT);
-    digitalWrite(ROW_DATA, LOW);
+    // Only the backends that drive real pins need to be root, so the trace backend can run anywhere.
+    if (fifoPriority != 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = fifoPriority;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+            printf("Couldn't set real-time priority, run me as root!\n");
+            if (backend->usesWiringX) { return 1; }
+        }
+    } else if (nice(-20) == -1) {
+        printf("Couldn't set priority, run me as root!\n");
+        if (backend->usesWiringX) { return 1; }
+    }
 
-    pinMode(ROW_CLOCK, PINMODE_OUTPUT);
-    digitalWrite(ROW_CLOCK, LOW);
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            printf("Couldn't pin ourselves to CPU %d!\n", cpu);
+            return 1;
+        }
+    }
+
+    printf("Initializing GPIO...\n");
+    if (backend->usesWiringX) {
+        wiringXSetup("rock4", NULL);
 
-    pinMode(COL_LATCH, PINMODE_OUTPUT);
-    digitalWrite(COL_LATCH, LOW);
+        for (int i = 0; i < PIN_COUNT; i++) {
+            pinMode(pins[i], PINMODE_OUTPUT);
+            digitalWrite(pins[i], pinDefaults[i]);
+        }
+    }
 
-    pinMode(OUT_ENABLE, PINMODE_OUTPUT);
-    digitalWrite(OUT_ENABLE, HIGH);
+    if (!backend->setup(backend)) {
+        // Writing the registers ourselves needs /dev/mem and a board we understand, but wiringX always works.
+        if (backendName == NULL && backend->usesWiringX) {
+            printf("Couldn't drive the %s directly, falling back to wiringX...\n", backend->name);
+            backend = findBackend("wiringx");
+        }
 
-    pinMode(COL_DATA, PINMODE_OUTPUT);
-    digitalWrite(COL_DATA, LOW);
+        if (backendName != NULL || !backend->setup(backend)) {
+            printf("Couldn't set up the %s backend!\n", backend->name);
+            return 1;
+        }
+    }
+    printf("Driving pins with the %s backend...\n", backend->name);
 
-    pinMode(COL_CLOCK, PINMODE_OUTPUT);
-    digitalWrite(COL_CLOCK, LOW);
+    // Renderers hand us frames through shared memory, but anything else can still write frame.bin.
+    FrameRing *ring = frameRingOpen();
+    if (ring != NULL) {
+        printf("Displaying images from %s, or frame.bin file when idle...\n", FRAME_RING_PATH);
+    } else {
+        printf("Displaying images from frame.bin file...\n");
+    }
 
-    printf("Displaying images from frame.bin file...\n");
+    // Only lock once everything is mapped, so that the ring is locked too.
+    if (lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        printf("Couldn't lock memory, run me as root!\n");
+        return 1;
+    }
 
-    unsigned long lastTime = (unsigned long)time(NULL);
+    unsigned long long period = (unsigned long long)(1000000000.0 / refreshRate);
+    unsigned long long nextFrame = getTimeInNanos();
+    unsigned long long lastTime = nextFrame;
+    unsigned long long lastCPUTime = getCPUTimeInNanos();
     unsigned long frames = 0;
+    unsigned long missed = 0;
+
+    // How late each refresh started compared to when it should have, and how long each row took from latch
+    // to latch, which between them say how steady the refresh is.
+    static Histogram frameTiming;
+    static Histogram rowTiming;
+    static Histogram shiftTiming;
     unsigned long lastFrame = 0;
+    uint64_t presented = 0;
+    uint64_t shown = 0;
+    unsigned long idleRefreshes = FRAME_RING_TIMEOUT;
+
+    // The frame we are showing, packed one bit per pixel, and what the backend was last given. Rows only go
+    // over to the backend again when they change, since working out how to shift them out isn't free. The
+    // extra row on the end is always left blank.
+    uint8_t data[ROWS * FRAME_ROW_BYTES];
+    uint8_t prepared[ROWS * FRAME_ROW_BYTES];
+    memset(data, 0, sizeof(data));
+    memset(prepared, 0, sizeof(prepared));
+    for (int row = 0; row < ROWS; row++) {
+        backend->prepareRow(backend, row, prepared + (row * FRAME_ROW_BYTES));
+    }
 
     while( 1 ) {
-        unsigned long long startTime = getTimeInMicros();
+        unsigned long long startTime = getTimeInNanos();
+        histogramAdd(&frameTiming, startTime - nextFrame);
 
-        // First, read our frame, and if it isn't available, read a blank screen.
-        uint8_t data[128*65];
-        FILE *fp = fopen("frame.bin", "rb");
+        // First, grab the newest frame that is due from the ring if a renderer has given us one recently.
+        // Frames come across as just the rows that changed, and are played straight over what we have.
+        // Frames queued up for later still count as recent, since somebody is clearly still around.
+        if (ring != NULL) {
+            if (frameRingPublished(ring) != presented) {
+                uint64_t due = frameRingReadDue(ring, data, shown, frameRingNow(), frameRingRefreshes(ring));
+                if (due != shown) {
+                    shown = due;
+                    presented = due;
+                }
+                idleRefreshes = 0;
+            } else if (idleRefreshes < FRAME_RING_TIMEOUT) {
+                idleRefreshes++;
+            }
+        }
+
+        // Otherwise, read our frame from the file, and if it isn't available, read a blank screen.
+        // The file has one byte per pixel, so it gets packed, and whatever the ring sends next has to start
+        // over from a key frame.
+        FILE *fp = NULL;
+        if (idleRefreshes >= FRAME_RING_TIMEOUT) {
+            fp = fopen("frame.bin", "rb");
+            shown = 0;
+            if (fp == NULL) {
+                memset(data, 0, FRAME_PACKED_SIZE);
+            }
+        }
 
         if (fp != NULL) {
             fseek(fp, 0L, SEEK_END);
             size_t sz = ftell(fp);
             if (sz == 128*64) {
+                uint8_t pixels[128*64];
                 fseek(fp, 0L, SEEK_SET);
-                (void)!fread(data, 1, 128*64, fp);
+                (void)!fread(pixels, 1, 128*64, fp);
+                framePack(pixels, data);
             } else {
-                memset(data, 0, 128*64);
+                memset(data, 0, FRAME_PACKED_SIZE);
             }
 
             fclose(fp);
-        } else {
-            memset(data, 0, 128*64);
         }
 
-        // Now, write the last frame so other applications can vsync.
+        // Now, let other applications know so they can vsync. Anybody who can see the ring is woken up through
+        // it, but older renderers and any that couldn't map the ring only ever look at the last frame file, and
+        // there's no telling whether any of those are around, so it is still written every refresh.
+        if (ring != NULL) {
+            frameRingRefreshed(ring, presented);
+        }
+
         fp = fopen("lastframe", "wb");
         if (fp != NULL) {
             fwrite(&lastFrame, 1, sizeof(lastFrame), fp);
@@ -85,49 +738,97 @@ int main() {
         // Mark that we've advanced past this frame.
         lastFrame++;
 
-        // We clock one more row than we have in order to make sure the final line isn't overly bright.
-        for (int row = 0; row < 65; row++) {
-            // First, clock out the column data.
-            for (int col = 0; col < 128; col++) {
-                digitalWrite(COL_DATA, data[row * 128 + col] ? HIGH : LOW);
-                digitalWrite(COL_CLOCK, HIGH);
-                digitalWrite(COL_CLOCK, LOW);
+        for (int row = 0; row < FRAME_HEIGHT; row++) {
+            uint8_t *bits = data + (row * FRAME_ROW_BYTES);
+            if (memcmp(bits, prepared + (row * FRAME_ROW_BYTES), FRAME_ROW_BYTES) != 0) {
+                memcpy(prepared + (row * FRAME_ROW_BYTES), bits, FRAME_ROW_BYTES);
+                backend->prepareRow(backend, row, bits);
             }
+        }
 
-            // Make sure we have adequate time from displaying the previous column.
-            delayMicroseconds(90);
+        unsigned long long lastLatch = 0;
+        for (int row = 0; row < ROWS; row++) {
+            // First, clock out the column data.
+            unsigned long long shiftStart = getTimeInNanos();
+            backend->shiftRow(backend, row);
+            histogramAdd(&shiftTiming, getTimeInNanos() - shiftStart);
 
-            // For some reason, the top row flickers a bit, must be a timing issue, but we can patch around
-            // it by being tricky with how much we delay displaying the first row after clocking it in.
-            if (row == 1) {
-                for (int delay = 0; delay < 6; delay++) {
-                    delayMicroseconds(50);
-                }
+            // Make sure we have adequate time from displaying the previous column. For some reason, the top
+            // row flickers a bit, must be a timing issue, but we can patch around it by being tricky with how
+            // much we delay displaying the first row after clocking it in.
+            waitUntil(getTimeInNanos() + (row == 1 ? 390000ULL : 90000ULL));
+
+            unsigned long long latch = getTimeInNanos();
+            if (row > 0) {
+                histogramAdd(&rowTiming, latch - lastLatch);
             }
+            lastLatch = latch;
 
             // Now, latch the column.
-            digitalWrite(OUT_ENABLE, LOW);
-            digitalWrite(COL_LATCH, HIGH);
-            digitalWrite(COL_LATCH, LOW);
+            backend->write(backend, OUT_ENABLE, LOW);
+            backend->write(backend, COL_LATCH, HIGH);
+            backend->write(backend, COL_LATCH, LOW);
 
             // Latch in the row indicator, which we only need to do once. Write a LOW otherwise to keep
             // the timing consistent.
             if (row == 0) {
-                digitalWrite(ROW_DATA, HIGH);
+                backend->write(backend, ROW_DATA, HIGH);
             } else {
-                digitalWrite(ROW_DATA, LOW);
+                backend->write(backend, ROW_DATA, LOW);
             }
 
             // Clock out the next row.
-            digitalWrite(ROW_CLOCK, HIGH);
-            digitalWrite(ROW_CLOCK, LOW);
-            digitalWrite(OUT_ENABLE, HIGH);
+            backend->write(backend, ROW_CLOCK, HIGH);
+            backend->write(backend, ROW_CLOCK, LOW);
+            backend->write(backend, OUT_ENABLE, HIGH);
         }
 
-        // Wait for exactly 1/60 of a second in a busyloop, so we can maintain a 60fps refresh rate.
-        while ((getTimeInMicros() - startTime) < 16667ULL) { ; }
+        // Sleep until the next refresh is due. Refreshes are scheduled against the clock rather than against
+        // when this one started, so that lateness never adds up. If we're so far behind that the next one is
+        // already due, we drop the ones we missed and start the schedule over from now.
+        nextFrame += period;
+        unsigned long long now = getTimeInNanos();
+        if (now >= nextFrame) {
+            missed += ((now - nextFrame) / period) + 1;
+            nextFrame = now;
+        }
+        waitUntil(nextFrame);
 
-        // Calculate and log our FPS.
+        // Calculate and log our FPS, and always do it one last time if we're about to stop.
         frames++;
+        now = getTimeInNanos();
+        int finished = refreshLimit > 0 && lastFrame >= (unsigned long)refreshLimit;
+        if (finished || (statsInterval > 0 && now - lastTime >= (unsigned long long)statsInterval * 1000000000ULL)) {
+            unsigned long long cpuTime = getCPUTimeInNanos();
+            printf(
+                "%.2f fps, %.1f%% CPU, %lu refreshes missed\n",
+                (frames * 1000000000.0) / (now - lastTime), ((cpuTime - lastCPUTime) * 100.0) / (now - lastTime), missed
+            );
+            histogramPrint("Refresh lateness", &frameTiming);
+            histogramPrint("Row time", &rowTiming);
+            histogramPrint("Row shift", &shiftTiming);
+            if (backend->report != NULL) {
+                backend->report(backend);
+            }
+            fflush(stdout);
+
+            if (histogramFile != NULL) {
+                FILE *hp = fopen(histogramFile, "w");
+                if (hp != NULL) {
+                    histogramWrite(hp, "refresh", &frameTiming);
+                    histogramWrite(hp, "row", &rowTiming);
+                    histogramWrite(hp, "shift", &shiftTiming);
+                    fclose(hp);
+                }
+            }
+
+            frames = 0;
+            lastTime = now;
+            lastCPUTime = cpuTime;
+        }
+
+        if (finished) {
+            return 0;
+        }
     }
 }
@@ -0,0 +1,57 @@
+#include <cstdlib>
+#include "arena.h"
+
+// Make sure everything we hand out is suitably aligned for doubles and pointers alike.
+#define ARENA_ALIGN(x) (((x) + (alignof(max_align_t) - 1)) & ~(alignof(max_align_t) - 1))
+
+ScratchArena::ScratchArena(size_t blockSize) {
+    this->blockSize = blockSize;
+    blocks = 0;
+    blockSizes = 0;
+    blockCount = 0;
+    currentBlock = 0;
+    offset = 0;
+}
+
+ScratchArena::~ScratchArena() {
+    for (int i = 0; i < blockCount; i++) {
+        free(blocks[i]);
+    }
+
+    free(blocks);
+    free(blockSizes);
+    blocks = 0;
+    blockSizes = 0;
+    blockCount = 0;
+}
+
+void *ScratchArena::alloc(size_t size) {
+    size = ARENA_ALIGN(size);
+
+    // Move on to the next block that can fit this, if the current one can't.
+    while (currentBlock < blockCount && offset + size > blockSizes[currentBlock]) {
+        currentBlock++;
+        offset = 0;
+    }
+
+    // We ran out of blocks, so grab a new one.
+    if (currentBlock == blockCount) {
+        size_t newSize = size > blockSize ? size : blockSize;
+
+        blocks = (char **)realloc(blocks, sizeof(blocks[0]) * (blockCount + 1));
+        blockSizes = (size_t *)realloc(blockSizes, sizeof(blockSizes[0]) * (blockCount + 1));
+        blocks[blockCount] = (char *)malloc(newSize);
+        blockSizes[blockCount] = newSize;
+        blockCount++;
+        offset = 0;
+    }
+
+    void *chunk = blocks[currentBlock] + offset;
+    offset += size;
+    return chunk;
+}
+
+void ScratchArena::reset() {
+    currentBlock = 0;
+    offset = 0;
+}
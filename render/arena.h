@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+
+class ScratchArena {
+    public:
+        // Constructor, blocks of at least blockSize bytes are allocated as needed.
+        ScratchArena(size_t blockSize);
+        ~ScratchArena();
+
+        // Hand out a chunk of memory which remains valid until the next reset. This only touches
+        // the heap when every block allocated so far is used up, so an arena that is reset every
+        // frame quickly stops allocating altogether.
+        void *alloc(size_t size);
+
+        // Typed versions of the above for arrays of plain old data.
+        template <class T> T *allocArray(int length) { return (T *)alloc(sizeof(T) * length); }
+
+        // Reclaim everything handed out since the last reset, keeping the blocks around for reuse.
+        void reset();
+
+    private:
+        char **blocks;
+        size_t *blockSizes;
+        int blockCount;
+
+        int currentBlock;
+        size_t offset;
+        size_t blockSize;
+};
+
+#endif
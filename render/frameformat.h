@@ -0,0 +1,154 @@
+#ifndef FRAMEFORMAT_H
+#define FRAMEFORMAT_H
+
+// How a frame is packed up to go from a renderer to the GPIO driver. Like the frame ring this is plain C so
+// that both sides can include it.
+//
+// A frame in memory is packed one bit per pixel, with each row being FRAME_ROW_BYTES bytes and the leftmost
+// pixel in the highest bit of the first byte, which is also the order the driver shifts them out in.
+//
+// An encoded frame starts with a version byte, a type byte and a little endian 64 bit mask of which rows
+// follow. Key frames always have every row, while delta frames only have the rows that changed since the
+// frame before them. Each row is then a control byte, followed by the row as it is if the control byte is
+// zero, or by that many pairs of run length and byte value otherwise.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define FRAME_FORMAT_VERSION 1
+
+#define FRAME_TYPE_KEY 0
+#define FRAME_TYPE_DELTA 1
+
+#define FRAME_WIDTH 128
+#define FRAME_HEIGHT 64
+#define FRAME_ROW_BYTES (FRAME_WIDTH / 8)
+#define FRAME_PACKED_SIZE (FRAME_ROW_BYTES * FRAME_HEIGHT)
+
+// The largest an encoded frame can get, which is every row stored as it is.
+#define FRAME_HEADER_SIZE 10
+#define FRAME_ENCODED_MAX (FRAME_HEADER_SIZE + (FRAME_HEIGHT * (FRAME_ROW_BYTES + 1)))
+
+// Pack a frame of one byte per pixel, zero for unlit and anything else for lit, down to one bit per pixel.
+static inline void framePack(const uint8_t *pixels, uint8_t *packed) {
+    for (int i = 0; i < FRAME_PACKED_SIZE; i++) {
+        const uint8_t *eight = pixels + (i * 8);
+        packed[i] = (uint8_t)(
+            ((eight[0] != 0) << 7) | ((eight[1] != 0) << 6) | ((eight[2] != 0) << 5) | ((eight[3] != 0) << 4) |
+            ((eight[4] != 0) << 3) | ((eight[5] != 0) << 2) | ((eight[6] != 0) << 1) | (eight[7] != 0)
+        );
+    }
+}
+
+// The opposite of the above, giving one byte per pixel that is either 0 or 1.
+static inline void frameUnpack(const uint8_t *packed, uint8_t *pixels) {
+    for (int i = 0; i < FRAME_PACKED_SIZE; i++) {
+        for (int bit = 0; bit < 8; bit++) {
+            pixels[(i * 8) + bit] = (packed[i] >> (7 - bit)) & 1;
+        }
+    }
+}
+
+// Encode a single packed row into out, returning how many bytes it took.
+static inline size_t _frameEncodeRow(const uint8_t *row, uint8_t *out) {
+    // Runs only pay off while they are smaller than the row itself.
+    int runs = 1;
+    for (int i = 1; i < FRAME_ROW_BYTES; i++) {
+        runs += row[i] != row[i - 1];
+    }
+
+    if ((runs * 2) >= FRAME_ROW_BYTES) {
+        out[0] = 0;
+        memcpy(out + 1, row, FRAME_ROW_BYTES);
+        return FRAME_ROW_BYTES + 1;
+    }
+
+    size_t length = 1;
+    out[0] = (uint8_t)runs;
+    for (int i = 0; i < FRAME_ROW_BYTES;) {
+        int start = i;
+        while (i < FRAME_ROW_BYTES && row[i] == row[start]) { i++; }
+
+        out[length++] = (uint8_t)(i - start);
+        out[length++] = row[start];
+    }
+
+    return length;
+}
+
+// Encode a packed frame into out, which must have room for FRAME_ENCODED_MAX bytes, and return how many bytes
+// it took. When previous is given, only the rows that differ from it are included and the frame can only be
+// decoded on top of previous. Otherwise this is a key frame that can be decoded on its own.
+static inline size_t frameEncode(const uint8_t *packed, const uint8_t *previous, uint8_t *out) {
+    uint64_t rows = 0;
+    size_t length = FRAME_HEADER_SIZE;
+
+    for (int row = 0; row < FRAME_HEIGHT; row++) {
+        const uint8_t *data = packed + (row * FRAME_ROW_BYTES);
+        if (previous != NULL && memcmp(data, previous + (row * FRAME_ROW_BYTES), FRAME_ROW_BYTES) == 0) { continue; }
+
+        rows |= 1ULL << row;
+        length += _frameEncodeRow(data, out + length);
+    }
+
+    out[0] = FRAME_FORMAT_VERSION;
+    out[1] = previous != NULL ? FRAME_TYPE_DELTA : FRAME_TYPE_KEY;
+    for (int i = 0; i < 8; i++) {
+        out[2 + i] = (uint8_t)(rows >> (i * 8));
+    }
+
+    return length;
+}
+
+// Whether an encoded frame can be decoded without the frame before it.
+static inline int frameIsKey(const uint8_t *encoded, size_t length) {
+    return length >= FRAME_HEADER_SIZE && encoded[0] == FRAME_FORMAT_VERSION && encoded[1] == FRAME_TYPE_KEY;
+}
+
+// Decode a frame of length bytes on top of the packed frame already in packed, which only has to be the frame
+// before it for delta frames. Returns 0 if the encoded frame is malformed, in which case packed might only have
+// been partly updated.
+static inline int frameDecode(const uint8_t *encoded, size_t length, uint8_t *packed) {
+    if (length < FRAME_HEADER_SIZE || encoded[0] != FRAME_FORMAT_VERSION) { return 0; }
+    if (encoded[1] != FRAME_TYPE_KEY && encoded[1] != FRAME_TYPE_DELTA) { return 0; }
+
+    uint64_t rows = 0;
+    for (int i = 0; i < 8; i++) {
+        rows |= (uint64_t)encoded[2 + i] << (i * 8);
+    }
+    if (encoded[1] == FRAME_TYPE_KEY && rows != ~0ULL) { return 0; }
+
+    const uint8_t *cur = encoded + FRAME_HEADER_SIZE;
+    const uint8_t *end = encoded + length;
+    for (int row = 0; row < FRAME_HEIGHT; row++) {
+        if (!((rows >> row) & 1)) { continue; }
+
+        uint8_t *data = packed + (row * FRAME_ROW_BYTES);
+        if (cur >= end) { return 0; }
+        int runs = *cur++;
+
+        if (runs == 0) {
+            if (end - cur < FRAME_ROW_BYTES) { return 0; }
+            memcpy(data, cur, FRAME_ROW_BYTES);
+            cur += FRAME_ROW_BYTES;
+            continue;
+        }
+
+        if (end - cur < runs * 2) { return 0; }
+        int filled = 0;
+        for (int i = 0; i < runs; i++) {
+            int count = cur[0];
+            if (count == 0 || filled + count > FRAME_ROW_BYTES) { return 0; }
+
+            memset(data + filled, cur[1], count);
+            filled += count;
+            cur += 2;
+        }
+        if (filled != FRAME_ROW_BYTES) { return 0; }
+    }
+
+    return cur == end;
+}
+
+#endif
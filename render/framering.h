@@ -0,0 +1,320 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+// The shared memory handoff between whatever renders frames and the GPIO driver that puts them on the sign.
+// This is plain C so that both the engine and the driver can include it, and it only uses the GCC atomic
+// builtins since those mean the same thing in both languages.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "frameformat.h"
+
+// Where the ring lives. This is where shm_open would put it on Linux anyway, and opening it directly means
+// nobody has to link against librt on older systems.
+#define FRAME_RING_PATH "/dev/shm/sign-frames"
+
+// Written at the start of the ring so that a stale or foreign file isn't mistaken for one.
+#define FRAME_RING_MAGIC 0x53474E46
+#define FRAME_RING_VERSION 4
+
+// How many frames the ring holds, which is also how far ahead of the driver frames can be queued. Frames
+// are encoded as in frameformat.h, mostly as deltas on the frame before, so a reader that is behind plays
+// the frames it missed over its own copy to catch up. Every this many frames is a key frame, so a reader
+// that is further behind than the ring is long can always start over from the last one.
+#define FRAME_RING_SLOTS 16
+
+// When a frame should be shown. Frames are shown in the order they were published, and at each refresh
+// the driver shows the newest frame that is due, skipping over any others that are.
+#define FRAME_PRESENT_NOW 0
+#define FRAME_PRESENT_AT_TIME 1
+#define FRAME_PRESENT_AT_REFRESH 2
+
+// Room for the biggest encoded frame, rounded up to whole words.
+#define FRAME_RING_SLOT_BYTES (((FRAME_ENCODED_MAX + 7) / 8) * 8)
+
+// How many refreshes the driver shows the last frame from the ring for before going back to frame.bin,
+// so that scripts which write the file still work once a renderer has gone away.
+#define FRAME_RING_TIMEOUT 60
+
+// How many times a reader goes back around for a slot that is being written before giving up until next time.
+// A writer only holds a slot for as long as it takes to copy a frame in, so one that is still going after this
+// has been preempted or has died halfway through, and the driver can't afford to wait for either.
+#define FRAME_RING_RETRIES 1000
+
+typedef struct {
+    // Odd while the slot is being written, and bumped to the next even number once it is done.
+    uint32_t sequence;
+
+    // How many bytes of data the encoded frame takes.
+    uint32_t length;
+
+    // Which frame this is, counting from 1, so that readers can tell it apart from the frame that was in
+    // this slot before.
+    uint64_t frame;
+
+    // One of the FRAME_PRESENT_ values, and the time in nanoseconds on CLOCK_MONOTONIC or the refresh
+    // count that goes with it.
+    uint32_t present;
+    uint32_t reserved;
+    uint64_t presentAt;
+
+    // Kept as words so that they can be copied with atomic loads and stores while the other side is
+    // looking at them.
+    uint64_t data[FRAME_RING_SLOT_BYTES / sizeof(uint64_t)];
+} FrameRingSlot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+
+    // How many frames have been published. The newest one is in slot (published - 1) % FRAME_RING_SLOTS.
+    uint64_t published;
+
+    // The newest frame the driver has shown or skipped past, so that queued frames never get more than the
+    // ring's length ahead of it.
+    uint64_t presented;
+
+    // How many refreshes the driver has finished, which renderers wait on as a futex to find out about vblank.
+    // It is shared between processes, so this is a plain futex and not a private one.
+    uint32_t refreshes;
+
+    // How many renderers are currently asleep on the futex, so the driver can skip waking nobody.
+    uint32_t waiters;
+
+    FrameRingSlot slots[FRAME_RING_SLOTS];
+} FrameRing;
+
+// Map the ring at the given path, creating it if nobody has yet. Returns NULL if shared memory isn't available
+// or the ring there isn't one we understand.
+static inline FrameRing *frameRingOpenAt(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) { return NULL; }
+
+    // The driver runs as root and renderers might not, so don't let the umask lock either of them out.
+    // This only works for whoever created it, which is fine since that's who the umask applied to.
+    (void)!fchmod(fd, 0666);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size < sizeof(FrameRing) && ftruncate(fd, sizeof(FrameRing)) != 0)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, sizeof(FrameRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { return NULL; }
+
+    // A brand new ring is all zeroes, which is already a perfectly good empty ring once it is labelled.
+    FrameRing *ring = (FrameRing *)data;
+    uint32_t magic = 0;
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) == magic) {
+        __atomic_store_n(&ring->version, FRAME_RING_VERSION, __ATOMIC_RELAXED);
+        __atomic_compare_exchange_n(&ring->magic, &magic, FRAME_RING_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != FRAME_RING_MAGIC || __atomic_load_n(&ring->version, __ATOMIC_RELAXED) != FRAME_RING_VERSION) {
+        munmap(data, sizeof(FrameRing));
+        return NULL;
+    }
+
+    return ring;
+}
+
+// Map the ring that renderers and the driver share. Returns NULL if it can't be, in which case callers should
+// fall back to frame.bin.
+static inline FrameRing *frameRingOpen(void) {
+    return frameRingOpenAt(FRAME_RING_PATH);
+}
+
+static inline void frameRingClose(FrameRing *ring) {
+    munmap(ring, sizeof(FrameRing));
+}
+
+// How many frames have been published so far. Cheap enough to check every refresh.
+static inline uint64_t frameRingPublished(FrameRing *ring) {
+    return __atomic_load_n(&ring->published, __ATOMIC_ACQUIRE);
+}
+
+// The current time on CLOCK_MONOTONIC in nanoseconds, which is what frames are queued against.
+static inline uint64_t frameRingNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+// Queue a packed frame to be shown as given by present and presentAt, and return which frame it was published
+// as. Only one writer is supported at a time. If previous is given, it should be the packed frame that was
+// published as previousFrame, and the new frame is sent as the rows that changed since then as long as that
+// is still the newest frame in the ring.
+//
+// Frames to be shown now always go in, even if that means replacing frames the driver hasn't got to yet.
+// Anything else is refused if the ring is already full of frames waiting to be shown, in which case this
+// returns 0.
+static inline uint64_t frameRingQueue(FrameRing *ring, const uint8_t *packed, const uint8_t *previous, uint64_t previousFrame, uint32_t present, uint64_t presentAt) {
+    uint64_t published = __atomic_load_n(&ring->published, __ATOMIC_RELAXED);
+    if (present != FRAME_PRESENT_NOW && published - __atomic_load_n(&ring->presented, __ATOMIC_ACQUIRE) >= FRAME_RING_SLOTS) {
+        return 0;
+    }
+
+    FrameRingSlot *slot = &ring->slots[published % FRAME_RING_SLOTS];
+
+    uint8_t encoded[FRAME_RING_SLOT_BYTES];
+    int key = previous == NULL || previousFrame != published || (published % FRAME_RING_SLOTS) == 0;
+    size_t length = frameEncode(packed, key ? NULL : previous, encoded);
+
+    // Round up to odd in case a previous writer died halfway through this slot.
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) | 1;
+    __atomic_store_n(&slot->sequence, sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&slot->frame, published + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->length, (uint32_t)length, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->present, present, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->presentAt, presentAt, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < (length + 7) / sizeof(uint64_t); i++) {
+        uint64_t word;
+        memcpy(&word, encoded + (i * sizeof(uint64_t)), sizeof(uint64_t));
+        __atomic_store_n(&slot->data[i], word, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->published, published + 1, __ATOMIC_RELEASE);
+    return published + 1;
+}
+
+// Identical to the above for a frame that should be shown as soon as possible, which always goes in.
+static inline uint64_t frameRingPublish(FrameRing *ring, const uint8_t *packed, const uint8_t *previous, uint64_t previousFrame) {
+    return frameRingQueue(ring, packed, previous, previousFrame, FRAME_PRESENT_NOW, 0);
+}
+
+// How many refreshes the driver has finished so far.
+static inline uint32_t frameRingRefreshes(FrameRing *ring) {
+    return __atomic_load_n(&ring->refreshes, __ATOMIC_ACQUIRE);
+}
+
+// Called by the driver once it has taken a frame for a refresh, to let writers know it is done with everything
+// up to presented and to wake up anybody waiting for vblank.
+static inline void frameRingRefreshed(FrameRing *ring, uint64_t presented) {
+    __atomic_store_n(&ring->presented, presented, __ATOMIC_RELEASE);
+
+    // Both this and the waiter's side are sequentially consistent, so that either we see the waiter and
+    // wake it, or the futex sees our new count and doesn't put it to sleep.
+    __atomic_add_fetch(&ring->refreshes, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST) != 0) {
+        syscall(SYS_futex, &ring->refreshes, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+// Sleep until the refresh count is something other than seen, or until the deadline on CLOCK_MONOTONIC has
+// passed if one is given. Returns the refresh count as of waking up, which is still seen on a timeout.
+static inline uint32_t frameRingWaitForRefresh(FrameRing *ring, uint32_t seen, const struct timespec *deadline) {
+    for (;;) {
+        uint32_t refreshes = frameRingRefreshes(ring);
+        if (refreshes != seen) { return refreshes; }
+
+        __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+        long result = syscall(SYS_futex, &ring->refreshes, FUTEX_WAIT_BITSET, seen, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+        int timedOut = result != 0 && errno == ETIMEDOUT;
+        __atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+
+        if (timedOut) { return frameRingRefreshes(ring); }
+    }
+}
+
+// Copy the given frame out of its slot, returning 0 if it is being written or has already been replaced.
+static inline int _frameRingCopy(FrameRing *ring, uint64_t frame, uint8_t *encoded, size_t *length, uint32_t *present, uint64_t *presentAt) {
+    FrameRingSlot *slot = &ring->slots[(frame - 1) % FRAME_RING_SLOTS];
+    uint32_t before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if (before & 1) { return 0; }
+
+    uint32_t size = __atomic_load_n(&slot->length, __ATOMIC_RELAXED);
+    uint32_t when = __atomic_load_n(&slot->present, __ATOMIC_RELAXED);
+    uint64_t at = __atomic_load_n(&slot->presentAt, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&slot->frame, __ATOMIC_RELAXED) != frame || size > FRAME_ENCODED_MAX) { return 0; }
+
+    for (size_t i = 0; i < (size + 7) / sizeof(uint64_t); i++) {
+        uint64_t word = __atomic_load_n(&slot->data[i], __ATOMIC_RELAXED);
+        memcpy(encoded + (i * sizeof(uint64_t)), &word, sizeof(uint64_t));
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != before) { return 0; }
+
+    *length = size;
+    *present = when;
+    *presentAt = at;
+    return 1;
+}
+
+// Whether a frame should be shown by now, given the time and refresh count it is being decided at.
+static inline int _frameRingIsDue(uint32_t present, uint64_t presentAt, uint64_t now, uint32_t refreshes) {
+    switch (present) {
+        case FRAME_PRESENT_AT_TIME:
+            return now >= presentAt;
+        case FRAME_PRESENT_AT_REFRESH:
+            return (int32_t)(refreshes - (uint32_t)presentAt) >= 0;
+        default:
+            return 1;
+    }
+}
+
+// Play frames from the ring over a packed frame that currently holds frame shown, or 0 if it doesn't hold one
+// from the ring yet, stopping at the first one that isn't due unless all is set. Returns which frame it holds
+// afterwards, which might not be the newest if a slot it needed never finished being written.
+static inline uint64_t _frameRingRead(FrameRing *ring, uint8_t *packed, uint64_t shown, int all, uint64_t now, uint32_t refreshes) {
+    uint8_t encoded[FRAME_RING_SLOT_BYTES];
+
+    for (int tries = 0; tries < FRAME_RING_RETRIES; tries++) {
+        uint64_t published = frameRingPublished(ring);
+        if (published == shown) { return shown; }
+
+        // Carry on from the frame we have if everything since is still in the ring, or else start over from
+        // the most recent key frame.
+        uint64_t next = shown + 1;
+        if (shown == 0 || shown > published || published - shown > FRAME_RING_SLOTS) {
+            next = published - ((published - 1) % FRAME_RING_SLOTS);
+        }
+
+        // If the writer laps us partway through, we keep what we caught up on and go around again.
+        size_t length;
+        uint32_t present;
+        uint64_t presentAt;
+        while (next <= published && _frameRingCopy(ring, next, encoded, &length, &present, &presentAt)) {
+            // Frames are shown in order, so nothing after one that isn't due yet is either.
+            if (!all && !_frameRingIsDue(present, presentAt, now, refreshes)) { return shown; }
+
+            // Nothing we can do about a frame we don't understand, so don't keep trying it.
+            if (!frameDecode(encoded, length, packed)) { return shown; }
+            shown = next++;
+        }
+
+        if (next > published) { return shown; }
+    }
+
+    return shown;
+}
+
+// Bring a packed frame up to date with the newest frame in the ring that is due at the given time on
+// CLOCK_MONOTONIC in nanoseconds and refresh count, where shown is which frame it currently holds, or 0 if
+// it doesn't hold one from the ring yet. Returns which frame it holds afterwards, which is still shown if
+// nothing new is due.
+static inline uint64_t frameRingReadDue(FrameRing *ring, uint8_t *packed, uint64_t shown, uint64_t now, uint32_t refreshes) {
+    return _frameRingRead(ring, packed, shown, 0, now, refreshes);
+}
+
+// Identical to the above, but brings the packed frame all the way up to the newest frame regardless of when
+// it is meant to be shown.
+static inline uint64_t frameRingRead(FrameRing *ring, uint8_t *packed, uint64_t shown) {
+    return _frameRingRead(ring, packed, shown, 1, 0, 0);
+}
+
+#endif
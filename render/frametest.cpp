@@ -0,0 +1,320 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include "framering.h"
+
+#define ASSERT(cond, error) if(!(cond)) { printf("%s:%d - %s (%s)\n", __FILE__, __LINE__, #cond, error); }
+
+// A ring of our own, so that running the tests doesn't disturb a sign that is running.
+#define TEST_RING_PATH "/dev/shm/sign-frames-test"
+
+// How many frames the benchmark pushes through.
+#define BENCHMARK_FRAMES 20000
+
+static void random_frame(uint8_t *packed, int density) {
+    for (int i = 0; i < FRAME_PACKED_SIZE; i++) {
+        packed[i] = (rand() % 100) < density ? (uint8_t)rand() : 0;
+    }
+}
+
+// Something like what the engine draws, a few lines that move a little from one frame to the next.
+static void wireframe_frame(uint8_t *pixels, int frame) {
+    memset(pixels, 0, FRAME_WIDTH * FRAME_HEIGHT);
+
+    for (int line = 0; line < 6; line++) {
+        double angle = (frame * 0.01) + (line * 1.047);
+        int x0 = 64 + (int)(40.0 * cos(angle));
+        int y0 = 32 + (int)(25.0 * sin(angle));
+        int x1 = 64 + (int)(40.0 * cos(angle + 2.0));
+        int y1 = 32 + (int)(25.0 * sin(angle + 2.0));
+
+        int steps = abs(x1 - x0) > abs(y1 - y0) ? abs(x1 - x0) : abs(y1 - y0);
+        for (int i = 0; i <= steps; i++) {
+            int x = x0 + (steps ? ((x1 - x0) * i) / steps : 0);
+            int y = y0 + (steps ? ((y1 - y0) * i) / steps : 0);
+            pixels[x + (y * FRAME_WIDTH)] = 1;
+        }
+    }
+}
+
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+void pack_test() {
+    uint8_t pixels[FRAME_WIDTH * FRAME_HEIGHT];
+    uint8_t packed[FRAME_PACKED_SIZE];
+    uint8_t unpacked[FRAME_WIDTH * FRAME_HEIGHT];
+
+    // Anything that isn't zero counts as lit.
+    for (int i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; i++) {
+        pixels[i] = (rand() % 3) == 0 ? 0 : (uint8_t)(rand() % 255 + 1);
+    }
+
+    framePack(pixels, packed);
+    frameUnpack(packed, unpacked);
+
+    bool same = true;
+    for (int i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; i++) {
+        same = same && unpacked[i] == (pixels[i] != 0);
+    }
+    ASSERT(same, "Frame doesn't survive being packed and unpacked!")
+
+    // The leftmost pixel goes out first, so it should be the highest bit.
+    memset(pixels, 0, sizeof(pixels));
+    pixels[0] = 1;
+    pixels[FRAME_WIDTH + 9] = 1;
+    framePack(pixels, packed);
+    ASSERT(packed[0] == 0x80, "First pixel isn't the highest bit!")
+    ASSERT(packed[FRAME_ROW_BYTES + 1] == 0x40, "Second row isn't packed where it should be!")
+}
+
+void key_round_trip_test() {
+    uint8_t packed[FRAME_PACKED_SIZE];
+    uint8_t decoded[FRAME_PACKED_SIZE];
+    uint8_t encoded[FRAME_ENCODED_MAX];
+
+    for (int density = 0; density <= 100; density += 10) {
+        random_frame(packed, density);
+        memset(decoded, 0xAA, sizeof(decoded));
+
+        size_t length = frameEncode(packed, NULL, encoded);
+        ASSERT(length <= FRAME_ENCODED_MAX, "Key frame is bigger than the most it should be!")
+        ASSERT(frameIsKey(encoded, length), "Key frame isn't marked as one!")
+        ASSERT(frameDecode(encoded, length, decoded), "Key frame doesn't decode!")
+        ASSERT(memcmp(packed, decoded, sizeof(packed)) == 0, "Key frame doesn't survive a round trip!")
+    }
+
+    // A blank frame should be almost nothing at all.
+    memset(packed, 0, sizeof(packed));
+    size_t length = frameEncode(packed, NULL, encoded);
+    ASSERT(length == FRAME_HEADER_SIZE + (FRAME_HEIGHT * 3), "Blank rows aren't run length encoded!")
+
+    // Every byte different is the worst case for runs, so they should all be stored as they are.
+    for (int i = 0; i < FRAME_PACKED_SIZE; i++) {
+        packed[i] = (uint8_t)i;
+    }
+    length = frameEncode(packed, NULL, encoded);
+    ASSERT(length == FRAME_ENCODED_MAX, "Rows that don't run aren't stored as they are!")
+    ASSERT(frameDecode(encoded, length, decoded) && memcmp(packed, decoded, sizeof(packed)) == 0, "Raw rows don't survive a round trip!")
+}
+
+void delta_round_trip_test() {
+    uint8_t previous[FRAME_PACKED_SIZE];
+    uint8_t packed[FRAME_PACKED_SIZE];
+    uint8_t decoded[FRAME_PACKED_SIZE];
+    uint8_t encoded[FRAME_ENCODED_MAX];
+
+    random_frame(previous, 30);
+    memcpy(decoded, previous, sizeof(decoded));
+
+    for (int frame = 0; frame < 100; frame++) {
+        memcpy(packed, previous, sizeof(packed));
+        for (int change = 0; change < frame % 8; change++) {
+            packed[rand() % FRAME_PACKED_SIZE] ^= (uint8_t)(1 << (rand() % 8));
+        }
+
+        size_t length = frameEncode(packed, previous, encoded);
+        ASSERT(!frameIsKey(encoded, length), "Delta frame is marked as a key frame!")
+        ASSERT(frameDecode(encoded, length, decoded), "Delta frame doesn't decode!")
+        ASSERT(memcmp(packed, decoded, sizeof(packed)) == 0, "Delta frame doesn't survive a round trip!")
+
+        memcpy(previous, packed, sizeof(previous));
+    }
+
+    // Nothing changing should cost nothing but the header.
+    size_t length = frameEncode(previous, previous, encoded);
+    ASSERT(length == FRAME_HEADER_SIZE, "Unchanged frame sends rows anyway!")
+}
+
+void malformed_test() {
+    uint8_t packed[FRAME_PACKED_SIZE];
+    uint8_t decoded[FRAME_PACKED_SIZE];
+    uint8_t encoded[FRAME_ENCODED_MAX];
+
+    random_frame(packed, 50);
+    size_t length = frameEncode(packed, NULL, encoded);
+
+    bool rejected = true;
+    for (size_t cut = 0; cut < length; cut++) {
+        rejected = rejected && !frameDecode(encoded, cut, decoded);
+    }
+    ASSERT(rejected, "Truncated frame decodes anyway!")
+
+    encoded[0] = FRAME_FORMAT_VERSION + 1;
+    ASSERT(!frameDecode(encoded, length, decoded), "Frame from another version decodes anyway!")
+}
+
+void ring_round_trip_test() {
+    unlink(TEST_RING_PATH);
+    FrameRing *ring = frameRingOpenAt(TEST_RING_PATH);
+    ASSERT(ring != NULL, "Couldn't open a test ring!")
+    if (ring == NULL) { return; }
+
+    uint8_t frames[64][FRAME_PACKED_SIZE];
+    uint8_t readers[5][FRAME_PACKED_SIZE];
+    uint64_t shown[5] = {0, 0, 0, 0, 0};
+    int lags[5] = {1, 2, 3, 5, 7};
+
+    uint64_t published = 0;
+    for (int frame = 0; frame < 64; frame++) {
+        // Mostly small changes, with the occasional whole new frame and a writer that starts over halfway.
+        if (frame == 0 || frame % 13 == 0) {
+            random_frame(frames[frame], 40);
+        } else {
+            memcpy(frames[frame], frames[frame - 1], FRAME_PACKED_SIZE);
+            frames[frame][rand() % FRAME_PACKED_SIZE] ^= 0x10;
+        }
+
+        bool restart = frame == 32;
+        published = frameRingPublish(ring, frames[frame], (frame && !restart) ? frames[frame - 1] : NULL, published);
+        ASSERT(published == (uint64_t)frame + 1, "Frames aren't counted as they are published!")
+
+        // Readers that fall further behind than the ring is long have to find a key frame to start over from.
+        for (int reader = 0; reader < 5; reader++) {
+            if ((frame + 1) % lags[reader] != 0) { continue; }
+
+            shown[reader] = frameRingRead(ring, readers[reader], shown[reader]);
+            ASSERT(shown[reader] == published, "Reader didn't catch up to the newest frame!")
+            ASSERT(memcmp(readers[reader], frames[frame], FRAME_PACKED_SIZE) == 0, "Reader's frame doesn't match what was published!")
+        }
+    }
+
+    frameRingClose(ring);
+    unlink(TEST_RING_PATH);
+}
+
+void queue_test() {
+    unlink(TEST_RING_PATH);
+    FrameRing *ring = frameRingOpenAt(TEST_RING_PATH);
+    ASSERT(ring != NULL, "Couldn't open a test ring!")
+    if (ring == NULL) { return; }
+
+    uint8_t frames[FRAME_RING_SLOTS + 1][FRAME_PACKED_SIZE];
+    uint8_t reader[FRAME_PACKED_SIZE];
+    uint64_t published = 0;
+
+    // Fill the queue up with frames 10ns apart from 100ns onwards.
+    for (int frame = 0; frame < FRAME_RING_SLOTS; frame++) {
+        random_frame(frames[frame], 20);
+        published = frameRingQueue(ring, frames[frame], frame ? frames[frame - 1] : NULL, published, FRAME_PRESENT_AT_TIME, 100 + (frame * 10));
+        ASSERT(published == (uint64_t)frame + 1, "Queued frame wasn't accepted!")
+    }
+
+    random_frame(frames[FRAME_RING_SLOTS], 20);
+    ASSERT(frameRingQueue(ring, frames[FRAME_RING_SLOTS], frames[FRAME_RING_SLOTS - 1], published, FRAME_PRESENT_AT_TIME, 1000) == 0, "Queue accepted a frame when it was full!")
+
+    // Nothing is due before the first frame's time, then it's whichever was due most recently.
+    uint64_t shown = frameRingReadDue(ring, reader, 0, 99, 0);
+    ASSERT(shown == 0, "Frame was shown before it was due!")
+    shown = frameRingReadDue(ring, reader, shown, 100, 0);
+    ASSERT(shown == 1 && memcmp(reader, frames[0], FRAME_PACKED_SIZE) == 0, "Frame wasn't shown once it was due!")
+    shown = frameRingReadDue(ring, reader, shown, 135, 0);
+    ASSERT(shown == 4 && memcmp(reader, frames[3], FRAME_PACKED_SIZE) == 0, "Late frames weren't skipped over!")
+
+    // Once the driver says it is done with them, there is room again.
+    frameRingRefreshed(ring, shown);
+    published = frameRingQueue(ring, frames[FRAME_RING_SLOTS], frames[FRAME_RING_SLOTS - 1], published, FRAME_PRESENT_AT_REFRESH, 3);
+    ASSERT(published == FRAME_RING_SLOTS + 1, "Queue didn't make room once frames were shown!")
+    shown = frameRingReadDue(ring, reader, shown, 1000, 2);
+    ASSERT(shown == FRAME_RING_SLOTS, "Frame was shown before its refresh!")
+    shown = frameRingReadDue(ring, reader, shown, 1000, 3);
+    ASSERT(shown == published && memcmp(reader, frames[FRAME_RING_SLOTS], FRAME_PACKED_SIZE) == 0, "Frame wasn't shown on its refresh!")
+
+    frameRingClose(ring);
+    unlink(TEST_RING_PATH);
+}
+
+void dead_writer_test() {
+    unlink(TEST_RING_PATH);
+    FrameRing *ring = frameRingOpenAt(TEST_RING_PATH);
+    ASSERT(ring != NULL, "Couldn't open a test ring!")
+    if (ring == NULL) { return; }
+
+    uint8_t frames[FRAME_RING_SLOTS + 1][FRAME_PACKED_SIZE];
+    uint8_t reader[FRAME_PACKED_SIZE];
+    uint64_t published = 0;
+    for (int frame = 0; frame < FRAME_RING_SLOTS; frame++) {
+        random_frame(frames[frame], 20);
+        published = frameRingPublish(ring, frames[frame], frame ? frames[frame - 1] : NULL, published);
+    }
+
+    // A writer that died partway through the key frame a new reader has to start from leaves it odd forever,
+    // which a reader has to give up on instead of waiting.
+    ring->slots[0].sequence |= 1;
+    uint64_t shown = frameRingRead(ring, reader, 0);
+    ASSERT(shown == 0, "Reader used a frame that was never finished!")
+
+    // The next writer to come along takes the slot over again as the next key frame.
+    random_frame(frames[FRAME_RING_SLOTS], 20);
+    published = frameRingPublish(ring, frames[FRAME_RING_SLOTS], NULL, 0);
+    shown = frameRingRead(ring, reader, shown);
+    ASSERT(shown == published && memcmp(reader, frames[FRAME_RING_SLOTS], FRAME_PACKED_SIZE) == 0, "Reader didn't recover from a dead writer!")
+
+    frameRingClose(ring);
+    unlink(TEST_RING_PATH);
+}
+
+void benchmark() {
+    uint8_t pixels[FRAME_WIDTH * FRAME_HEIGHT];
+    uint8_t previous[FRAME_PACKED_SIZE];
+    uint8_t packed[FRAME_PACKED_SIZE];
+    uint8_t decoded[FRAME_PACKED_SIZE];
+    uint8_t *encoded = (uint8_t *)malloc((size_t)BENCHMARK_FRAMES * FRAME_ENCODED_MAX);
+    size_t *lengths = (size_t *)malloc(BENCHMARK_FRAMES * sizeof(size_t));
+    size_t total = 0;
+
+    // Encoding includes packing, since that is what a renderer pays for every frame.
+    double start = seconds();
+    for (int frame = 0; frame < BENCHMARK_FRAMES; frame++) {
+        wireframe_frame(pixels, frame);
+        framePack(pixels, packed);
+        lengths[frame] = frameEncode(packed, frame % FRAME_RING_SLOTS ? previous : NULL, encoded + ((size_t)frame * FRAME_ENCODED_MAX));
+        total += lengths[frame];
+        memcpy(previous, packed, sizeof(previous));
+    }
+    double encodeTime = seconds() - start;
+
+    // Drawing the frames is in there too, so take it back out.
+    start = seconds();
+    for (int frame = 0; frame < BENCHMARK_FRAMES; frame++) {
+        wireframe_frame(pixels, frame);
+    }
+    encodeTime -= seconds() - start;
+
+    start = seconds();
+    bool decodes = true;
+    for (int frame = 0; frame < BENCHMARK_FRAMES; frame++) {
+        decodes = decodes && frameDecode(encoded + ((size_t)frame * FRAME_ENCODED_MAX), lengths[frame], decoded);
+    }
+    double decodeTime = seconds() - start;
+    ASSERT(decodes && memcmp(decoded, packed, sizeof(packed)) == 0, "Benchmark frames didn't decode to the last one!")
+
+    printf(
+        "Encoded %d frames at %.0f frames/sec, decoded at %.0f frames/sec, averaging %zu bytes instead of %d.\n",
+        BENCHMARK_FRAMES, BENCHMARK_FRAMES / encodeTime, BENCHMARK_FRAMES / decodeTime,
+        total / BENCHMARK_FRAMES, FRAME_WIDTH * FRAME_HEIGHT
+    );
+
+    free(encoded);
+    free(lengths);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Running frame tests...\n");
+
+    pack_test();
+    key_round_trip_test();
+    delta_round_trip_test();
+    malformed_test();
+    ring_round_trip_test();
+    queue_test();
+    dead_writer_test();
+    benchmark();
+
+    printf("Done!\n");
+}
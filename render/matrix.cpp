@@ -1,6 +1,11 @@
 #include <cmath>
 #include "matrix.h"
 
+Point::Point() {
+    this->x = 0.0;
+    this->y = 0.0;
+    this->z = 0.0;
+}
 
 Point::Point(double x, double y, double z) {
     this->x = x;
@@ -75,7 +80,21 @@ bool Plane::isPointAbove(Point *point) {
     return dot >= 0.0;
 }
 
+double Plane::distance(Point *point) {
+    double vx = point->x - p1.x;
+    double vy = point->y - p1.y;
+    double vz = point->z - p1.z;
+
+    return (vx * nx) + (vy * ny) + (vz * nz);
+}
+
 Point *Plane::intersection(Point *start, Point *end) {
+    Point *point = new Point();
+    intersection(start, end, point);
+    return point;
+}
+
+void Plane::intersection(Point *start, Point *end, Point *out) {
     double lineX = end->x - start->x;
     double lineY = end->y - start->y;
     double lineZ = end->z - start->z;
@@ -91,11 +110,9 @@ Point *Plane::intersection(Point *start, Point *end) {
 
     // Now that we've calculated the factor, start at the start point and add the factor percentage
     // along to get to the new point.
-    return new Point(
-        start->x + (lineX * factor),
-        start->y + (lineY * factor),
-        start->z + (lineZ * factor)
-    );
+    out->x = start->x + (lineX * factor);
+    out->y = start->y + (lineY * factor);
+    out->z = start->z + (lineZ * factor);
 }
 
 Frustum::Frustum(int width, int height, double fov, double zNear, double zFar) {
@@ -219,14 +236,18 @@ Point *Matrix::multiplyPoint(Point *point) {
     return new Point(x, y, z);
 }
 
-void Matrix::multiplyUpdatePoint(Point *point) {
+void Matrix::multiplyPoint(Point *point, Point *out) {
     double x = (a11 * point->x) + (a21 * point->y) + (a31 * point->z) + a41;
     double y = (a12 * point->x) + (a22 * point->y) + (a32 * point->z) + a42;
     double z = (a13 * point->x) + (a23 * point->y) + (a33 * point->z) + a43;
 
-    point->x = x;
-    point->y = y;
-    point->z = z;
+    out->x = x;
+    out->y = y;
+    out->z = z;
+}
+
+void Matrix::multiplyUpdatePoint(Point *point) {
+    multiplyPoint(point, point);
 }
 
 Point *Matrix::projectPoint(Point *point) {
@@ -237,14 +258,18 @@ Point *Matrix::projectPoint(Point *point) {
     return new Point(x / w, y / w, 1 / w);
 }
 
-void Matrix::projectUpdatePoint(Point *point) {
+void Matrix::projectPoint(Point *point, Point *out) {
     double x = (a11 * point->x) + (a21 * point->y) + (a31 * point->z) + a41;
     double y = (a12 * point->x) + (a22 * point->y) + (a32 * point->z) + a42;
     double w = (a14 * point->x) + (a24 * point->y) + (a34 * point->z) + a44;
 
-    point->x = x / w;
-    point->y = y / w;
-    point->z = 1 / w;
+    out->x = x / w;
+    out->y = y / w;
+    out->z = 1 / w;
+}
+
+void Matrix::projectUpdatePoint(Point *point) {
+    projectPoint(point, point);
 }
 
 void Matrix::multiplyPoints(Point *points[], int length) {
@@ -484,6 +509,31 @@ double _det(double m[16])
     );
 }
 
+bool Matrix::getCenterOfProjection(Point *center) {
+    // Solve for the point where projected X, Y and W are all zero using Cramer's rule.
+    double det = (a11 * ((a22 * a34) - (a24 * a32))) -
+                 (a21 * ((a12 * a34) - (a14 * a32))) +
+                 (a31 * ((a12 * a24) - (a14 * a22)));
+    if (det == 0.0) {
+        return false;
+    }
+
+    double bx = -a41;
+    double by = -a42;
+    double bw = -a44;
+
+    center->x = ((bx * ((a22 * a34) - (a24 * a32))) -
+                 (a21 * ((by * a34) - (bw * a32))) +
+                 (a31 * ((by * a24) - (bw * a22)))) / det;
+    center->y = ((a11 * ((by * a34) - (bw * a32))) -
+                 (bx * ((a12 * a34) - (a14 * a32))) +
+                 (a31 * ((a12 * bw) - (a14 * by)))) / det;
+    center->z = ((a11 * ((a22 * bw) - (a24 * by))) -
+                 (a21 * ((a12 * bw) - (a14 * by))) +
+                 (bx * ((a12 * a24) - (a14 * a22)))) / det;
+    return true;
+}
+
 Matrix *Matrix::invert()
 {
     double orig[16] = {
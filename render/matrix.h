@@ -3,7 +3,8 @@
 
 class Point {
     public:
-        // Constructor
+        // Constructors
+        Point();
         Point(double x, double y, double z);
 
         // Return a clone of this point.
@@ -28,11 +29,17 @@ class Plane {
         // that the plane is constructed via points in a CCW fashion.
         bool isPointAbove(Point *point);
 
+        // Return the signed distance from a point to the plane, which is positive when above.
+        double distance(Point *point);
+
         // Return the intersection point on the plane for a line passsing through the
         // plane. Note that this only works when isPointAbove returns different values
         // for the start and end of the line.
         Point *intersection(Point *start, Point *end);
 
+        // Identical to the above, but writes the intersection into an existing point instead.
+        void intersection(Point *start, Point *end, Point *out);
+
     private:
         Point p1;
         Point p2;
@@ -71,10 +78,12 @@ class Matrix {
 
         // Multiply a point to translate/rotate/scale that point in 3D space.
         Point *multiplyPoint(Point *point);
+        void multiplyPoint(Point *point, Point *out);
         void multiplyUpdatePoint(Point *point);
 
         // Project a point from 3D to 2D space, preserving linearity and 1/W in Z.
         Point *projectPoint(Point *point);
+        void projectPoint(Point *point, Point *out);
         void projectUpdatePoint(Point *point);
 
         // Multiply an array of points, updating the points in-place.
@@ -83,6 +92,10 @@ class Matrix {
         // Project an array of points, updating the points in-place.
         void projectPoints(Point *points[], int length);
 
+        // Find the point that this perspective projection projects from, which is the only point
+        // with no X, Y or W. Returns false if there isn't one, such as for an orthographic projection.
+        bool getCenterOfProjection(Point *center);
+
         // Translate this matrix by an X/Y/Z value represented by a point.
         Matrix *translate(Point *point);
         Matrix *translate(double x, double y, double z);
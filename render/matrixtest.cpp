@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <cmath>
 #include "matrix.h"
 
 #define ASSERT(cond, error) if(!(cond)) { printf("%s:%d - %s (%s)\n", __FILE__, __LINE__, #cond, error); }
@@ -124,6 +125,30 @@ void plane_test() {
     }
 }
 
+void projection_test() {
+    // A perspective projection should project from exactly one point.
+    {
+        Matrix projection(128, 64, 60.0, 1.0, 1000.0);
+        Point center;
+        ASSERT(projection.getCenterOfProjection(&center), "Projection has no center?");
+
+        // Everything else along a line through the center should land on the same spot.
+        Point near(center.x + 0.5, center.y - 0.25, center.z + 2.0);
+        Point far(center.x + 1.0, center.y - 0.5, center.z + 4.0);
+        projection.projectUpdatePoint(&near);
+        projection.projectUpdatePoint(&far);
+        ASSERT(fabs(near.x - far.x) < 0.000001, "Projected points don't line up!");
+        ASSERT(fabs(near.y - far.y) < 0.000001, "Projected points don't line up!");
+    }
+
+    // An affine transformation doesn't project from anywhere.
+    {
+        Matrix identity;
+        Point center;
+        ASSERT(!identity.getCenterOfProjection(&center), "Identity has a center of projection?");
+    }
+}
+
 int main(int argc, char *argv[]) {
     printf("Running matrix tests...\n");
 
@@ -131,6 +156,7 @@ int main(int argc, char *argv[]) {
     multiply_point_test();
     translate_test();
     plane_test();
+    projection_test();
 
     printf("Done!\n");
 
@@ -0,0 +1,176 @@
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "meshcache.h"
+#include "model.h"
+
+MeshCache::MeshCache(const char * const filename) {
+    data = 0;
+    size = 0;
+    valid = false;
+    models = 0;
+    length = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) { return; }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MeshCacheHeader)) {
+        close(fd);
+        return;
+    }
+
+    // The mapping stays around after the file is closed.
+    size = st.st_size;
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        data = 0;
+        return;
+    }
+
+    MeshCacheHeader *header = (MeshCacheHeader *)data;
+    if (memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(header->magic)) != 0) { return; }
+    if (header->version != MESH_CACHE_VERSION) { return; }
+    if (
+        header->pointSize != sizeof(Point) ||
+        header->edgeSize != sizeof(Edge) ||
+        header->edgeFaceSize != sizeof(EdgeFace) ||
+        header->bvhNodeSize != sizeof(BVHNode)
+    ) {
+        return;
+    }
+    // Every level of detail takes at least a section header, so anything claiming more than fit is corrupt.
+    if (header->modelCount < 1 || header->modelCount > (size - sizeof(MeshCacheHeader)) / sizeof(MeshCacheModel)) { return; }
+
+    // Walk each level of detail, making sure that everything it points at is actually in the file.
+    models = (MeshCacheModel **)malloc(sizeof(models[0]) * header->modelCount);
+    if (models == NULL) { return; }
+    size_t offset = sizeof(MeshCacheHeader);
+
+    for (uint32_t i = 0; i < header->modelCount; i++) {
+        if (offset + sizeof(MeshCacheModel) > size) { return; }
+
+        MeshCacheModel *model = (MeshCacheModel *)(((char *)data) + offset);
+        if (!_checkModel(model, size - offset)) { return; }
+
+        models[length++] = model;
+        offset += model->size;
+    }
+
+    valid = true;
+}
+
+MeshCache::~MeshCache() {
+    if (data) {
+        munmap(data, size);
+    }
+
+    free(models);
+    data = 0;
+    models = 0;
+}
+
+bool MeshCache::_checkModel(MeshCacheModel *model, size_t available) {
+    if (model->size < sizeof(MeshCacheModel) || model->size > available) { return false; }
+    if (model->vertexLength < 0 || model->modelLength < 0 || model->cornerLength < 0) { return false; }
+    if (model->edgeLength < 0 || model->edgeFaceLength < 0 || model->bvhLength < 1) { return false; }
+
+    bool arrays = (
+        _checkArray(model, model->vertices, model->vertexLength, sizeof(Point)) &&
+        _checkArray(model, model->normals, model->modelLength, sizeof(Point)) &&
+        _checkArray(model, model->cornerOffsets, model->modelLength + 1, sizeof(int32_t)) &&
+        _checkArray(model, model->indices, model->cornerLength, sizeof(int32_t)) &&
+        _checkArray(model, model->highlights, model->cornerLength, sizeof(uint8_t)) &&
+        _checkArray(model, model->cornerEdges, model->cornerLength, sizeof(int32_t)) &&
+        _checkArray(model, model->edges, model->edgeLength, sizeof(Edge)) &&
+        _checkArray(model, model->edgeFaces, model->edgeFaceLength, sizeof(EdgeFace)) &&
+        _checkArray(model, model->bvh, model->bvhLength, sizeof(BVHNode)) &&
+        _checkArray(model, model->bvhPolygons, model->modelLength, sizeof(int32_t))
+    );
+
+    return arrays && _checkContents(model);
+}
+
+bool MeshCache::_checkContents(MeshCacheModel *model) {
+    // Everything in the arrays gets used as an index into another one without any further checks, so a
+    // single bad value anywhere would otherwise only turn up once the model is drawn.
+    int32_t *offsets = getArray<int32_t>(model, model->cornerOffsets);
+    int32_t *indices = getArray<int32_t>(model, model->indices);
+    int32_t *cornerEdges = getArray<int32_t>(model, model->cornerEdges);
+    Edge *edges = getArray<Edge>(model, model->edges);
+    EdgeFace *edgeFaces = getArray<EdgeFace>(model, model->edgeFaces);
+    BVHNode *bvh = getArray<BVHNode>(model, model->bvh);
+    int32_t *bvhPolygons = getArray<int32_t>(model, model->bvhPolygons);
+
+    // Polygons have at least three corners, and they run back to back through the corner arrays.
+    if (offsets[0] != 0 || offsets[model->modelLength] != model->cornerLength) { return false; }
+    for (int i = 0; i < model->modelLength; i++) {
+        if (offsets[i + 1] - offsets[i] < 3 || offsets[i + 1] > model->cornerLength) { return false; }
+    }
+
+    for (int i = 0; i < model->cornerLength; i++) {
+        if (indices[i] < 0 || indices[i] >= model->vertexLength) { return false; }
+        if (cornerEdges[i] < 0 || cornerEdges[i] >= model->edgeLength) { return false; }
+    }
+
+    for (int i = 0; i < model->edgeLength; i++) {
+        Edge *edge = &edges[i];
+        if (edge->first < 0 || edge->first >= model->vertexLength) { return false; }
+        if (edge->second < 0 || edge->second >= model->vertexLength) { return false; }
+        if (edge->start < 0 || edge->length < 0 || edge->length > model->edgeFaceLength - edge->start) { return false; }
+    }
+
+    for (int i = 0; i < model->edgeFaceLength; i++) {
+        EdgeFace *edgeFace = &edgeFaces[i];
+        if (edgeFace->polygon < 0 || edgeFace->polygon >= model->modelLength) { return false; }
+
+        int polyLength = offsets[edgeFace->polygon + 1] - offsets[edgeFace->polygon];
+        if (edgeFace->corner < 0 || edgeFace->corner >= polyLength) { return false; }
+    }
+
+    // Children always come after their parent, which also rules out any loops, and leaves have neither.
+    for (int i = 0; i < model->bvhLength; i++) {
+        BVHNode *node = &bvh[i];
+        if (node->start < 0 || node->start > node->end || node->end > model->modelLength) { return false; }
+
+        if (node->left < 0 || node->right < 0) {
+            if (node->left != -1 || node->right != -1) { return false; }
+        } else if (node->left <= i || node->right <= i || node->left >= model->bvhLength || node->right >= model->bvhLength) {
+            return false;
+        }
+    }
+
+    // The BVH is an ordering of every polygon, so each one has to be in there exactly once.
+    std::vector<bool> seen(model->modelLength, false);
+    for (int i = 0; i < model->modelLength; i++) {
+        if (bvhPolygons[i] < 0 || bvhPolygons[i] >= model->modelLength || seen[bvhPolygons[i]]) { return false; }
+        seen[bvhPolygons[i]] = true;
+    }
+
+    return true;
+}
+
+bool MeshCache::_checkArray(MeshCacheModel *model, uint64_t offset, int length, size_t size) {
+    if (offset % MESH_CACHE_ALIGN != 0) { return false; }
+    if (offset < sizeof(MeshCacheModel) || offset > model->size) { return false; }
+
+    return (uint64_t)length * size <= model->size - offset;
+}
+
+bool MeshCache::isValid() {
+    return valid;
+}
+
+int MeshCache::getLength() {
+    return length;
+}
+
+MeshCacheModel *MeshCache::getModel(int index) {
+    return models[index];
+}
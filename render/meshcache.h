@@ -0,0 +1,98 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+
+// A preprocessed model, laid out so that it can be mapped straight into memory and loaded without
+// any parsing, welding, coalescing or simplifying. A cache starts with a MeshCacheHeader, followed by
+// one MeshCacheModel section per level of detail, most detailed first. Every array in a section is
+// aligned to MESH_CACHE_ALIGN bytes from the start of the file.
+//
+// Loading one isn't free, since a model still copies the arrays out into memory of its own and creates a
+// polygon for every face to hold its per-frame state. That is a single pass of plain copies, though, where
+// loading anything else means parsing text, welding corners, building edges and the BVH, and simplifying
+// every level of detail, which is where nearly all of the time spent loading a big model goes. Every
+// index is checked when the cache is opened, so a corrupted cache is rejected instead of crashing later.
+#define MESH_CACHE_MAGIC "SGNMESH"
+#define MESH_CACHE_VERSION 1
+#define MESH_CACHE_ALIGN 8
+
+class MeshCacheHeader {
+    public:
+        char magic[8];
+        uint32_t version;
+
+        // The size of each record that is stored exactly as it sits in memory, so that a cache written
+        // by a build which lays them out differently is rejected instead of misread.
+        uint32_t pointSize;
+        uint32_t edgeSize;
+        uint32_t edgeFaceSize;
+        uint32_t bvhNodeSize;
+
+        uint32_t modelCount;
+};
+
+// One level of detail. Each array is given as an offset in bytes from the start of this section, and
+// the section itself is size bytes long, with the next one starting straight after it.
+class MeshCacheModel {
+    public:
+        uint64_t size;
+
+        int32_t vertexLength;
+        int32_t modelLength;
+        int32_t cornerLength;
+        int32_t edgeLength;
+        int32_t edgeFaceLength;
+        int32_t bvhLength;
+
+        // Point[vertexLength] and Point[modelLength].
+        uint64_t vertices;
+        uint64_t normals;
+
+        // int32_t[modelLength + 1], where each polygon's corners start, plus the total at the end.
+        uint64_t cornerOffsets;
+
+        // int32_t[cornerLength], uint8_t[cornerLength] and int32_t[cornerLength], for each polygon corner.
+        uint64_t indices;
+        uint64_t highlights;
+        uint64_t cornerEdges;
+
+        // Edge[edgeLength], EdgeFace[edgeFaceLength], BVHNode[bvhLength] and int32_t[modelLength].
+        uint64_t edges;
+        uint64_t edgeFaces;
+        uint64_t bvh;
+        uint64_t bvhPolygons;
+};
+
+class MeshCache {
+    public:
+        // Map the given file into memory, checking that it is a mesh cache that this build can read. Anything
+        // else (including a file that doesn't exist) leaves us invalid, and the file can be loaded some other way.
+        MeshCache(const char * const filename);
+        ~MeshCache();
+
+        // Whether the file is a mesh cache we can load.
+        bool isValid();
+
+        // Return how many levels of detail there are, and each one in order. Pointers are valid for as
+        // long as we are.
+        int getLength();
+        MeshCacheModel *getModel(int index);
+
+        // Return an array out of a level of detail given its offset.
+        template <class T> T *getArray(MeshCacheModel *model, uint64_t offset) { return (T *)(((char *)model) + offset); }
+
+    private:
+        bool _checkModel(MeshCacheModel *model, size_t available);
+        bool _checkArray(MeshCacheModel *model, uint64_t offset, int length, size_t size);
+        bool _checkContents(MeshCacheModel *model);
+
+        void *data;
+        size_t size;
+        bool valid;
+        MeshCacheModel **models;
+        int length;
+};
+
+#endif
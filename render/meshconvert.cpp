@@ -0,0 +1,34 @@
+#include <cstdio>
+#include <cstdlib>
+#include "model.h"
+
+int main (int argc, char *argv[]) {
+    if (argc < 3 || argc > 5) {
+        printf("Usage: %s <model> <model.mesh> [coalesce degrees] [weld distance]\n", argv[0]);
+        printf("Preprocesses a model into a mesh cache that Model can load directly.\n");
+        printf("STL corners closer than the weld distance are merged into one vertex.\n");
+        return 1;
+    }
+
+    // The kind of polygon doesn't matter here, only the geometry gets saved.
+    double weldDistance = argc == 5 ? atof(argv[4]) : DEFAULT_WELD_DISTANCE;
+    Model *model = new Model(argv[1], FLAGS_WIREFRAME, weldDistance);
+    if (argc >= 4) {
+        model->coalesce(atof(argv[3]));
+    } else {
+        model->coalesce();
+    }
+
+    if (!model->save(argv[2])) {
+        printf("Failed to write %s!\n", argv[2]);
+        delete model;
+        return 1;
+    }
+
+    if (model->getWeldRatio() > 0.0) {
+        printf("Welded %.1f%% of the triangle corners into shared vertices.\n", model->getWeldRatio() * 100.0);
+    }
+    printf("Wrote %s with %d level(s) of detail.\n", argv[2], model->getLODLength());
+    delete model;
+    return 0;
+}
@@ -0,0 +1,363 @@
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "meshfile.h"
+
+// The types a PLY property can have, in the order of plyTypeNames.
+#define PLY_TYPE_INVALID -1
+#define PLY_TYPE_INT8 0
+#define PLY_TYPE_UINT8 1
+#define PLY_TYPE_INT16 2
+#define PLY_TYPE_UINT16 3
+#define PLY_TYPE_INT32 4
+#define PLY_TYPE_UINT32 5
+#define PLY_TYPE_FLOAT32 6
+#define PLY_TYPE_FLOAT64 7
+
+static const char *plyTypeNames[] = {"char", "uchar", "short", "ushort", "int", "uint", "float", "double"};
+static const char *plyTypeAliases[] = {"int8", "uint8", "int16", "uint16", "int32", "uint32", "float32", "float64"};
+static const int plyTypeSizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+
+class PLYProperty {
+    public:
+        std::string name;
+        int type;
+
+        // For lists, the type of the count in front of the values, otherwise PLY_TYPE_INVALID.
+        int countType;
+};
+
+class PLYElement {
+    public:
+        std::string name;
+        long count;
+        std::vector<PLYProperty> properties;
+};
+
+MeshFile::MeshFile(const char * const filename) {
+    valid = false;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) { return; }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    size_t size = st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { return; }
+
+    // We only ever read forwards, so let the kernel read ahead of us.
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    const char *start = (const char *)data;
+    const char *end = start + size;
+    size_t nameLength = strlen(filename);
+
+    if (size >= 4 && memcmp(start, "ply", 3) == 0 && (start[3] == '\n' || start[3] == '\r')) {
+        valid = _loadPLY(start, end);
+    } else if (nameLength >= 4 && strcasecmp(filename + nameLength - 4, ".obj") == 0) {
+        valid = _loadOBJ(start, end);
+    }
+
+    munmap(data, size);
+
+    // Make sure nobody points outside of the vertices we have.
+    for (size_t i = 0; valid && i < indices.size(); i++) {
+        if (indices[i] < 0 || indices[i] >= (int)vertices.size()) {
+            valid = false;
+        }
+    }
+
+    if (!valid) {
+        vertices.clear();
+        offsets.clear();
+        indices.clear();
+    }
+}
+
+bool MeshFile::isValid() {
+    return valid;
+}
+
+int MeshFile::getVertexLength() {
+    return vertices.size();
+}
+
+Point *MeshFile::getVertices() {
+    return vertices.data();
+}
+
+int MeshFile::getLength() {
+    return offsets.empty() ? 0 : offsets.size() - 1;
+}
+
+int *MeshFile::getOffsets() {
+    return offsets.data();
+}
+
+int *MeshFile::getIndices() {
+    return indices.data();
+}
+
+bool MeshFile::_addPolygon(int start) {
+    if (offsets.empty()) {
+        offsets.push_back(0);
+    }
+
+    if ((int)indices.size() - start < 3) {
+        // Points and lines don't make a polygon, so leave them out.
+        indices.resize(start);
+        return false;
+    }
+
+    offsets.push_back(indices.size());
+    return true;
+}
+
+static const char *_skipSpaces(const char *cur, const char *end) {
+    while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == '\r')) {
+        cur++;
+    }
+
+    return cur;
+}
+
+static const char *_skipWord(const char *cur, const char *end) {
+    while (cur < end && *cur != ' ' && *cur != '\t' && *cur != '\r' && *cur != '\n') {
+        cur++;
+    }
+
+    return cur;
+}
+
+static const char *_nextLine(const char *cur, const char *end) {
+    const char *newline = (const char *)memchr(cur, '\n', end - cur);
+    return newline == NULL ? end : newline + 1;
+}
+
+static const char *_parseDouble(const char *cur, const char *end, double *value) {
+    // Unlike strtod, from_chars doesn't need the text to be terminated (our mapping isn't), but it
+    // also doesn't understand a leading plus.
+    if (cur < end && *cur == '+') { cur++; }
+
+    std::from_chars_result result = std::from_chars(cur, end, *value);
+    return result.ec == std::errc() ? result.ptr : NULL;
+}
+
+bool MeshFile::_loadOBJ(const char *data, const char *end) {
+    const char *cur = data;
+
+    while (cur < end) {
+        cur = _skipSpaces(cur, end);
+        const char *word = _skipWord(cur, end);
+
+        if (word - cur == 1 && *cur == 'v') {
+            // A vertex, with an optional w we don't care about.
+            double coords[3];
+            cur = word;
+
+            for (int i = 0; i < 3; i++) {
+                cur = _parseDouble(_skipSpaces(cur, end), end, &coords[i]);
+                if (cur == NULL) { return false; }
+            }
+
+            vertices.push_back(Point(coords[0], coords[1], coords[2]));
+        } else if (word - cur == 1 && *cur == 'f') {
+            // A face, whose corners look like v, v/vt, v//vn or v/vt/vn, and only v matters to us.
+            int start = indices.size();
+            cur = _skipSpaces(word, end);
+
+            while (cur < end && *cur != '\n' && *cur != '#') {
+                int index;
+                std::from_chars_result result = std::from_chars(cur, end, index);
+                if (result.ec != std::errc() || index == 0) { return false; }
+
+                // Negative indexes count back from the most recent vertex.
+                indices.push_back(index > 0 ? index - 1 : (int)vertices.size() + index);
+                cur = _skipSpaces(_skipWord(result.ptr, end), end);
+            }
+
+            _addPolygon(start);
+        }
+
+        // Everything else (normals, texture coordinates, groups, materials) means nothing to us.
+        cur = _nextLine(cur, end);
+    }
+
+    return true;
+}
+
+static int _getPLYType(const std::string &name) {
+    for (int i = 0; i < (int)(sizeof(plyTypeSizes) / sizeof(plyTypeSizes[0])); i++) {
+        if (name == plyTypeNames[i] || name == plyTypeAliases[i]) {
+            return i;
+        }
+    }
+
+    return PLY_TYPE_INVALID;
+}
+
+static bool _readPLYValue(const char **cur, const char *end, int type, bool swap, double *value) {
+    int size = plyTypeSizes[type];
+    if (end - *cur < size) { return false; }
+
+    // Copy out so that unaligned and opposite endian values are both safe to read.
+    unsigned char bytes[8];
+    for (int i = 0; i < size; i++) {
+        bytes[i] = (*cur)[swap ? (size - 1 - i) : i];
+    }
+    *cur += size;
+
+    switch (type) {
+        case PLY_TYPE_INT8: { int8_t v; memcpy(&v, bytes, 1); *value = v; break; }
+        case PLY_TYPE_UINT8: { uint8_t v; memcpy(&v, bytes, 1); *value = v; break; }
+        case PLY_TYPE_INT16: { int16_t v; memcpy(&v, bytes, 2); *value = v; break; }
+        case PLY_TYPE_UINT16: { uint16_t v; memcpy(&v, bytes, 2); *value = v; break; }
+        case PLY_TYPE_INT32: { int32_t v; memcpy(&v, bytes, 4); *value = v; break; }
+        case PLY_TYPE_UINT32: { uint32_t v; memcpy(&v, bytes, 4); *value = v; break; }
+        case PLY_TYPE_FLOAT32: { float v; memcpy(&v, bytes, 4); *value = v; break; }
+        case PLY_TYPE_FLOAT64: { double v; memcpy(&v, bytes, 8); *value = v; break; }
+    }
+
+    return true;
+}
+
+bool MeshFile::_loadPLY(const char *data, const char *end) {
+    // The header is plain text, one short line at a time, and tells us how to read the binary after it.
+    std::vector<PLYElement> elements;
+    bool bigEndian = false;
+    bool formatKnown = false;
+    const char *cur = _nextLine(data, end);
+
+    for (;;) {
+        if (cur >= end) { return false; }
+
+        const char *lineEnd = (const char *)memchr(cur, '\n', end - cur);
+        if (lineEnd == NULL) { return false; }
+
+        // Split the line into words.
+        std::vector<std::string> words;
+        const char *word = _skipSpaces(cur, lineEnd);
+        while (word < lineEnd) {
+            const char *wordEnd = _skipWord(word, lineEnd);
+            words.push_back(std::string(word, wordEnd - word));
+            word = _skipSpaces(wordEnd, lineEnd);
+        }
+        cur = lineEnd + 1;
+
+        if (words.empty() || words[0] == "comment" || words[0] == "obj_info") { continue; }
+        if (words[0] == "end_header") { break; }
+
+        if (words[0] == "format" && words.size() >= 2) {
+            // Plain text PLY files are rare enough for our parts that we leave them alone.
+            if (words[1] == "binary_little_endian") {
+                bigEndian = false;
+            } else if (words[1] == "binary_big_endian") {
+                bigEndian = true;
+            } else {
+                return false;
+            }
+            formatKnown = true;
+        } else if (words[0] == "element" && words.size() >= 3) {
+            PLYElement element;
+            element.name = words[1];
+            element.count = strtol(words[2].c_str(), NULL, 10);
+            if (element.count < 0) { return false; }
+            elements.push_back(element);
+        } else if (words[0] == "property" && !elements.empty()) {
+            PLYProperty property;
+            if (words.size() >= 5 && words[1] == "list") {
+                property.countType = _getPLYType(words[2]);
+                property.type = _getPLYType(words[3]);
+                property.name = words[4];
+                if (property.countType == PLY_TYPE_INVALID) { return false; }
+            } else if (words.size() >= 3) {
+                property.countType = PLY_TYPE_INVALID;
+                property.type = _getPLYType(words[1]);
+                property.name = words[2];
+            } else {
+                return false;
+            }
+
+            if (property.type == PLY_TYPE_INVALID) { return false; }
+            elements.back().properties.push_back(property);
+        } else {
+            return false;
+        }
+    }
+
+    if (!formatKnown) { return false; }
+
+    const uint16_t probe = 1;
+    bool swap = bigEndian == (*(const uint8_t *)&probe == 1);
+
+    // Now read every element in order, keeping only vertex positions and face corners.
+    for (size_t e = 0; e < elements.size(); e++) {
+        PLYElement *element = &elements[e];
+        bool isVertex = element->name == "vertex";
+        bool isFace = element->name == "face";
+
+        // Every record takes at least a byte, so anything claiming more of them than we have left is lying,
+        // and would otherwise have us spin through records that take up nothing at all.
+        if (element->count > end - cur) { return false; }
+
+        if (isVertex) {
+            vertices.reserve(element->count);
+        }
+
+        for (long i = 0; i < element->count; i++) {
+            double coords[3] = {0.0, 0.0, 0.0};
+            int start = indices.size();
+
+            for (size_t p = 0; p < element->properties.size(); p++) {
+                PLYProperty *property = &element->properties[p];
+                double value;
+
+                if (property->countType == PLY_TYPE_INVALID) {
+                    if (!_readPLYValue(&cur, end, property->type, swap, &value)) { return false; }
+
+                    if (isVertex && property->name.size() == 1 && property->name[0] >= 'x' && property->name[0] <= 'z') {
+                        coords[property->name[0] - 'x'] = value;
+                    }
+                    continue;
+                }
+
+                double count;
+                if (!_readPLYValue(&cur, end, property->countType, swap, &count)) { return false; }
+                if (!std::isfinite(count) || count < 0 || count > end - cur) { return false; }
+
+                bool isCorners = isFace && (property->name == "vertex_indices" || property->name == "vertex_index");
+                for (long j = 0; j < (long)count; j++) {
+                    if (!_readPLYValue(&cur, end, property->type, swap, &value)) { return false; }
+                    if (isCorners) {
+                        // Indexes can come in as any type at all, so only whole numbers that fit are indexes.
+                        if (!std::isfinite(value) || value < 0 || value >= INT_MAX || value != std::floor(value)) { return false; }
+                        indices.push_back((int)value);
+                    }
+                }
+            }
+
+            if (isVertex) {
+                vertices.push_back(Point(coords[0], coords[1], coords[2]));
+            } else if (isFace) {
+                _addPolygon(start);
+            }
+        }
+    }
+
+    return true;
+}
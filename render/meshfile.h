@@ -0,0 +1,41 @@
+#ifndef MESHFILE_H
+#define MESHFILE_H
+
+#include <cstddef>
+#include <vector>
+#include "matrix.h"
+
+// A polygon mesh read out of a Wavefront OBJ or binary PLY file. Unlike STL, both of these can hold
+// quads and larger polygons, which are kept intact instead of being split into triangles. The file is
+// mapped into memory and parsed in place, so nothing is allocated per line or per record.
+class MeshFile {
+    public:
+        // Load the given file, if it is a PLY file (going by its contents) or an OBJ file (going by its
+        // name, since they don't have any header to go by). Anything else leaves us invalid.
+        MeshFile(const char * const filename);
+
+        // Whether the file was one we understand and loaded without problems.
+        bool isValid();
+
+        // The vertices of the mesh, shared between polygons.
+        int getVertexLength();
+        Point *getVertices();
+
+        // The polygons of the mesh, where polygon i has the corners given by indices[offsets[i]] up to
+        // but not including indices[offsets[i + 1]].
+        int getLength();
+        int *getOffsets();
+        int *getIndices();
+
+    private:
+        bool _loadOBJ(const char *data, const char *end);
+        bool _loadPLY(const char *data, const char *end);
+        bool _addPolygon(int start);
+
+        std::vector<Point> vertices;
+        std::vector<int> offsets;
+        std::vector<int> indices;
+        bool valid;
+};
+
+#endif
@@ -0,0 +1,315 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "meshcache.h"
+#include "meshfile.h"
+#include "model.h"
+
+#define ASSERT(cond, error) if(!(cond)) { printf("%s:%d - %s (%s)\n", __FILE__, __LINE__, #cond, error); }
+
+// Where caches written by the tests go, so that nothing next to the real models gets touched.
+#define TEST_CACHE_PATH "/tmp/sign-meshtest.mesh"
+#define TEST_CACHE_COPY_PATH "/tmp/sign-meshtest-copy.mesh"
+#define TEST_PLY_PATH "/tmp/sign-meshtest.ply"
+#define TEST_STL_PATH "/tmp/sign-meshtest.stl"
+
+// The torus fixtures are the same 8 by 6 ring of quads.
+#define TORUS_VERTICES 48
+#define TORUS_POLYGONS 48
+
+static bool read_file(const char *filename, std::vector<char> *data) {
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) { return false; }
+
+    char buffer[65536];
+    size_t length;
+    data->clear();
+    while ((length = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data->insert(data->end(), buffer, buffer + length);
+    }
+
+    fclose(fp);
+    return true;
+}
+
+static bool write_file(const char *filename, const std::vector<char> &data, size_t length) {
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) { return false; }
+
+    bool ok = length == 0 || fwrite(&data[0], length, 1, fp) == 1;
+    return (fclose(fp) == 0) && ok;
+}
+
+// Whether a copy of the given cache with one 32 bit value replaced still opens, with offset counted from the
+// start of the first level of detail.
+static bool opens_with(const std::vector<char> &cache, uint64_t offset, int32_t value) {
+    std::vector<char> copy = cache;
+    memcpy(&copy[sizeof(MeshCacheHeader) + offset], &value, sizeof(value));
+    write_file(TEST_CACHE_COPY_PATH, copy, copy.size());
+
+    MeshCache opened(TEST_CACHE_COPY_PATH);
+    return opened.isValid();
+}
+
+void cache_round_trip_test() {
+    Model *model = new Model("testmodel.stl", FLAGS_WIREFRAME);
+    model->coalesce();
+    ASSERT(model->save(TEST_CACHE_PATH), "Couldn't write a mesh cache!")
+
+    MeshCache cache(TEST_CACHE_PATH);
+    ASSERT(cache.isValid(), "Mesh cache we just wrote isn't valid!")
+    ASSERT(cache.getLength() == model->getLODLength(), "Mesh cache doesn't have every level of detail!")
+
+    // A model loaded from the cache should save back out to exactly the same thing.
+    Model *cached = new Model(TEST_CACHE_PATH, FLAGS_WIREFRAME);
+    ASSERT(cached->getLODLength() == model->getLODLength(), "Cached model lost levels of detail!")
+    ASSERT(cached->save(TEST_CACHE_COPY_PATH), "Couldn't write a cached model back out!")
+
+    std::vector<char> original;
+    std::vector<char> copy;
+    ASSERT(read_file(TEST_CACHE_PATH, &original) && read_file(TEST_CACHE_COPY_PATH, &copy), "Couldn't read the caches back!")
+    ASSERT(original == copy, "Mesh cache doesn't survive a round trip!")
+
+    delete cached;
+    delete model;
+    unlink(TEST_CACHE_PATH);
+    unlink(TEST_CACHE_COPY_PATH);
+}
+
+void cache_corrupt_test() {
+    Model *model = new Model("testmodel.stl", FLAGS_WIREFRAME);
+    ASSERT(model->save(TEST_CACHE_PATH), "Couldn't write a mesh cache!")
+    delete model;
+
+    std::vector<char> cache;
+    ASSERT(read_file(TEST_CACHE_PATH, &cache), "Couldn't read the cache back!")
+    if (cache.size() < sizeof(MeshCacheHeader) + sizeof(MeshCacheModel)) { return; }
+
+    // Anything cut short is missing arrays, or even the header.
+    size_t lengths[] = {0, sizeof(MeshCacheHeader) - 1, sizeof(MeshCacheHeader) + sizeof(MeshCacheModel), cache.size() / 2, cache.size() - 1};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        write_file(TEST_CACHE_COPY_PATH, cache, lengths[i]);
+        MeshCache truncated(TEST_CACHE_COPY_PATH);
+        ASSERT(!truncated.isValid(), "Truncated mesh cache was accepted!")
+    }
+
+    // A header claiming more levels of detail than could possibly fit must not be believed.
+    std::vector<char> copy = cache;
+    ((MeshCacheHeader *)&copy[0])->modelCount = 0xFFFFFFFF;
+    write_file(TEST_CACHE_COPY_PATH, copy, copy.size());
+    MeshCache counted(TEST_CACHE_COPY_PATH);
+    ASSERT(!counted.isValid(), "Mesh cache with an impossible model count was accepted!")
+
+    // A single bad index anywhere is enough to be rejected.
+    MeshCacheModel section;
+    memcpy(&section, &cache[sizeof(MeshCacheHeader)], sizeof(section));
+    ASSERT(opens_with(cache, section.indices, 0), "Mesh cache is rejected for a good index!")
+    ASSERT(!opens_with(cache, section.indices, 50000000), "Mesh cache with a bad vertex index was accepted!")
+    ASSERT(!opens_with(cache, section.cornerOffsets + sizeof(int32_t), -1), "Mesh cache with bad corner offsets was accepted!")
+    ASSERT(!opens_with(cache, section.cornerEdges, section.edgeLength), "Mesh cache with a bad corner edge was accepted!")
+    ASSERT(!opens_with(cache, section.edges, -1), "Mesh cache with a bad edge was accepted!")
+    ASSERT(!opens_with(cache, section.edgeFaces, section.modelLength), "Mesh cache with a bad edge face was accepted!")
+    ASSERT(!opens_with(cache, section.bvh + sizeof(Bounds), 0), "Mesh cache with a BVH loop was accepted!")
+    ASSERT(!opens_with(cache, section.bvhPolygons, -1), "Mesh cache with a bad BVH polygon was accepted!")
+
+    // Nor is anything that isn't a cache at all.
+    MeshCache missing("/nonexistent/model.mesh");
+    ASSERT(!missing.isValid(), "Missing mesh cache was accepted!")
+    MeshCache stl("testmodel.stl");
+    ASSERT(!stl.isValid(), "STL file was taken for a mesh cache!")
+
+    unlink(TEST_CACHE_PATH);
+    unlink(TEST_CACHE_COPY_PATH);
+}
+
+void polygon_normals_test() {
+    // One triangle facing each way along Z, which is all we have to go on since polygons don't come with normals.
+    Point a(0.0, 0.0, 0.0);
+    Point b(1.0, 0.0, 0.0);
+    Point c(0.0, 1.0, 0.0);
+    Point d(0.0, -1.0, 0.0);
+    Polygon *triangles[2] = {new Polygon(&a, &b, &c), new Polygon(&a, &b, &d)};
+    Model *model = new Model(triangles, 2);
+    delete triangles[0];
+    delete triangles[1];
+
+    // The cache holds exactly the normals we worked out.
+    ASSERT(model->save(TEST_CACHE_PATH), "Couldn't write a mesh cache!")
+    delete model;
+
+    MeshCache cache(TEST_CACHE_PATH);
+    ASSERT(cache.isValid(), "Mesh cache we just wrote isn't valid!")
+    if (!cache.isValid()) { return; }
+
+    MeshCacheModel *section = cache.getModel(0);
+    Point *normals = cache.getArray<Point>(section, section->normals);
+    ASSERT(section->modelLength == 2, "Model lost some polygons!")
+    ASSERT(normals[0].x == 0.0 && normals[0].y == 0.0 && normals[0].z == 1.0, "Normal of a polygon facing +Z is wrong!")
+    ASSERT(normals[1].x == 0.0 && normals[1].y == 0.0 && normals[1].z == -1.0, "Normal of a polygon facing -Z is wrong!")
+
+    unlink(TEST_CACHE_PATH);
+}
+
+// Write a little endian PLY file with the given header lines after the format, followed by body.
+static bool write_ply(const char *header, const void *body, size_t length) {
+    std::string text = std::string("ply\nformat binary_little_endian 1.0\n") + header + "end_header\n";
+    std::vector<char> data(text.begin(), text.end());
+    data.insert(data.end(), (const char *)body, (const char *)body + length);
+    return write_file(TEST_PLY_PATH, data, data.size());
+}
+
+static void torus_test(const char *filename) {
+    MeshFile mesh(filename);
+    ASSERT(mesh.isValid(), "Torus fixture didn't load!")
+    if (!mesh.isValid()) { return; }
+
+    ASSERT(mesh.getVertexLength() == TORUS_VERTICES, "Torus has the wrong number of vertices!")
+    ASSERT(mesh.getLength() == TORUS_POLYGONS, "Torus has the wrong number of polygons!")
+
+    bool quads = true;
+    for (int i = 0; i < mesh.getLength(); i++) {
+        quads = quads && mesh.getOffsets()[i + 1] - mesh.getOffsets()[i] == 4;
+    }
+    ASSERT(quads, "Torus quads weren't kept whole!")
+
+    // The first quad goes around to the next ring, then to the next vertex around the tube.
+    int expected[4] = {0, 6, 7, 1};
+    ASSERT(memcmp(mesh.getIndices(), expected, sizeof(expected)) == 0, "Torus corners aren't where they should be!")
+
+    // Models keep them whole too, which shows up in what they save.
+    Model *model = new Model(filename, FLAGS_WIREFRAME);
+    ASSERT(model->save(TEST_CACHE_PATH), "Couldn't write the torus out as a mesh cache!")
+    delete model;
+
+    MeshCache cache(TEST_CACHE_PATH);
+    ASSERT(cache.isValid() && cache.getModel(0)->modelLength == TORUS_POLYGONS, "Torus model doesn't have its quads!")
+    ASSERT(cache.isValid() && cache.getModel(0)->cornerLength == TORUS_POLYGONS * 4, "Torus model doesn't have its quads!")
+    unlink(TEST_CACHE_PATH);
+}
+
+void mesh_file_test() {
+    torus_test("testtorus.obj");
+    torus_test("testtorus.ply");
+
+    // Those are the same torus, so they should have ended up with the same vertices.
+    MeshFile obj("testtorus.obj");
+    MeshFile ply("testtorus.ply");
+    bool same = obj.getVertexLength() == ply.getVertexLength();
+    for (int i = 0; same && i < obj.getVertexLength(); i++) {
+        Point *a = &obj.getVertices()[i];
+        Point *b = &ply.getVertices()[i];
+        same = fabs(a->x - b->x) < 0.0001 && fabs(a->y - b->y) < 0.0001 && fabs(a->z - b->z) < 0.0001;
+    }
+    ASSERT(same, "OBJ and PLY tori don't match!")
+}
+
+void mesh_file_malformed_test() {
+    const char *vertices = "element vertex 3\nproperty uchar x\nproperty uchar y\nproperty uchar z\n";
+    uint8_t corners[9] = {0, 0, 0, 1, 0, 0, 0, 1, 0};
+
+    // A triangle as it should be, so that it's clear what each case below breaks.
+    struct { uint8_t corners[9]; uint8_t count; uint32_t indices[3]; } __attribute__((packed)) face;
+    memcpy(face.corners, corners, sizeof(corners));
+    face.count = 3;
+    face.indices[0] = 0;
+    face.indices[1] = 1;
+    face.indices[2] = 2;
+    std::string header = std::string(vertices) + "element face 1\nproperty list uchar uint vertex_indices\n";
+    write_ply(header.c_str(), &face, sizeof(face));
+    MeshFile good(TEST_PLY_PATH);
+    ASSERT(good.isValid() && good.getLength() == 1, "Good PLY triangle didn't load!")
+
+    // Indexes that don't fit in an int.
+    face.indices[2] = 0x80000000;
+    write_ply(header.c_str(), &face, sizeof(face));
+    MeshFile big(TEST_PLY_PATH);
+    ASSERT(!big.isValid(), "PLY index too big for an int was accepted!")
+
+    // Indexes that aren't numbers at all.
+    struct { uint8_t corners[9]; uint8_t count; float indices[3]; } __attribute__((packed)) floatFace;
+    memcpy(floatFace.corners, corners, sizeof(corners));
+    floatFace.count = 3;
+    floatFace.indices[0] = 0.0f;
+    floatFace.indices[1] = 1.0f;
+    floatFace.indices[2] = NAN;
+    std::string floatHeader = std::string(vertices) + "element face 1\nproperty list uchar float vertex_indices\n";
+    write_ply(floatHeader.c_str(), &floatFace, sizeof(floatFace));
+    MeshFile nan(TEST_PLY_PATH);
+    ASSERT(!nan.isValid(), "PLY index that isn't a number was accepted!")
+
+    floatFace.indices[2] = INFINITY;
+    write_ply(floatHeader.c_str(), &floatFace, sizeof(floatFace));
+    MeshFile inf(TEST_PLY_PATH);
+    ASSERT(!inf.isValid(), "Infinite PLY index was accepted!")
+
+    // Lists and elements longer than the whole file, which would otherwise take forever when their records
+    // take up nothing at all.
+    struct { uint8_t corners[9]; uint32_t count; } __attribute__((packed)) longFace;
+    memcpy(longFace.corners, corners, sizeof(corners));
+    longFace.count = 0xFFFFFFFF;
+    std::string longHeader = std::string(vertices) + "element face 1\nproperty list uint uint vertex_indices\n";
+    write_ply(longHeader.c_str(), &longFace, sizeof(longFace));
+    MeshFile longList(TEST_PLY_PATH);
+    ASSERT(!longList.isValid(), "PLY list longer than the file was accepted!")
+
+    write_ply("element nothing 9223372036854775000\n", NULL, 0);
+    MeshFile empty(TEST_PLY_PATH);
+    ASSERT(!empty.isValid(), "PLY element with more records than the file has room for was accepted!")
+
+    unlink(TEST_PLY_PATH);
+}
+
+// How many vertices the first level of detail of a model has, going by the cache it saves.
+static int saved_vertices(Model *model) {
+    if (!model->save(TEST_CACHE_PATH)) { return -1; }
+
+    MeshCache cache(TEST_CACHE_PATH);
+    int length = cache.isValid() ? cache.getModel(0)->vertexLength : -1;
+    unlink(TEST_CACHE_PATH);
+    return length;
+}
+
+void assembly_test() {
+    AssemblyModel *torus = new AssemblyModel("testtorus.obj", FLAGS_WIREFRAME);
+    ASSERT(torus->getLength() == 1, "OBJ file didn't load as a single part!")
+    ASSERT(saved_vertices(torus->getPart(0)) == TORUS_VERTICES, "OBJ part doesn't have the whole torus!")
+    delete torus;
+
+    // Two solids, each a pair of triangles whose shared corners are written slightly differently.
+    FILE *fp = fopen(TEST_STL_PATH, "w");
+    ASSERT(fp != NULL, "Couldn't write a test STL!")
+    if (fp == NULL) { return; }
+    for (int solid = 0; solid < 2; solid++) {
+        fprintf(fp, "solid part%d\n", solid);
+        fprintf(fp, "facet normal 0 0 1\nouter loop\nvertex %d 0 0\nvertex %d.5 0 0\nvertex %d 1 0\nendloop\nendfacet\n", solid * 2, solid * 2, solid * 2);
+        fprintf(fp, "facet normal 0 0 1\nouter loop\nvertex %d.5001 0 0\nvertex %d.5 1 0\nvertex %d.0001 1 0\nendloop\nendfacet\n", solid * 2, solid * 2, solid * 2);
+        fprintf(fp, "endsolid part%d\n", solid);
+    }
+    fclose(fp);
+
+    AssemblyModel *apart = new AssemblyModel(TEST_STL_PATH, FLAGS_WIREFRAME);
+    AssemblyModel *welded = new AssemblyModel(TEST_STL_PATH, FLAGS_WIREFRAME, 0.01);
+    ASSERT(apart->getLength() == 2 && welded->getLength() == 2, "STL solids didn't load as parts of their own!")
+    ASSERT(saved_vertices(apart->getPart(1)) == 6, "STL part was welded without being asked to!")
+    ASSERT(saved_vertices(welded->getPart(1)) == 4, "STL part wasn't welded!")
+    delete apart;
+    delete welded;
+
+    unlink(TEST_STL_PATH);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Running mesh tests...\n");
+
+    cache_round_trip_test();
+    cache_corrupt_test();
+    polygon_normals_test();
+    mesh_file_test();
+    mesh_file_malformed_test();
+    assembly_test();
+
+    printf("Done!\n");
+}
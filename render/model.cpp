@@ -1,89 +1,142 @@
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include "model.h"
 #include "matrix.h"
+#include "meshcache.h"
+#include "meshfile.h"
+#include "simplify.h"
+#include "threadpool.h"
 #include "common.h"
 
+// How big each block of per-frame scratch memory for clipping should be.
+#define MODEL_SCRATCH_SIZE 16384
+
+// How many polygons a leaf of the bounding volume hierarchy should hold at most.
+#define MODEL_BVH_LEAF_SIZE 32
+
+// How many vertices or polygons a loop needs before it is worth splitting across threads, and how
+// many each thread takes at a time.
+#define MODEL_PARALLEL_THRESHOLD 8192
+#define MODEL_PARALLEL_CHUNK 1024
+
+// Adds the time between its construction and destruction onto a running total in seconds, so that
+// every way out of a stage gets counted.
+class StageTimer {
+    public:
+        StageTimer(double *total) {
+            this->total = total;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+
+        ~StageTimer() {
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            *total += (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1000000000.0);
+        }
+
+    private:
+        double *total;
+        struct timespec start;
+};
+
 #define STL_READER_NO_EXCEPTIONS  1
 #include "stl_reader.h"
 
 Polygon::Polygon(Point *x, Point *y, Point *z) {
-    // Set up initial polygon.
-    polyLength = 3;
-    polyPoints = (Point **)malloc(sizeof(polyPoints[0]) * 3);
+    // Set up our own private vertex buffer, since we aren't part of a model.
+    ownsVertices = true;
+    vertices = new Point[3];
+    transVertices = new Point[3];
 
-    polyPoints[0] = x->clone();
-    polyPoints[1] = y->clone();
-    polyPoints[2] = z->clone();
+    vertices[0] = *x;
+    vertices[1] = *y;
+    vertices[2] = *z;
 
-    // Set up transformed polygon copy.
-    transPolyLength = 3;
-    transPoints = (Point **)malloc(sizeof(transPoints[0]) * 3);
+    int triIndices[3] = {0, 1, 2};
+    _setup(triIndices, 3);
+}
 
-    transPoints[0] = x->clone();
-    transPoints[1] = y->clone();
-    transPoints[2] = z->clone();
+Polygon::Polygon(Point *points[], int length) {
+    // Set up our own private vertex buffer, since we aren't part of a model.
+    ownsVertices = true;
+    vertices = new Point[length];
+    transVertices = new Point[length];
 
-    // Set up whether we are highlighting this polygon's edge or not.
-    highlights = (bool *)malloc(sizeof(bool) * 3);
-    highlights[0] = true;
-    highlights[1] = true;
-    highlights[2] = true;
-
-    // Set up the transformed (and culled) highlights.
-    transHighlights = (bool *)malloc(sizeof(bool) * 3);
-    transHighlights[0] = true;
-    transHighlights[1] = true;
-    transHighlights[2] = true;
-
-    // We aren't completely culled.
-    culled = false;
+    int *polyIndices = (int *)malloc(sizeof(int) * length);
+    for (int i = 0; i < length; i++) {
+        vertices[i] = *points[i];
+        polyIndices[i] = i;
+    }
+
+    _setup(polyIndices, length);
+    free(polyIndices);
 }
 
-Polygon::Polygon(Point *points[], int length) {
+Polygon::Polygon(int indices[], int length, Point *vertices, Point *transVertices) {
+    // Borrow the vertex buffer we were given.
+    ownsVertices = false;
+    this->vertices = vertices;
+    this->transVertices = transVertices;
+
+    _setup(indices, length);
+}
+
+void Polygon::_setup(int indices[], int length) {
     polyLength = length;
-    transPolyLength = length;
 
-    polyPoints = (Point **)malloc(sizeof(polyPoints[0]) * length);
-    transPoints = (Point **)malloc(sizeof(transPoints[0]) * length);
+    this->indices = (int *)malloc(sizeof(int) * length);
+    basePoints = (Point **)malloc(sizeof(basePoints[0]) * length);
 
-    // Safe to do this in one loop because polyLength == transPolyLength here.
     for (int i = 0; i < length; i++) {
-        polyPoints[i] = points[i]->clone();
-        transPoints[i] = points[i]->clone();
+        this->indices[i] = indices[i];
+        basePoints[i] = &transVertices[indices[i]];
     }
 
-    // Also set up highlights.
+    // Make sure our own transformed copy starts out untransformed.
+    if (ownsVertices) {
+        for (int i = 0; i < length; i++) {
+            transVertices[i] = vertices[i];
+        }
+    }
+
+    // Set up whether we are highlighting this polygon's edge or not.
     highlights = (bool *)malloc(sizeof(bool) * length);
-    transHighlights = (bool *)malloc(sizeof(bool) * length);
 
     for (int i = 0; i < length; i++) {
         highlights[i] = true;
-        transHighlights[i] = true;
     }
 
-    // We aren't completely culled.
+    // Set up the transformed (and culled) outline, which starts out as our base outline.
+    transPoints = basePoints;
+    transHighlights = highlights;
+    transPolyLength = length;
+
+    // We aren't clipped or completely culled.
+    clipped = false;
     culled = false;
 }
 
 Polygon::~Polygon() {
-    for (int i = 0; i < polyLength; i++) {
-        delete polyPoints[i];
-    }
-    for (int i = 0; i < transPolyLength; i++) {
-        delete transPoints[i];
+    if (ownsVertices) {
+        delete[] vertices;
+        delete[] transVertices;
     }
 
-    free(polyPoints);
-    free(transPoints);
+    free(indices);
+    free(basePoints);
     free(highlights);
-    free(transHighlights);
-    polyPoints = 0;
-    transPoints = 0;
+    vertices = 0;
+    transVertices = 0;
+    indices = 0;
+    basePoints = 0;
     highlights = 0;
+    transPoints = 0;
     transHighlights = 0;
 
     polyLength = 0;
@@ -91,14 +144,32 @@ Polygon::~Polygon() {
 }
 
 void Polygon::transform(Matrix *matrix) {
-    for (int i = 0; i < transPolyLength; i++) {
-        matrix->multiplyUpdatePoint(transPoints[i]);
+    if (ownsVertices) {
+        for (int i = 0; i < polyLength; i++) {
+            matrix->multiplyUpdatePoint(&transVertices[i]);
+        }
+    }
+
+    // A clipped outline is entirely made up of our own copies of points.
+    if (clipped) {
+        for (int i = 0; i < transPolyLength; i++) {
+            matrix->multiplyUpdatePoint(transPoints[i]);
+        }
     }
 }
 
 void Polygon::project(Matrix *matrix) {
-    for (int i = 0; i < transPolyLength; i++) {
-        matrix->projectUpdatePoint(transPoints[i]);
+    if (ownsVertices) {
+        for (int i = 0; i < polyLength; i++) {
+            matrix->projectUpdatePoint(&transVertices[i]);
+        }
+    }
+
+    // A clipped outline is entirely made up of our own copies of points.
+    if (clipped) {
+        for (int i = 0; i < transPolyLength; i++) {
+            matrix->projectUpdatePoint(transPoints[i]);
+        }
     }
 }
 
@@ -107,40 +178,51 @@ Polygon *Polygon::clone() {
     Polygon *newPoly = new Polygon(transPoints, transPolyLength);
     for (int i = 0; i < transPolyLength; i++) {
         newPoly->highlights[i] = transHighlights[i];
-        newPoly->transHighlights[i] = transHighlights[i];
     }
 
     return newPoly;
 }
 
-void Polygon::reset() {
-    // Kill old transformed polygon entirely, it could be frustum culled and have more points than
-    // our original.
+Polygon *Polygon::cloneShared(int indices[], Point *vertices, Point *transVertices) {
+    // Same as above, but our transformed points now live in somebody else's buffer.
+    Polygon *newPoly = new Polygon(indices, transPolyLength, vertices, transVertices);
     for (int i = 0; i < transPolyLength; i++) {
-        delete transPoints[i];
+        newPoly->highlights[i] = transHighlights[i];
     }
-    free(transPoints);
-    free(transHighlights);
 
-    transPolyLength = polyLength;
-    transPoints = (Point **)malloc(sizeof(transPoints[0]) * polyLength);
-    transHighlights = (bool *)malloc(sizeof(bool) * polyLength);
+    return newPoly;
+}
 
-    for (int i = 0; i < polyLength; i++) {
-        transPoints[i] = polyPoints[i]->clone();
-        transHighlights[i] = highlights[i];
+void Polygon::reset() {
+    // Our own vertices need resetting, shared vertices are reset by the model that owns them.
+    if (ownsVertices) {
+        for (int i = 0; i < polyLength; i++) {
+            transVertices[i] = vertices[i];
+        }
     }
 
-    // We aren't culled.
+    // Any clipped outline belonged to a scratch arena, so simply point back at our base outline.
+    transPoints = basePoints;
+    transHighlights = highlights;
+    transPolyLength = polyLength;
+
+    // We aren't clipped or culled.
+    clipped = false;
     culled = false;
 }
 
-void Polygon::cull(Frustum *frustum) {
+void Polygon::cull(Frustum *frustum, ScratchArena *scratch, unsigned int planeMask) {
     // Number of planes we are inside. Should equal the number of planes in the frustum
     // if we are entirely inside the frustum.
     int insidePlaneCount = 0;
 
     for (int j = 0; j < frustum->length; j++) {
+        if (!(planeMask & (1 << j))) {
+            // We already know we're inside this plane.
+            insidePlaneCount ++;
+            continue;
+        }
+
         // Count how many edges are inside this particular plane. Should equal the count
         // of points if we're entirely inside this plane.
         int insidePointCount = 0;
@@ -171,84 +253,74 @@ void Polygon::cull(Frustum *frustum) {
     // The polygon is at least partially visible.
     culled = false;
 
-    // We need to spin around the polygon and introduce extra polygons at intersection points.
-    // We also need to do it for each plane as a unit operation so that we can clip polygons
-    // for each plane.
-    for (int j = 0; j < frustum->length; j++) {
-        bool inside = frustum->planes[j]->isPointAbove(transPoints[0]);
-        int start = 0;
+    // Take a copy of our outline, since from here on out we will be projecting our own points
+    // instead of the shared ones.
+    int length = transPolyLength;
+    Point **points = scratch->allocArray<Point *>(length);
+    bool *draws = scratch->allocArray<bool>(length);
+    Point *copies = scratch->allocArray<Point>(length);
 
-        // We need to track which bits of the polygon are in/out of this particular cull operation,
-        // otherwise its possible for us to over-cull edges when we intersect two planes at once.
-        bool *inOrOut = (bool *)malloc(sizeof(bool) * (transPolyLength));
+    for (int i = 0; i < length; i++) {
+        copies[i] = *transPoints[i];
+        points[i] = &copies[i];
+        draws[i] = transHighlights[i];
+    }
 
-        while (start < transPolyLength) {
-            // The end node we're looking at can wrap around.
-            int end = (start + 1) % transPolyLength;
+    // Now clip against each plane in turn, Sutherland-Hodgman style. Each edge can emit at most
+    // two points, so that bounds the size of the output for each plane. The drawn/not drawn flag
+    // for an edge is attached to its starting point, and any edge that we introduce running along
+    // the clipping plane itself is never drawn.
+    for (int j = 0; j < frustum->length; j++) {
+        if (!(planeMask & (1 << j))) { continue; }
 
-            bool newInside = frustum->planes[j]->isPointAbove(transPoints[end]);
-            bool curCulled = transHighlights[start];
+        Plane *plane = frustum->planes[j];
+        Point **outPoints = scratch->allocArray<Point *>(length * 2);
+        bool *outDraws = scratch->allocArray<bool>(length * 2);
+        int outLength = 0;
 
-            if (newInside == inside) {
-                // Simply mark this line for inclusion or exclusion, continuing the trend.
-                transHighlights[start] = curCulled & newInside;
-                inOrOut[start] = newInside;
+        bool inside = plane->isPointAbove(points[0]);
 
-                // We didn't intersect, simply move on.
-                start++;
-                continue;
+        for (int start = 0; start < length; start++) {
+            // The end node we're looking at can wrap around.
+            int end = (start + 1) % length;
+            bool newInside = plane->isPointAbove(points[end]);
+
+            if (inside) {
+                // The start point survives, as does at least the start of the edge out of it.
+                outPoints[outLength] = points[start];
+                outDraws[outLength] = draws[start];
+                outLength++;
             }
 
-            // We intersected this plane with this line. Introduce a new point at the intersection.
-            Point *intersection = frustum->planes[j]->intersection(transPoints[start], transPoints[end]);
-
-            // Insert that point.
-            transPoints = (Point **)realloc(transPoints, sizeof(transPoints[0]) * (transPolyLength + 1));
-            transHighlights = (bool *)realloc(transHighlights, sizeof(transHighlights[0]) * (transPolyLength + 1));
-            inOrOut = (bool *)realloc(inOrOut, sizeof(inOrOut[0]) * (transPolyLength + 1));
-            if (end != 0) {
-                // Move the rest of the points to make room.
-                memmove(&transPoints[end + 1], &transPoints[end], sizeof(transPoints[0]) * (transPolyLength - end));
-                memmove(&transHighlights[end + 1], &transHighlights[end], sizeof(transHighlights[0]) * (transPolyLength - end));
-                memmove(&inOrOut[end + 1], &inOrOut[end], sizeof(inOrOut[0]) * (transPolyLength - end));
-            }
-            transPoints[start + 1] = intersection;
-            transPolyLength++;
+            if (inside != newInside) {
+                // We intersected this plane with this line. Introduce a new point at the intersection,
+                // whose outgoing edge continues the original edge only if we're heading back inside.
+                Point *intersection = scratch->allocArray<Point>(1);
+                plane->intersection(points[start], points[end], intersection);
 
-            // Mark the points themselves.
-            transHighlights[start] = curCulled & inside;
-            transHighlights[start + 1] = curCulled & newInside;
-            inOrOut[start] = inside;
-            inOrOut[start + 1] = newInside;
+                outPoints[outLength] = intersection;
+                outDraws[outLength] = draws[start] & newInside;
+                outLength++;
+            }
 
-            // Continue on.
             inside = newInside;
-            start += 2;
         }
 
-        // Get rid of runs of invisible edges by collapsing down.
-        int edge = 0;
-        while (edge < transPolyLength) {
-            int next = (edge + 1) % transPolyLength;
-
-            if (!inOrOut[edge] && !inOrOut[next]) {
-                // We can get rid of the next node entirely, since we aren't going to draw it.
-                delete transPoints[next];
-
-                if ((transPolyLength - (next + 1)) > 0) {
-                    memmove(&transPoints[next], &transPoints[next + 1], sizeof(transPoints[0]) * (transPolyLength - (next + 1)));
-                    memmove(&transHighlights[next], &transHighlights[next + 1], sizeof(transHighlights[0]) * (transPolyLength - (next + 1)));
-                    memmove(&inOrOut[next], &inOrOut[next + 1], sizeof(inOrOut[0]) * (transPolyLength - (next + 1)));
-                }
-
-                transPolyLength --;
-            } else {
-                edge ++;
-            }
+        if (outLength == 0) {
+            // Clipping against previous planes left nothing inside this one.
+            culled = true;
+            return;
         }
 
-        free(inOrOut);
+        points = outPoints;
+        draws = outDraws;
+        length = outLength;
     }
+
+    transPoints = points;
+    transHighlights = draws;
+    transPolyLength = length;
+    clipped = true;
 }
 
 void Polygon::draw(Screen *screen) {
@@ -263,17 +335,41 @@ void Polygon::draw(Screen *screen) {
     }
 }
 
+bool Polygon::_isDirty() {
+    return culled || clipped || transHighlights != highlights;
+}
+
+bool Polygon::isBackFaceCulled() {
+    // Wireframes show their back edges too.
+    return false;
+}
+
+int Polygon::getDrawMode() {
+    return DRAW_MODE_WIREFRAME;
+}
+
 OccludedWireframePolygon::OccludedWireframePolygon(Point *x, Point *y, Point *z) : Polygon(x, y, z) {}
 
 OccludedWireframePolygon::OccludedWireframePolygon(Point *points[], int length) : Polygon(points, length) {}
 
+OccludedWireframePolygon::OccludedWireframePolygon(int indices[], int length, Point *vertices, Point *transVertices) :
+    Polygon(indices, length, vertices, transVertices) {}
+
 Polygon *OccludedWireframePolygon::clone() {
     // Make sure if we clone a polygon that's been transformed, the new is also. Also make sure
     // to copy culled edge information.
     OccludedWireframePolygon *newPoly = new OccludedWireframePolygon(transPoints, transPolyLength);
     for (int i = 0; i < transPolyLength; i++) {
         newPoly->highlights[i] = transHighlights[i];
-        newPoly->transHighlights[i] = transHighlights[i];
+    }
+
+    return newPoly;
+}
+
+Polygon *OccludedWireframePolygon::cloneShared(int indices[], Point *vertices, Point *transVertices) {
+    OccludedWireframePolygon *newPoly = new OccludedWireframePolygon(indices, transPolyLength, vertices, transVertices);
+    for (int i = 0; i < transPolyLength; i++) {
+        newPoly->highlights[i] = transHighlights[i];
     }
 
     return newPoly;
@@ -285,201 +381,1540 @@ void OccludedWireframePolygon::draw(Screen *screen) {
     }
 }
 
+bool OccludedWireframePolygon::isBackFaceCulled() {
+    return true;
+}
+
+int OccludedWireframePolygon::getDrawMode() {
+    return DRAW_MODE_OCCLUDED;
+}
+
+static void _calculateNormal(Point *vertices, int *indices, int length, Point *normal) {
+    // Newell's method, which copes with any planar polygon and gives the normal that points
+    // towards a viewer seeing the points in counter-clockwise order.
+    double nx = 0.0;
+    double ny = 0.0;
+    double nz = 0.0;
+
+    for (int i = 0; i < length; i++) {
+        Point *cur = &vertices[indices[i]];
+        Point *next = &vertices[indices[(i + 1) % length]];
+
+        nx += (cur->y - next->y) * (cur->z + next->z);
+        ny += (cur->z - next->z) * (cur->x + next->x);
+        nz += (cur->x - next->x) * (cur->y + next->y);
+    }
+
+    double normalLength = sqrt((nx * nx) + (ny * ny) + (nz * nz));
+    if (normalLength > 0.0) {
+        *normal = Point(nx / normalLength, ny / normalLength, nz / normalLength);
+    } else {
+        *normal = Point(0.0, 0.0, 0.0);
+    }
+}
+
 Model::Model(Polygon *polygons[], int length) {
+    // Weld every identical point across all of the polygons together, so that we only store
+    // (and later transform) each unique vertex once.
+    std::map<Point, int> vertexMap;
+    std::vector<Point> uniqueVertices;
+    std::vector<int> polyIndices;
+
+    for (int i = 0; i < length; i++) {
+        for (int j = 0; j < polygons[i]->transPolyLength; j++) {
+            Point *point = polygons[i]->transPoints[j];
+            auto vIt = vertexMap.find(*point);
+
+            if (vIt == vertexMap.end()) {
+                vertexMap[*point] = uniqueVertices.size();
+                polyIndices.push_back(uniqueVertices.size());
+                uniqueVertices.push_back(*point);
+            } else {
+                polyIndices.push_back(vIt->second);
+            }
+        }
+    }
+
+    vertexLength = uniqueVertices.size();
+    vertices = new Point[vertexLength];
+    transVertices = new Point[vertexLength];
+    for (int i = 0; i < vertexLength; i++) {
+        vertices[i] = uniqueVertices[i];
+    }
+
     modelLength = length;
     this->polygons = (Polygon **)malloc(sizeof(this->polygons[0]) * length);
+
+    int offset = 0;
     for (int i = 0; i < length; i++) {
-        this->polygons[i] = polygons[i]->clone();
+        this->polygons[i] = polygons[i]->cloneShared(&polyIndices[offset], vertices, transVertices);
+        offset += polygons[i]->transPolyLength;
+    }
+
+    // We don't have any normals to go on, so work them out from the polygons themselves.
+    normals = new Point[modelLength];
+    for (int i = 0; i < modelLength; i++) {
+        _calculateNormal(vertices, this->polygons[i]->indices, this->polygons[i]->polyLength, &normals[i]);
+    }
+
+    _setup();
+}
+
+Model::Model(const char * const modelFile, int flags) : Model(modelFile, flags, DEFAULT_WELD_DISTANCE) {}
+
+Model::Model(const char * const modelFile, int flags, double weldDistance) {
+    // Preprocessed models can skip straight to the end.
+    MeshCache cache(modelFile);
+    if (cache.isValid()) {
+        _loadCacheLevels(&cache, flags);
+        return;
+    }
+
+    // Formats that can hold more than triangles get to keep their polygons whole.
+    MeshFile meshFile(modelFile);
+    if (meshFile.isValid()) {
+        _loadMesh(&meshFile, flags);
+        return;
     }
+
+    // Anything else had better be an STL. The STL reader has already welded corners together
+    // for us, so we can use its vertex buffer directly.
+    stl_reader::StlMesh <float, unsigned int> mesh(modelFile, weldDistance);
+    _loadTriangles(mesh.raw_coords(), mesh.num_vrts(), mesh.raw_tris(), mesh.raw_normals(), mesh.num_tris(), flags);
+    weldRatio = mesh.weld_stats().ratio();
 }
 
-Model::Model(const char * const modelFile, int flags) {
-    // TODO: Here would be a good place to figure out if it is a STL file or otherwise.
-    stl_reader::StlMesh <float, unsigned int> mesh(modelFile);
+Model::Model(const float *coords, int vertexLength, const unsigned int *tris, const float *triNormals, int length, int flags) {
+    _loadTriangles(coords, vertexLength, tris, triNormals, length, flags);
+}
 
-    modelLength = mesh.num_tris();
-    polygons = (Polygon **)malloc(sizeof(this->polygons[0]) * modelLength);
+void Model::_loadTriangles(const float *coords, int vertexLength, const unsigned int *tris, const float *triNormals, int length, int flags) {
+    this->vertexLength = vertexLength;
+    vertices = new Point[vertexLength];
+    transVertices = new Point[vertexLength];
 
-    for(size_t itri = 0; itri < modelLength; ++itri) {
-        // Grab each corner, create a point out of it.
-        Point *triPoints[3];
+    for (int ivrt = 0; ivrt < vertexLength; ivrt++) {
+        const float* c = &coords[ivrt * 3];
+        vertices[ivrt] = Point(c[0], c[1], c[2]);
+    }
 
-        for(size_t icorner = 0; icorner < 3; ++icorner) {
-            const float* c = mesh.tri_corner_coords(itri, icorner);
-            triPoints[icorner] = new Point(c[0], c[1], c[2]);
-        }
+    // Grab the index of each corner in the vertex buffer.
+    std::vector<int> triIndices(length * 3);
+    for (int i = 0; i < length * 3; i++) {
+        triIndices[i] = tris[i];
+    }
 
-        // Grab the normal so we can keep a mapping of it.
-        const float* n = mesh.tri_normal(itri);
-        Point normalPoint(n[0], n[1], n[2]);
-        if (normalMap.count(normalPoint) == 0) {
-            normalMap[normalPoint] = PolyOffset();
-        }
-        normalMap[normalPoint].push_back(itri);
+    _setupTriangles(triIndices.empty() ? NULL : &triIndices[0], length, flags);
 
-        if (flags & FLAGS_OCCLUDED) {
-            polygons[itri] = new OccludedWireframePolygon(triPoints, 3);
+    for(size_t itri = 0; itri < modelLength; ++itri) {
+        // Grab the normal, falling back to working it out ourselves since plenty of
+        // exporters don't bother writing them.
+        const float* n = &triNormals[itri * 3];
+        double length = sqrt((n[0] * n[0]) + (n[1] * n[1]) + (n[2] * n[2]));
+        if (length > 0.0) {
+            normals[itri] = Point(n[0] / length, n[1] / length, n[2] / length);
         } else {
-            polygons[itri] = new Polygon(triPoints, 3);
+            _calculateNormal(vertices, polygons[itri]->indices, 3, &normals[itri]);
         }
-
-        delete triPoints[0];
-        delete triPoints[1];
-        delete triPoints[2];
     }
+
+    _setup();
+    silhouette = (flags & FLAGS_SILHOUETTE) != 0;
+    _buildLODs(triIndices.empty() ? NULL : &triIndices[0], modelLength, flags);
 }
 
-void Model::coalesce() {
-    // Now go through each group of normals and figure out if any line segments on
-    // any two polygons are equal. If so, turn the highlight off on both polygons.
-    NormalMap::iterator it;
-    for (it = normalMap.begin(); it != normalMap.end(); it++)
-    {
-        // Now, make a candidate list to go through.
-        PolyOffset candidates;
-        for (auto pIt = it->second.begin(); pIt != it->second.end(); pIt++)
-        {
-            candidates.push_back(*pIt);
-        }
-
-        // We want to compare each element to the rest of the list of elements.
-        // However, we can optimize by not comparing backwards, so if we visualize
-        // the comparison it is a triangle instead of a quad. This is still O(N^2)
-        // but it halves the comparisons.
-        while (!candidates.empty()) {
-            int currentCandidate = candidates[candidates.size() - 1];
-            candidates.pop_back();
-
-            if (!candidates.empty()) {
-                for (auto pCan = candidates.begin(); pCan != candidates.end(); pCan++) {
-                    Polygon *srcPoly = polygons[currentCandidate];
-                    Polygon *dstPoly = polygons[*pCan];
-
-                    for (int srcStart = 0; srcStart < srcPoly->polyLength; srcStart++) {
-                        int srcEnd = (srcStart + 1) % srcPoly->polyLength;
-
-                        for (int dstStart = 0; dstStart < dstPoly->polyLength; dstStart++) {
-                            int dstEnd = (dstStart + 1) % dstPoly->polyLength;
-
-                            if (!srcPoly->highlights[srcStart] && !dstPoly->highlights[dstStart]) { continue; }
-
-                            if ((
-                                (*srcPoly->polyPoints[srcStart] == *dstPoly->polyPoints[dstStart]) &&
-                                (*srcPoly->polyPoints[srcEnd] == *dstPoly->polyPoints[dstEnd])
-                            ) || (
-                                (*srcPoly->polyPoints[srcStart] == *dstPoly->polyPoints[dstEnd]) &&
-                                (*srcPoly->polyPoints[srcEnd] == *dstPoly->polyPoints[dstStart])
-                            )) {
-                                srcPoly->highlights[srcStart] = false;
-                                dstPoly->highlights[dstStart] = false;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+void Model::_loadMesh(MeshFile *mesh, int flags) {
+    vertexLength = mesh->getVertexLength();
+    vertices = new Point[vertexLength];
+    transVertices = new Point[vertexLength];
+
+    for (int i = 0; i < vertexLength; i++) {
+        vertices[i] = mesh->getVertices()[i];
+    }
+
+    _setupPolygons(mesh->getIndices(), mesh->getOffsets(), mesh->getLength(), flags);
+
+    // Neither format has facet normals to go on, but the polygons are all we need.
+    for (int i = 0; i < modelLength; i++) {
+        _calculateNormal(vertices, polygons[i]->indices, polygons[i]->polyLength, &normals[i]);
+    }
+
+    _setup();
+    silhouette = (flags & FLAGS_SILHOUETTE) != 0;
 
+    // Simplifying only works on triangles, so split everything up into fans for that.
+    std::vector<int> triIndices;
+    for (int i = 0; i < modelLength; i++) {
+        Polygon *polygon = polygons[i];
+        for (int j = 1; j < polygon->polyLength - 1; j++) {
+            triIndices.push_back(polygon->indices[0]);
+            triIndices.push_back(polygon->indices[j]);
+            triIndices.push_back(polygon->indices[j + 1]);
+        }
     }
+
+    _buildLODs(triIndices.empty() ? NULL : &triIndices[0], triIndices.size() / 3, flags);
 }
 
-Model::~Model() {
+Model::Model(Point *vertices, int vertexLength, int *indices, int length, int flags) {
+    this->vertexLength = vertexLength;
+    this->vertices = new Point[vertexLength];
+    transVertices = new Point[vertexLength];
+
+    for (int i = 0; i < vertexLength; i++) {
+        this->vertices[i] = vertices[i];
+    }
+
+    _setupTriangles(indices, length, flags);
+
     for (int i = 0; i < modelLength; i++) {
-        delete polygons[i];
+        _calculateNormal(vertices, polygons[i]->indices, 3, &normals[i]);
     }
 
-    free(polygons);
-    polygons = 0;
-    modelLength = 0;
+    _setup();
+    silhouette = (flags & FLAGS_SILHOUETTE) != 0;
 }
 
-Model *Model::clone() {
-    Model *newModel = new Model(polygons, modelLength);
+Model::Model(MeshCache *cache, MeshCacheModel *model, int flags) {
+    _loadCache(cache, model, flags);
+}
 
-    NormalMap::iterator it;
-    for (it = normalMap.begin(); it != normalMap.end(); it++)
-    {
-        newModel->normalMap[it->first] = PolyOffset();
-        for (auto pIt = it->second.begin(); pIt != it->second.end(); pIt++)
-        {
-            newModel->normalMap[it->first].push_back(*pIt);
-        }
+Model::Model(MeshCache *cache, int flags) {
+    _loadCacheLevels(cache, flags);
+}
+
+Model::Model(MeshFile *mesh, int flags) {
+    _loadMesh(mesh, flags);
+}
+
+void Model::_loadCacheLevels(MeshCache *cache, int flags) {
+    _loadCache(cache, cache->getModel(0), flags);
+    for (int i = 1; i < cache->getLength(); i++) {
+        lods.push_back(new Model(cache, cache->getModel(i), flags));
     }
 
-    return newModel;
+    setLODTriangleSize(DEFAULT_LOD_TRIANGLE_SIZE);
 }
 
-void Model::reset() {
+void Model::_loadCache(MeshCache *cache, MeshCacheModel *model, int flags) {
+    vertexLength = model->vertexLength;
+    vertices = new Point[vertexLength];
+    transVertices = new Point[vertexLength];
+    memcpy(vertices, cache->getArray<Point>(model, model->vertices), sizeof(vertices[0]) * vertexLength);
+
+    // Polygons carry our per-frame state, so they're the one thing that can't come straight out of the cache.
+    int32_t *offsets = cache->getArray<int32_t>(model, model->cornerOffsets);
+    int32_t *indices = cache->getArray<int32_t>(model, model->indices);
+    uint8_t *highlights = cache->getArray<uint8_t>(model, model->highlights);
+    _setupPolygons(indices, offsets, model->modelLength, flags);
+
+    memcpy(normals, cache->getArray<Point>(model, model->normals), sizeof(normals[0]) * modelLength);
     for (int i = 0; i < modelLength; i++) {
-        polygons[i]->reset();
+        for (int j = 0; j < polygons[i]->polyLength; j++) {
+            polygons[i]->highlights[j] = highlights[offsets[i] + j] != 0;
+        }
     }
+
+    // Everything else we would have worked out is already done.
+    _setupFrame();
+
+    Edge *cachedEdges = cache->getArray<Edge>(model, model->edges);
+    EdgeFace *cachedEdgeFaces = cache->getArray<EdgeFace>(model, model->edgeFaces);
+    int32_t *cachedCornerEdges = cache->getArray<int32_t>(model, model->cornerEdges);
+    BVHNode *cachedBVH = cache->getArray<BVHNode>(model, model->bvh);
+
+    edges.assign(cachedEdges, cachedEdges + model->edgeLength);
+    edgeFaces.assign(cachedEdgeFaces, cachedEdgeFaces + model->edgeFaceLength);
+    cornerEdges.assign(cachedCornerEdges, cachedCornerEdges + model->cornerLength);
+    cornerOffsets.assign(offsets, offsets + modelLength + 1);
+    bvh.assign(cachedBVH, cachedBVH + model->bvhLength);
+
+    bvhPolygons = (int *)malloc(sizeof(bvhPolygons[0]) * MAX(modelLength, 1));
+    memcpy(bvhPolygons, cache->getArray<int32_t>(model, model->bvhPolygons), sizeof(bvhPolygons[0]) * modelLength);
+
+    // Which edges get drawn depends on what kind of polygons we were asked for.
+    _buildWireframe();
+    silhouette = (flags & FLAGS_SILHOUETTE) != 0;
 }
 
-void Model::transform(Matrix *matrix) {
-    for (int i = 0; i < modelLength; i++) {
-        polygons[i]->transform(matrix);
+bool Model::save(const char * const cacheFile) {
+    FILE *fp = fopen(cacheFile, "wb");
+    if (fp == NULL) { return false; }
+
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.pointSize = sizeof(Point);
+    header.edgeSize = sizeof(Edge);
+    header.edgeFaceSize = sizeof(EdgeFace);
+    header.bvhNodeSize = sizeof(BVHNode);
+    header.modelCount = lods.size() + 1;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && _saveCache(fp);
+    for (size_t i = 0; i < lods.size(); i++) {
+        ok = ok && lods[i]->_saveCache(fp);
+    }
+
+    return (fclose(fp) == 0) && ok;
+}
+
+// Add an array to a mesh cache section being built up in memory, returning where it starts.
+static uint64_t _addCacheArray(std::vector<char> *section, const void *data, size_t size) {
+    size_t offset = (section->size() + (MESH_CACHE_ALIGN - 1)) & ~(size_t)(MESH_CACHE_ALIGN - 1);
+    section->resize(offset + size);
+    if (size > 0) {
+        memcpy(&(*section)[offset], data, size);
     }
+
+    return offset;
 }
 
-void Model::project(Matrix *matrix) {
+bool Model::_saveCache(FILE *fp) {
+    // Gather each polygon's corners and highlights back to back. These line up with cornerOffsets.
+    std::vector<int32_t> indices;
+    std::vector<uint8_t> highlights;
     for (int i = 0; i < modelLength; i++) {
-        polygons[i]->project(matrix);
+        for (int j = 0; j < polygons[i]->polyLength; j++) {
+            indices.push_back(polygons[i]->indices[j]);
+            highlights.push_back(polygons[i]->highlights[j] ? 1 : 0);
+        }
     }
+
+    MeshCacheModel model;
+    memset(&model, 0, sizeof(model));
+    model.vertexLength = vertexLength;
+    model.modelLength = modelLength;
+    model.cornerLength = indices.size();
+    model.edgeLength = edges.size();
+    model.edgeFaceLength = edgeFaces.size();
+    model.bvhLength = bvh.size();
+
+    std::vector<char> section(sizeof(model));
+    model.vertices = _addCacheArray(&section, vertices, sizeof(vertices[0]) * vertexLength);
+    model.normals = _addCacheArray(&section, normals, sizeof(normals[0]) * modelLength);
+    model.cornerOffsets = _addCacheArray(&section, cornerOffsets.data(), sizeof(cornerOffsets[0]) * cornerOffsets.size());
+    model.indices = _addCacheArray(&section, indices.data(), sizeof(indices[0]) * indices.size());
+    model.highlights = _addCacheArray(&section, highlights.data(), sizeof(highlights[0]) * highlights.size());
+    model.cornerEdges = _addCacheArray(&section, cornerEdges.data(), sizeof(cornerEdges[0]) * cornerEdges.size());
+    model.edges = _addCacheArray(&section, edges.data(), sizeof(edges[0]) * edges.size());
+    model.edgeFaces = _addCacheArray(&section, edgeFaces.data(), sizeof(edgeFaces[0]) * edgeFaces.size());
+    model.bvh = _addCacheArray(&section, bvh.data(), sizeof(bvh[0]) * bvh.size());
+    model.bvhPolygons = _addCacheArray(&section, bvhPolygons, sizeof(bvhPolygons[0]) * modelLength);
+
+    // Pad out the end so that the next section starts aligned too.
+    section.resize((section.size() + (MESH_CACHE_ALIGN - 1)) & ~(size_t)(MESH_CACHE_ALIGN - 1));
+    model.size = section.size();
+    memcpy(&section[0], &model, sizeof(model));
+
+    return fwrite(&section[0], section.size(), 1, fp) == 1;
 }
 
-void Model::cull(Frustum *frustum) {
+void Model::_setupPolygons(int *indices, int *offsets, int length, int flags) {
+    modelLength = length;
+    polygons = (Polygon **)malloc(sizeof(polygons[0]) * MAX(modelLength, 1));
+    normals = new Point[modelLength];
+
     for (int i = 0; i < modelLength; i++) {
-        polygons[i]->cull(frustum);
+        int start = offsets[i];
+        int polyLength = offsets[i + 1] - offsets[i];
+
+        if (flags & (FLAGS_OCCLUDED | FLAGS_SILHOUETTE)) {
+            polygons[i] = new OccludedWireframePolygon(&indices[start], polyLength, vertices, transVertices);
+        } else {
+            polygons[i] = new Polygon(&indices[start], polyLength, vertices, transVertices);
+        }
     }
 }
 
-void Model::draw(Screen *screen) {
+void Model::_setupTriangles(int *indices, int length, int flags) {
+    modelLength = length;
+    polygons = (Polygon **)malloc(sizeof(polygons[0]) * MAX(modelLength, 1));
+    normals = new Point[modelLength];
+
     for (int i = 0; i < modelLength; i++) {
-        polygons[i]->draw(screen);
+        if (flags & (FLAGS_OCCLUDED | FLAGS_SILHOUETTE)) {
+            polygons[i] = new OccludedWireframePolygon(&indices[i * 3], 3, vertices, transVertices);
+        } else {
+            polygons[i] = new Polygon(&indices[i * 3], 3, vertices, transVertices);
+        }
     }
 }
 
-Point *Model::getOrigin() {
-    double minX, maxX;
-    double minY, maxY;
-    double minZ, maxZ;
+void Model::_buildLODs(int *indices, int length, int flags) {
+    if (length < LOD_MIN_TRIANGLES * LOD_REDUCTION) {
+        // Already simple enough.
+        return;
+    }
 
-    minX = maxX = polygons[0]->transPoints[0]->x;
-    minY = maxY = polygons[0]->transPoints[0]->y;
-    minZ = maxZ = polygons[0]->transPoints[0]->z;
+    // Each level carries on simplifying from where the last one left off.
+    Simplifier simplifier(vertices, vertexLength, indices, length);
 
-    for (int i = 0; i < modelLength; i++) {
-        for (int j = 0; j < polygons[i]->polyLength; j++) {
-            minX = MIN(minX, polygons[i]->transPoints[j]->x);
-            maxX = MAX(maxX, polygons[i]->transPoints[j]->x);
-            minY = MIN(minY, polygons[i]->transPoints[j]->y);
-            maxY = MAX(maxY, polygons[i]->transPoints[j]->y);
-            minZ = MIN(minZ, polygons[i]->transPoints[j]->z);
-            maxZ = MAX(maxZ, polygons[i]->transPoints[j]->z);
+    while (length / LOD_REDUCTION >= LOD_MIN_TRIANGLES) {
+        simplifier.simplify(length / LOD_REDUCTION);
+        if (simplifier.getLength() >= length) {
+            // Nothing more can be collapsed without ruining the shape.
+            break;
         }
+
+        length = simplifier.getLength();
+        lods.push_back(new Model(simplifier.getVertices(), simplifier.getVertexLength(), simplifier.getIndices(), length, flags));
     }
 
-    return new Point((minX + maxX) / 2.0, (minY + maxY) / 2.0, (minZ + maxZ) / 2.0);
+    setLODTriangleSize(DEFAULT_LOD_TRIANGLE_SIZE);
 }
 
-Point *Model::getDimensions() {
-    double minX, maxX;
-    double minY, maxY;
-    double minZ, maxZ;
+void Model::setLODTriangleSize(double pixels) {
+    // Roughly half of a closed model faces us, covering about pi/4 of the square its bounding sphere
+    // covers on screen. Work out how big that can get before each triangle covers more than we want.
+    lodSizes.resize(lods.size());
+    for (size_t i = 0; i < lods.size(); i++) {
+        lodSizes[i] = sqrt((2.0 * pixels * lods[i]->modelLength) / M_PI);
+    }
+}
+
+void Model::setLODSize(int level, double pixels) {
+    if (level > 0 && level <= (int)lods.size()) {
+        lodSizes[level - 1] = pixels;
+    }
+}
+
+int Model::getLODLength() {
+    return lods.size() + 1;
+}
+
+int Model::getLOD() {
+    return lod;
+}
+
+double Model::_getProjectedSize(Matrix *projection) {
+    // Move our bounding sphere to where the model is now.
+    Point center = bvh[0].bounds.center;
+    modelMatrix->multiplyUpdatePoint(&center);
+    double radius = bvh[0].bounds.radius * _getTransformedScale();
+
+    // Anything we can't work out, or that the viewer is inside of, is as big as it gets.
+    Point viewer;
+    if (!projection->getCenterOfProjection(&viewer)) {
+        return INFINITY;
+    }
+
+    double dx = center.x - viewer.x;
+    double dy = center.y - viewer.y;
+    double dz = center.z - viewer.z;
+    double distance = sqrt((dx * dx) + (dy * dy) + (dz * dz));
+    if (distance <= radius) {
+        return INFINITY;
+    }
+
+    // Find a direction at right angles to the way we're being looked at, and see how far apart the
+    // center and the edge of the sphere in that direction end up on screen.
+    double sx = -dy;
+    double sy = dx;
+    double sz = 0.0;
+    if ((sx * sx) + (sy * sy) == 0.0) {
+        sx = dz;
+        sy = 0.0;
+        sz = -dx;
+    }
+    double sideLength = sqrt((sx * sx) + (sy * sy) + (sz * sz));
+
+    Point side(
+        center.x + ((sx / sideLength) * radius),
+        center.y + ((sy / sideLength) * radius),
+        center.z + ((sz / sideLength) * radius)
+    );
+    projection->projectUpdatePoint(&center);
+    projection->projectUpdatePoint(&side);
+
+    double px = side.x - center.x;
+    double py = side.y - center.y;
+    return 2.0 * sqrt((px * px) + (py * py));
+}
+
+void Model::_buildEdges() {
+    // Hash every polygon edge by its welded vertex indices, so that we can find every polygon
+    // sharing an edge in linear time.
+    std::unordered_map<unsigned long long, int> edgeMap;
+    std::vector<int> faceEdge;
+
+    edges.clear();
+    for (int i = 0; i < modelLength; i++) {
+        Polygon *poly = polygons[i];
+
+        for (int j = 0; j < poly->polyLength; j++) {
+            int first = poly->indices[j];
+            int second = poly->indices[(j + 1) % poly->polyLength];
+            if (first > second) {
+                int tmp = first;
+                first = second;
+                second = tmp;
+            }
+
+            unsigned long long key = (((unsigned long long)first) << 32) | (unsigned long long)second;
+            auto result = edgeMap.emplace(key, (int)edges.size());
+            if (result.second) {
+                Edge edge;
+                edge.first = first;
+                edge.second = second;
+                edge.start = 0;
+                edge.length = 0;
+                edge.angle = 0.0;
+                edges.push_back(edge);
+            }
+
+            edges[result.first->second].length++;
+            faceEdge.push_back(result.first->second);
+        }
+    }
 
-    minX = maxX = polygons[0]->transPoints[0]->x;
-    minY = maxY = polygons[0]->transPoints[0]->y;
-    minZ = maxZ = polygons[0]->transPoints[0]->z;
+    // Now that we know how many polygons share each edge, lay them out back to back.
+    int start = 0;
+    for (size_t i = 0; i < edges.size(); i++) {
+        edges[i].start = start;
+        start += edges[i].length;
+        edges[i].length = 0;
+    }
 
+    edgeFaces.resize(start);
+    cornerOffsets.resize(modelLength + 1);
+    int face = 0;
     for (int i = 0; i < modelLength; i++) {
+        cornerOffsets[i] = face;
         for (int j = 0; j < polygons[i]->polyLength; j++) {
-            minX = MIN(minX, polygons[i]->transPoints[j]->x);
-            maxX = MAX(maxX, polygons[i]->transPoints[j]->x);
-            minY = MIN(minY, polygons[i]->transPoints[j]->y);
-            maxY = MAX(maxY, polygons[i]->transPoints[j]->y);
-            minZ = MIN(minZ, polygons[i]->transPoints[j]->z);
-            maxZ = MAX(maxZ, polygons[i]->transPoints[j]->z);
+            Edge *edge = &edges[faceEdge[face++]];
+            edgeFaces[edge->start + edge->length].polygon = i;
+            edgeFaces[edge->start + edge->length].corner = j;
+            edge->length++;
+        }
+    }
+    cornerOffsets[modelLength] = face;
+    cornerEdges.swap(faceEdge);
+
+    _buildCreases();
+}
+
+void Model::_buildCreases() {
+    // Work out how sharp each edge is from the polygons on either side of it.
+    for (size_t e = 0; e < edges.size(); e++) {
+        Edge *edge = &edges[e];
+        double minDot = 1.0;
+
+        for (int i = 0; i < edge->length; i++) {
+            Point *srcNormal = &normals[edgeFaces[edge->start + i].polygon];
+
+            for (int j = i + 1; j < edge->length; j++) {
+                Point *dstNormal = &normals[edgeFaces[edge->start + j].polygon];
+                double dot = (srcNormal->x * dstNormal->x) + (srcNormal->y * dstNormal->y) + (srcNormal->z * dstNormal->z);
+                minDot = MIN(minDot, dot);
+            }
+        }
+
+        edge->angle = (acos(MAX(-1.0, minDot)) / M_PI) * 180.0;
+    }
+}
+
+void Model::coalesce() {
+    coalesce(0.0);
+}
+
+void Model::coalesce(double degrees) {
+    for (size_t i = 0; i < lods.size(); i++) {
+        lods[i]->coalesce(degrees);
+    }
+
+    // A tolerance of zero means only identical normals count, rather than being at the mercy of
+    // rounding in the dot product.
+    bool exact = degrees <= 0.0;
+    double minDot = cos((degrees / 180.0) * M_PI);
+
+    // Go through each edge and see if any two polygons sharing it face the same way. If so, turn
+    // the highlight off on both polygons. Every polygon edge belongs to exactly one entry in edges,
+    // so each edge can be handled completely independently of the others.
+    for (size_t e = 0; e < edges.size(); e++) {
+        Edge *edge = &edges[e];
+
+        for (int i = 0; i < edge->length; i++) {
+            EdgeFace *src = &edgeFaces[edge->start + i];
+
+            for (int j = i + 1; j < edge->length; j++) {
+                EdgeFace *dst = &edgeFaces[edge->start + j];
+                if (src->polygon == dst->polygon) { continue; }
+
+                Point *srcNormal = &normals[src->polygon];
+                Point *dstNormal = &normals[dst->polygon];
+                double dot = (srcNormal->x * dstNormal->x) + (srcNormal->y * dstNormal->y) + (srcNormal->z * dstNormal->z);
+
+                if (exact ? (*srcNormal == *dstNormal) : (dot >= minDot)) {
+                    polygons[src->polygon]->highlights[src->corner] = false;
+                    polygons[dst->polygon]->highlights[dst->corner] = false;
+                }
+            }
         }
     }
 
-    return new Point(fabs(maxX - minX), fabs(maxY - minY), fabs(maxZ - minZ));
+    // Some edges may no longer be drawn at all.
+    _buildWireframe();
+}
+
+void Model::_drawSilhouette(Screen *screen) {
+    // Fill in everything facing us first, so that whatever is behind it is hidden.
+    for (int i = 0; i < modelLength; i++) {
+        Polygon *polygon = polygons[i];
+        if (!polygon->culled) {
+            screen->drawUnlitPolygon(polygon->transPoints, polygon->transPolyLength);
+        }
+    }
+
+    // Now, draw only the edges we picked out when culling, on top of that.
+    for (int i = 0; i < modelLength; i++) {
+        Polygon *polygon = polygons[i];
+        if (polygon->culled) { continue; }
+
+        for (int j = 0; j < polygon->transPolyLength; j++) {
+            if (polygon->transHighlights[j]) {
+                int k = (j + 1) % polygon->transPolyLength;
+                screen->drawLine(polygon->transPoints[j], polygon->transPoints[k], true);
+            }
+        }
+    }
+}
+
+void Model::_buildWireframe() {
+    drawMode = modelLength > 0 ? polygons[0]->getDrawMode() : DRAW_MODE_WIREFRAME;
+    for (int i = 1; i < modelLength; i++) {
+        if (polygons[i]->getDrawMode() != drawMode) {
+            drawMode = DRAW_MODE_MIXED;
+        }
+    }
+
+    wireEdges.clear();
+    if (drawMode != DRAW_MODE_WIREFRAME) { return; }
+
+    for (size_t e = 0; e < edges.size(); e++) {
+        Edge *edge = &edges[e];
+
+        for (int i = 0; i < edge->length; i++) {
+            EdgeFace *face = &edgeFaces[edge->start + i];
+            if (polygons[face->polygon]->highlights[face->corner]) {
+                wireEdges.push_back(e);
+                break;
+            }
+        }
+    }
+}
+
+InstancedModel::InstancedModel(Model *model) {
+    this->model = model;
+}
+
+int InstancedModel::addInstance() {
+    matrices.push_back(Matrix());
+    return matrices.size() - 1;
+}
+
+int InstancedModel::getLength() {
+    return matrices.size();
+}
+
+void InstancedModel::reset() {
+    for (size_t i = 0; i < matrices.size(); i++) {
+        matrices[i] = Matrix();
+    }
+}
+
+void InstancedModel::transform(int instance, Matrix *matrix) {
+    // Same as a model, this goes on the outside of everything applied so far.
+    Matrix accumulated = *matrix;
+    accumulated.multiply(&matrices[instance]);
+    matrices[instance] = accumulated;
+}
+
+void InstancedModel::transform(Matrix *matrix) {
+    // Nothing here touches a vertex, so moving every instance at once costs one matrix multiply each.
+    for (size_t i = 0; i < matrices.size(); i++) {
+        transform(i, matrix);
+    }
+}
+
+void InstancedModel::draw(Screen *screen, Frustum *frustum, Matrix *projection) {
+    // Each instance is finished with before the next one starts, so they can all take turns using
+    // the same model. Its transformations are put off until culling, so an instance that is entirely
+    // off screen never touches a vertex.
+    for (size_t i = 0; i < matrices.size(); i++) {
+        model->reset();
+        model->transform(&matrices[i]);
+        model->cull(frustum, projection, screen);
+        model->project(projection);
+        model->draw(screen);
+    }
+}
+
+AssemblyModel::AssemblyModel(const char * const modelFile, int flags) : AssemblyModel(modelFile, flags, DEFAULT_WELD_DISTANCE) {}
+
+AssemblyModel::AssemblyModel(const char * const modelFile, int flags, double weldDistance) {
+    // Anything that isn't an STL can't have solids, so it is one part. Neither of these looks any further than
+    // the header or the name of a file that isn't theirs, and whichever one takes the file is loaded as it is.
+    MeshCache cache(modelFile);
+    MeshFile meshFile(modelFile);
+    if (cache.isValid()) {
+        parts.push_back(new Model(&cache, flags));
+    } else if (meshFile.isValid()) {
+        parts.push_back(new Model(&meshFile, flags));
+    } else {
+        stl_reader::StlMesh <float, unsigned int> mesh(modelFile, weldDistance);
+
+        if (mesh.num_solids() <= 1) {
+            parts.push_back(new Model(mesh.raw_coords(), mesh.num_vrts(), mesh.raw_tris(), mesh.raw_normals(), mesh.num_tris(), flags));
+        } else {
+            // Each part gets its own copy of just the vertices its triangles use.
+            std::vector<int> partIndex(mesh.num_vrts(), -1);
+            for (size_t solid = 0; solid < mesh.num_solids(); solid++) {
+                int begin = mesh.solid_tris_begin(solid);
+                int end = mesh.solid_tris_end(solid);
+                if (begin >= end) { continue; }
+
+                std::vector<float> coords;
+                std::vector<unsigned int> tris;
+                for (int i = begin * 3; i < end * 3; i++) {
+                    unsigned int vertex = mesh.raw_tris()[i];
+                    if (partIndex[vertex] < 0) {
+                        partIndex[vertex] = coords.size() / 3;
+                        coords.insert(coords.end(), mesh.vrt_coords(vertex), mesh.vrt_coords(vertex) + 3);
+                    }
+                    tris.push_back(partIndex[vertex]);
+                }
+
+                // Solids can share vertices, so forget ours before the next one.
+                for (int i = begin * 3; i < end * 3; i++) {
+                    partIndex[mesh.raw_tris()[i]] = -1;
+                }
+
+                parts.push_back(new Model(&coords[0], coords.size() / 3, &tris[0], mesh.raw_normals() + (begin * 3), end - begin, flags));
+            }
+        }
+
+        for (size_t i = 0; i < parts.size(); i++) {
+            parts[i]->weldRatio = mesh.weld_stats().ratio();
+        }
+    }
+
+    if (parts.empty()) {
+        parts.push_back(new Model(NULL, 0, NULL, NULL, 0, flags));
+    }
+    matrices.resize(parts.size());
+
+    // Work out our bounds while nothing has been moved yet.
+    min = Point(INFINITY, INFINITY, INFINITY);
+    max = Point(-INFINITY, -INFINITY, -INFINITY);
+    for (size_t i = 0; i < parts.size(); i++) {
+        for (int j = 0; j < parts[i]->vertexLength; j++) {
+            Point *vertex = &parts[i]->vertices[j];
+            min = Point(MIN(min.x, vertex->x), MIN(min.y, vertex->y), MIN(min.z, vertex->z));
+            max = Point(MAX(max.x, vertex->x), MAX(max.y, vertex->y), MAX(max.z, vertex->z));
+        }
+    }
+    if (min.x > max.x) {
+        min = Point(0.0, 0.0, 0.0);
+        max = Point(0.0, 0.0, 0.0);
+    }
+}
+
+AssemblyModel::~AssemblyModel() {
+    for (size_t i = 0; i < parts.size(); i++) {
+        delete parts[i];
+    }
+}
+
+int AssemblyModel::getLength() {
+    return parts.size();
+}
+
+Model *AssemblyModel::getPart(int part) {
+    return parts[part];
+}
+
+void AssemblyModel::coalesce() {
+    coalesce(0.0);
+}
+
+void AssemblyModel::coalesce(double degrees) {
+    for (size_t i = 0; i < parts.size(); i++) {
+        parts[i]->coalesce(degrees);
+    }
+}
+
+Point *AssemblyModel::getOrigin() {
+    return new Point((min.x + max.x) / 2.0, (min.y + max.y) / 2.0, (min.z + max.z) / 2.0);
+}
+
+Point *AssemblyModel::getDimensions() {
+    return new Point(max.x - min.x, max.y - min.y, max.z - min.z);
+}
+
+void AssemblyModel::reset() {
+    for (size_t i = 0; i < matrices.size(); i++) {
+        matrices[i] = Matrix();
+    }
+}
+
+void AssemblyModel::transform(int part, Matrix *matrix) {
+    Matrix accumulated = *matrix;
+    accumulated.multiply(&matrices[part]);
+    matrices[part] = accumulated;
+}
+
+void AssemblyModel::transform(Matrix *matrix) {
+    for (size_t i = 0; i < matrices.size(); i++) {
+        transform(i, matrix);
+    }
+}
+
+void AssemblyModel::draw(Screen *screen, Frustum *frustum, Matrix *projection) {
+    // Same as instances, transformations wait until culling, so a part entirely off screen is
+    // rejected by its bounds without touching any of its vertices. The screen's Z-buffer sorts
+    // out which part is in front of which.
+    for (size_t i = 0; i < parts.size(); i++) {
+        parts[i]->reset();
+        parts[i]->transform(&matrices[i]);
+        parts[i]->cull(frustum, projection, screen);
+        parts[i]->project(projection);
+        parts[i]->draw(screen);
+    }
+}
+
+Model::~Model() {
+    for (size_t i = 0; i < lods.size(); i++) {
+        delete lods[i];
+    }
+
+    for (int i = 0; i < modelLength; i++) {
+        delete polygons[i];
+    }
+
+    free(polygons);
+    free(bvhPolygons);
+    free(dirtyPolygons);
+    free(frontFacing);
+    free(drawPoints);
+    free(drawHighlights);
+    free(drawLengths);
+    free(drawChecks);
+    free(checkFacing);
+    delete[] normals;
+    delete modelMatrix;
+    delete scratch;
+    delete[] vertices;
+    delete[] transVertices;
+    polygons = 0;
+    bvhPolygons = 0;
+    dirtyPolygons = 0;
+    frontFacing = 0;
+    checkFacing = 0;
+    normals = 0;
+    modelMatrix = 0;
+    scratch = 0;
+    vertices = 0;
+    transVertices = 0;
+    modelLength = 0;
+    vertexLength = 0;
+}
+
+Model *Model::clone() {
+    if (active != this) {
+        return active->clone();
+    }
+
+    bool untransformed = !transformed;
+    _prepareVertices();
+    Model *newModel = new Model(polygons, modelLength);
+    newModel->silhouette = silhouette;
+    newModel->creaseAngle = creaseAngle;
+    newModel->weldRatio = weldRatio;
+
+    // Our normals are likely better than ones worked out from the (possibly clipped) polygons, but
+    // they only still point the right way if we haven't been transformed since we were reset.
+    if (untransformed) {
+        for (int i = 0; i < modelLength; i++) {
+            newModel->normals[i] = normals[i];
+        }
+        newModel->_buildCreases();
+    }
+
+    return newModel;
+}
+
+void Model::reset() {
+    for (size_t i = 0; i < lods.size(); i++) {
+        lods[i]->reset();
+    }
+    active = this;
+    lod = 0;
+
+    // Everything clipped last frame is no longer needed.
+    scratch->reset();
+    *modelMatrix = Matrix();
+    transformed = false;
+    pending = false;
+    projected = false;
+    outside = false;
+    silhouetteFrame = false;
+    facingFrame = false;
+
+    // Only polygons that were touched by culling have anything to undo.
+    for (int i = 0; i < dirtyLength; i++) {
+        polygons[dirtyPolygons[i]]->reset();
+    }
+    dirtyLength = 0;
+}
+
+void Model::_prepareVertices() {
+    if (pending) {
+        // Apply every transformation since we were reset in one go.
+        _parallelFor(vertexLength, [this](int start, int end) {
+            for (int i = start; i < end; i++) {
+                modelMatrix->multiplyPoint(&vertices[i], &transVertices[i]);
+            }
+        });
+        pending = false;
+    } else if (!transformed) {
+        // Somebody wants our transformed vertices before we transformed anything, so they are
+        // simply the untransformed ones.
+        for (int i = 0; i < vertexLength; i++) {
+            transVertices[i] = vertices[i];
+        }
+        transformed = true;
+    }
+}
+
+void Model::transform(Matrix *matrix) {
+    StageTimer timer(&timings.transform);
+
+    // Simpler versions of ourselves only need to keep track of the matrix, same as us.
+    for (size_t i = 0; i < lods.size(); i++) {
+        lods[i]->transform(matrix);
+    }
+
+    // Keep track of where our bounds went. Matrices apply in the order they are multiplied onto
+    // the matrix doing the multiplying, so this one goes on the outside.
+    Matrix accumulated = *matrix;
+    accumulated.multiply(modelMatrix);
+    *modelMatrix = accumulated;
+
+    if (projected) {
+        // Somebody is transforming projected points, so there's no going back to the source.
+        _parallelFor(vertexLength, [this, matrix](int start, int end) {
+            for (int i = start; i < end; i++) {
+                matrix->multiplyUpdatePoint(&transVertices[i]);
+            }
+        });
+    } else {
+        // Put off transforming shared vertices until somebody needs them, so that however many
+        // transformations are applied, each vertex is only transformed once.
+        pending = true;
+        transformed = true;
+    }
+
+    // Only clipped polygons have any points of their own.
+    for (int i = 0; i < dirtyLength; i++) {
+        polygons[dirtyPolygons[i]]->transform(matrix);
+    }
+}
+
+void Model::project(Matrix *matrix) {
+    StageTimer timer(&timings.project);
+
+    if (active != this) {
+        active->project(matrix);
+        return;
+    }
+
+    if (outside) { return; }
+
+    // Project each shared vertex exactly once, applying any transformations we put off on the way.
+    if (pending) {
+        _parallelFor(vertexLength, [this, matrix](int start, int end) {
+            for (int i = start; i < end; i++) {
+                Point transformed;
+                modelMatrix->multiplyPoint(&vertices[i], &transformed);
+                matrix->projectPoint(&transformed, &transVertices[i]);
+            }
+        });
+    } else {
+        Point *source = transformed ? transVertices : vertices;
+        _parallelFor(vertexLength, [this, matrix, source](int start, int end) {
+            for (int i = start; i < end; i++) {
+                matrix->projectPoint(&source[i], &transVertices[i]);
+            }
+        });
+    }
+    transformed = true;
+    pending = false;
+    projected = true;
+
+    // Only clipped polygons have any points of their own.
+    for (int i = 0; i < dirtyLength; i++) {
+        polygons[dirtyPolygons[i]]->project(matrix);
+    }
+}
+
+void Model::cull(Frustum *frustum) {
+    StageTimer timer(&timings.cull);
+
+    if (_isOutside(frustum)) { return; }
+
+    _prepareVertices();
+    _cullNode(0, frustum, CULL_ALL_PLANES, _getTransformedScale());
+}
+
+void Model::cull(Frustum *frustum, Matrix *projection, Screen *screen) {
+    StageTimer timer(&timings.cull);
+
+    // Pick the simplest version of ourselves that still has enough detail for how big we are.
+    if (!lods.empty()) {
+        double size = _getProjectedSize(projection);
+
+        lod = 0;
+        active = this;
+        for (size_t i = 0; i < lods.size(); i++) {
+            if (size <= lodSizes[i]) {
+                lod = i + 1;
+                active = lods[i];
+            }
+        }
+
+        if (active != this) {
+            active->cull(frustum, projection, screen);
+            return;
+        }
+    }
+
+    if (_isOutside(frustum)) { return; }
+
+    _prepareVertices();
+    _cullBackFaces(projection, screen->getNormalOrder());
+    _cullNode(0, frustum, CULL_ALL_PLANES, _getTransformedScale());
+}
+
+void Model::_cullBackFaces(Matrix *projection, int normalOrder) {
+    // Work out where the viewer is, and then where that is in the space our untransformed vertices
+    // and normals live in. That way nothing needs transforming at all.
+    Point viewer;
+    if (!projection->getCenterOfProjection(&viewer)) {
+        // Not a perspective projection, so leave it all to the screen.
+        return;
+    }
+
+    Matrix *m = modelMatrix;
+    double det = (m->a11 * ((m->a22 * m->a33) - (m->a23 * m->a32))) -
+                 (m->a12 * ((m->a21 * m->a33) - (m->a23 * m->a31))) +
+                 (m->a13 * ((m->a21 * m->a32) - (m->a22 * m->a31)));
+    if (det == 0.0) {
+        // We've been flattened, so there's no telling which way anything faces.
+        return;
+    }
+
+    Matrix inverse = *modelMatrix;
+    inverse.invert();
+    inverse.multiplyUpdatePoint(&viewer);
+
+    // Our normals point towards a viewer that sees a polygon counter-clockwise in model space. The
+    // screen sees things mirrored from that, and a mirroring transformation flips that again.
+    double facing = (normalOrder == NORMAL_ORDER_CCW) ? 1.0 : -1.0;
+    if (det < 0.0) {
+        facing = -facing;
+    }
+
+    // Work out which way everything faces first, which can be split up since each polygon only
+    // writes its own answer.
+    _parallelFor(modelLength, [this, &viewer, facing](int start, int end) {
+        for (int i = start; i < end; i++) {
+            Polygon *polygon = polygons[i];
+            frontFacing[i] = true;
+            checkFacing[i] = true;
+            if (polygon->culled || !(silhouette || polygon->isBackFaceCulled())) { continue; }
+
+            Point *normal = &normals[i];
+            Point *corner = &vertices[polygon->indices[0]];
+            double dx = viewer.x - corner->x;
+            double dy = viewer.y - corner->y;
+            double dz = viewer.z - corner->z;
+            double distance = sqrt((dx * dx) + (dy * dy) + (dz * dz));
+            double dot = facing * ((normal->x * dx) + (normal->y * dy) + (normal->z * dz));
+
+            if (silhouette) {
+                // Finding silhouettes needs to know which way everything faces, and we're the ones
+                // deciding what gets drawn, so there's no edge-on case to leave to the screen.
+                frontFacing[i] = dot >= 0.0;
+            } else {
+                // Anything close to edge-on is left for the screen to decide, so we never throw away a
+                // polygon that it would have drawn.
+                frontFacing[i] = dot >= -BACKFACE_EPSILON * distance;
+                checkFacing[i] = dot < BACKFACE_EPSILON * distance;
+            }
+        }
+    });
+
+    // Then cull in order, so that the dirty list comes out the same however the work was split.
+    for (int i = 0; i < modelLength; i++) {
+        Polygon *polygon = polygons[i];
+        if (!frontFacing[i] && !polygon->culled) {
+            polygon->culled = true;
+            dirtyPolygons[dirtyLength++] = i;
+        }
+    }
+    facingFrame = true;
+
+    if (silhouette) {
+        silhouetteFrame = true;
+        _markFeatureEdges();
+    }
+}
+
+void Model::_markFeatureEdges() {
+    // Swap each visible polygon's highlights for ones that only cover silhouettes and creases. These
+    // then get clipped along with the rest of the polygon.
+    for (int i = 0; i < modelLength; i++) {
+        Polygon *polygon = polygons[i];
+        if (polygon->culled) { continue; }
+
+        bool *draws = scratch->allocArray<bool>(polygon->polyLength);
+        for (int j = 0; j < polygon->polyLength; j++) {
+            Edge *edge = &edges[cornerEdges[cornerOffsets[i] + j]];
+            draws[j] = polygon->highlights[j] && _isFeatureEdge(edge, i, j);
+        }
+
+        polygon->transHighlights = draws;
+        dirtyPolygons[dirtyLength++] = i;
+    }
+}
+
+bool Model::_isFeatureEdge(Edge *edge, int polygon, int corner) {
+    // Only the first polygon facing us draws an edge, so that it is only drawn once.
+    bool owner = false;
+    bool front = false;
+    bool back = false;
+
+    for (int i = 0; i < edge->length; i++) {
+        EdgeFace *face = &edgeFaces[edge->start + i];
+
+        if (frontFacing[face->polygon]) {
+            if (!front) {
+                owner = (face->polygon == polygon) && (face->corner == corner);
+            }
+            front = true;
+        } else {
+            back = true;
+        }
+    }
+
+    if (!owner) {
+        return false;
+    }
+
+    // Edges along the border of the model or between polygons facing towards and away from us make up
+    // the silhouette, the rest only count if they are sharp enough.
+    return (edge->length == 1) || back || (edge->angle > creaseAngle);
+}
+
+void Model::_parallelFor(int length, const std::function<void(int, int)> &body) {
+    if (pool == NULL || length < MODEL_PARALLEL_THRESHOLD) {
+        // Small enough that waking up other threads would cost more than it saves.
+        body(0, length);
+    } else {
+        pool->parallelFor(length, MODEL_PARALLEL_CHUNK, body);
+    }
+}
+
+void Model::setThreadPool(ThreadPool *pool) {
+    for (size_t i = 0; i < lods.size(); i++) {
+        lods[i]->setThreadPool(pool);
+    }
+
+    this->pool = pool;
+}
+
+void Model::getTimings(ModelTimings *timings) {
+    *timings = this->timings;
+}
+
+void Model::clearTimings() {
+    timings = ModelTimings();
+}
+
+double Model::getWeldRatio() {
+    return weldRatio;
+}
+
+ModelTimings::ModelTimings() {
+    transform = 0.0;
+    cull = 0.0;
+    project = 0.0;
+    draw = 0.0;
+}
+
+bool Model::_isOutside(Frustum *frustum) {
+    // Move our bounding sphere to where the model is now.
+    Point center = bvh[0].bounds.center;
+    modelMatrix->multiplyUpdatePoint(&center);
+    double radius = bvh[0].bounds.radius * _getTransformedScale();
+
+    for (int j = 0; j < frustum->length; j++) {
+        if (frustum->planes[j]->distance(&center) < -radius) {
+            // Nothing of ours is on screen, so none of our vertices need transforming, projecting or
+            // drawing, and none of our polygons need culling one by one.
+            outside = true;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Model::_cullNode(int node, Frustum *frustum, unsigned int planeMask, double scale) {
+    BVHNode *bvhNode = &bvh[node];
+
+    // Move our bounding sphere to where the model is now.
+    Point center = bvhNode->bounds.center;
+    modelMatrix->multiplyUpdatePoint(&center);
+    double radius = bvhNode->bounds.radius * scale;
+
+    for (int j = 0; j < frustum->length; j++) {
+        if (!(planeMask & (1 << j))) { continue; }
+
+        double distance = frustum->planes[j]->distance(&center);
+        if (distance < -radius) {
+            // Everything under this node is outside this plane.
+            for (int i = bvhNode->start; i < bvhNode->end; i++) {
+                Polygon *polygon = polygons[bvhPolygons[i]];
+                if (!polygon->_isDirty()) {
+                    dirtyPolygons[dirtyLength++] = bvhPolygons[i];
+                }
+                polygon->culled = true;
+            }
+            return;
+        }
+
+        if (distance >= radius) {
+            // Everything under this node is inside this plane, so nobody below needs to check it.
+            planeMask &= ~(1 << j);
+        }
+    }
+
+    if ((planeMask & ((1 << frustum->length) - 1)) == 0) {
+        // Everything under this node is inside the frustum, nothing needs clipping.
+        return;
+    }
+
+    if (bvhNode->left < 0) {
+        // We're a leaf, so only cull the polygons that might actually straddle a plane.
+        for (int i = bvhNode->start; i < bvhNode->end; i++) {
+            Polygon *polygon = polygons[bvhPolygons[i]];
+            if (polygon->culled) { continue; }
+            bool wasDirty = polygon->_isDirty();
+
+            polygon->cull(frustum, scratch, planeMask);
+            if (!wasDirty && polygon->_isDirty()) {
+                dirtyPolygons[dirtyLength++] = bvhPolygons[i];
+            }
+        }
+    } else {
+        _cullNode(bvhNode->left, frustum, planeMask, scale);
+        _cullNode(bvhNode->right, frustum, planeMask, scale);
+    }
+}
+
+void Model::setCreaseAngle(double degrees) {
+    for (size_t i = 0; i < lods.size(); i++) {
+        lods[i]->setCreaseAngle(degrees);
+    }
+
+    creaseAngle = degrees;
+}
+
+void Model::draw(Screen *screen) {
+    StageTimer timer(&timings.draw);
+
+    if (active != this) {
+        active->draw(screen);
+        return;
+    }
+
+    if (outside) { return; }
+
+    _prepareVertices();
+
+    if (silhouetteFrame) {
+        _drawSilhouette(screen);
+        return;
+    }
+
+    if (drawMode == DRAW_MODE_OCCLUDED) {
+        _drawOccluded(screen);
+        return;
+    }
+
+    if (drawMode == DRAW_MODE_MIXED) {
+        for (int i = 0; i < modelLength; i++) {
+            polygons[i]->draw(screen);
+        }
+        return;
+    }
+
+    // Draw each edge once, as long as a polygon that is still whole wants it drawn.
+    for (size_t e = 0; e < wireEdges.size(); e++) {
+        Edge *edge = &edges[wireEdges[e]];
+
+        for (int i = 0; i < edge->length; i++) {
+            EdgeFace *face = &edgeFaces[edge->start + i];
+            Polygon *polygon = polygons[face->polygon];
+
+            if (!polygon->culled && !polygon->clipped && polygon->highlights[face->corner]) {
+                screen->drawLine(&transVertices[edge->first], &transVertices[edge->second], true);
+                break;
+            }
+        }
+    }
+
+    // Clipped polygons have an outline of their own, so they still draw themselves.
+    for (int i = 0; i < dirtyLength; i++) {
+        Polygon *polygon = polygons[dirtyPolygons[i]];
+        if (polygon->clipped) {
+            polygon->draw(screen);
+        }
+    }
+}
+
+void Model::_drawOccluded(Screen *screen) {
+    // Gather up every polygon still on screen, in order, and let the screen have at them.
+    int count = 0;
+    for (int i = 0; i < modelLength; i++) {
+        Polygon *polygon = polygons[i];
+        if (polygon->culled) { continue; }
+
+        drawPoints[count] = polygon->transPoints;
+        drawHighlights[count] = polygon->transHighlights;
+        drawLengths[count] = polygon->transPolyLength;
+        drawChecks[count] = !facingFrame || checkFacing[i];
+        count++;
+    }
+
+    screen->drawOccludedPolygons(drawPoints, drawHighlights, drawLengths, drawChecks, count);
+}
+
+void Model::_getTransformedBox(Bounds *bounds, Point *min, Point *max) {
+    // The transformed box is the bounding box of all eight transformed corners.
+    for (int i = 0; i < 8; i++) {
+        Point corner(
+            (i & 1) ? bounds->max.x : bounds->min.x,
+            (i & 2) ? bounds->max.y : bounds->min.y,
+            (i & 4) ? bounds->max.z : bounds->min.z
+        );
+        modelMatrix->multiplyUpdatePoint(&corner);
+
+        if (i == 0) {
+            *min = corner;
+            *max = corner;
+        } else {
+            min->x = MIN(min->x, corner.x);
+            max->x = MAX(max->x, corner.x);
+            min->y = MIN(min->y, corner.y);
+            max->y = MAX(max->y, corner.y);
+            min->z = MIN(min->z, corner.z);
+            max->z = MAX(max->z, corner.z);
+        }
+    }
+}
+
+double Model::_getTransformedScale() {
+    // The most that our transformations can stretch a sphere by is the largest singular value of
+    // the upper 3x3 of the model matrix, which is the square root of the largest eigenvalue of
+    // its transpose multiplied by itself.
+    Matrix *m = modelMatrix;
+    double b11 = (m->a11 * m->a11) + (m->a12 * m->a12) + (m->a13 * m->a13);
+    double b22 = (m->a21 * m->a21) + (m->a22 * m->a22) + (m->a23 * m->a23);
+    double b33 = (m->a31 * m->a31) + (m->a32 * m->a32) + (m->a33 * m->a33);
+    double b12 = (m->a11 * m->a21) + (m->a12 * m->a22) + (m->a13 * m->a23);
+    double b13 = (m->a11 * m->a31) + (m->a12 * m->a32) + (m->a13 * m->a33);
+    double b23 = (m->a21 * m->a31) + (m->a22 * m->a32) + (m->a23 * m->a33);
+
+    double off = (b12 * b12) + (b13 * b13) + (b23 * b23);
+    double largest;
+
+    if (off == 0.0) {
+        // Already diagonal, which is the common case of no rotation.
+        largest = MAX(MAX(b11, b22), b33);
+    } else {
+        // Closed form eigenvalues of a symmetric 3x3 matrix.
+        double q = (b11 + b22 + b33) / 3.0;
+        double p = sqrt((((b11 - q) * (b11 - q)) + ((b22 - q) * (b22 - q)) + ((b33 - q) * (b33 - q)) + (2.0 * off)) / 6.0);
+        double c11 = (b11 - q) / p;
+        double c22 = (b22 - q) / p;
+        double c33 = (b33 - q) / p;
+        double c12 = b12 / p;
+        double c13 = b13 / p;
+        double c23 = b23 / p;
+        double r = (
+            (c11 * ((c22 * c33) - (c23 * c23))) -
+            (c12 * ((c12 * c33) - (c23 * c13))) +
+            (c13 * ((c12 * c23) - (c22 * c13)))
+        ) / 2.0;
+        r = MAX(MIN(r, 1.0), -1.0);
+        largest = q + (2.0 * p * cos(acos(r) / 3.0));
+    }
+
+    // Pad slightly so that rounding never makes the sphere too small.
+    return sqrt(largest) * (1.0 + 1e-9);
+}
+
+Point *Model::getOrigin() {
+    Point min, max;
+    _getTransformedBox(&bvh[0].bounds, &min, &max);
+
+    return new Point((min.x + max.x) / 2.0, (min.y + max.y) / 2.0, (min.z + max.z) / 2.0);
+}
+
+Point *Model::getDimensions() {
+    Point min, max;
+    _getTransformedBox(&bvh[0].bounds, &min, &max);
+
+    return new Point(fabs(max.x - min.x), fabs(max.y - min.y), fabs(max.z - min.z));
+}
+
+Bounds::Bounds() {
+    radius = 0.0;
+    empty = true;
+}
+
+void Bounds::add(Point *point) {
+    if (empty) {
+        min = *point;
+        max = *point;
+        empty = false;
+    } else {
+        min.x = MIN(min.x, point->x);
+        max.x = MAX(max.x, point->x);
+        min.y = MIN(min.y, point->y);
+        max.y = MAX(max.y, point->y);
+        min.z = MIN(min.z, point->z);
+        max.z = MAX(max.z, point->z);
+    }
+
+    center = Point((min.x + max.x) / 2.0, (min.y + max.y) / 2.0, (min.z + max.z) / 2.0);
+}
+
+void Bounds::addRadius(Point *point) {
+    double dx = point->x - center.x;
+    double dy = point->y - center.y;
+    double dz = point->z - center.z;
+
+    radius = MAX(radius, sqrt((dx * dx) + (dy * dy) + (dz * dz)));
+}
+
+void Model::_setup() {
+    _setupFrame();
+    _buildEdges();
+    _buildWireframe();
+    _buildBounds();
+}
+
+void Model::_setupFrame() {
+    // Nothing has been culled or transformed yet.
+    scratch = new ScratchArena(MODEL_SCRATCH_SIZE);
+    modelMatrix = new Matrix();
+    dirtyPolygons = (int *)malloc(sizeof(dirtyPolygons[0]) * MAX(modelLength, 1));
+    dirtyLength = 0;
+    transformed = false;
+    pending = false;
+    projected = false;
+    outside = false;
+    active = this;
+    lod = 0;
+    pool = ThreadPool::getShared();
+    silhouette = false;
+    silhouetteFrame = false;
+    facingFrame = false;
+    creaseAngle = DEFAULT_CREASE_ANGLE;
+    weldRatio = 0.0;
+    frontFacing = (bool *)malloc(sizeof(frontFacing[0]) * MAX(modelLength, 1));
+    drawPoints = (Point ***)malloc(sizeof(drawPoints[0]) * MAX(modelLength, 1));
+    drawHighlights = (bool **)malloc(sizeof(drawHighlights[0]) * MAX(modelLength, 1));
+    drawLengths = (int *)malloc(sizeof(drawLengths[0]) * MAX(modelLength, 1));
+    drawChecks = (bool *)malloc(sizeof(drawChecks[0]) * MAX(modelLength, 1));
+    checkFacing = (bool *)malloc(sizeof(checkFacing[0]) * MAX(modelLength, 1));
+}
+
+void Model::_buildBounds() {
+    // Work out the center of each polygon, which is what we sort on when splitting nodes.
+    Point *centroids = new Point[modelLength];
+    bvhPolygons = (int *)malloc(sizeof(bvhPolygons[0]) * MAX(modelLength, 1));
+
+    for (int i = 0; i < modelLength; i++) {
+        Polygon *poly = polygons[i];
+        for (int j = 0; j < poly->polyLength; j++) {
+            Point *vertex = &vertices[poly->indices[j]];
+            centroids[i].x += vertex->x / poly->polyLength;
+            centroids[i].y += vertex->y / poly->polyLength;
+            centroids[i].z += vertex->z / poly->polyLength;
+        }
+
+        bvhPolygons[i] = i;
+    }
+
+    bvh.clear();
+    _buildBVH(bvhPolygons, centroids, 0, modelLength);
+
+    delete[] centroids;
+}
+
+int Model::_buildBVH(int *centroidOrder, Point *centroids, int start, int end) {
+    int node = bvh.size();
+    bvh.push_back(BVHNode());
+    bvh[node].left = -1;
+    bvh[node].right = -1;
+    bvh[node].start = start;
+    bvh[node].end = end;
+
+    // Calculate the box first, since the sphere is centered on it.
+    Bounds bounds;
+    for (int i = start; i < end; i++) {
+        Polygon *poly = polygons[centroidOrder[i]];
+        for (int j = 0; j < poly->polyLength; j++) {
+            bounds.add(&vertices[poly->indices[j]]);
+        }
+    }
+    for (int i = start; i < end; i++) {
+        Polygon *poly = polygons[centroidOrder[i]];
+        for (int j = 0; j < poly->polyLength; j++) {
+            bounds.addRadius(&vertices[poly->indices[j]]);
+        }
+    }
+    bvh[node].bounds = bounds;
+
+    if (end - start <= MODEL_BVH_LEAF_SIZE) {
+        return node;
+    }
+
+    // Split the polygons in half along the longest axis of the box.
+    double dx = bounds.max.x - bounds.min.x;
+    double dy = bounds.max.y - bounds.min.y;
+    double dz = bounds.max.z - bounds.min.z;
+    int mid = (start + end) / 2;
+
+    if (dx >= dy && dx >= dz) {
+        std::nth_element(&centroidOrder[start], &centroidOrder[mid], &centroidOrder[end], [centroids](int a, int b) { return centroids[a].x < centroids[b].x; });
+    } else if (dy >= dz) {
+        std::nth_element(&centroidOrder[start], &centroidOrder[mid], &centroidOrder[end], [centroids](int a, int b) { return centroids[a].y < centroids[b].y; });
+    } else {
+        std::nth_element(&centroidOrder[start], &centroidOrder[mid], &centroidOrder[end], [centroids](int a, int b) { return centroids[a].z < centroids[b].z; });
+    }
+
+    // Careful, bvh can be reallocated by building the children.
+    int left = _buildBVH(centroidOrder, centroids, start, mid);
+    int right = _buildBVH(centroidOrder, centroids, mid, end);
+    bvh[node].left = left;
+    bvh[node].right = right;
+
+    return node;
 }
@@ -1,46 +1,90 @@
 #ifndef MODEL_H
 #define MODEL_H
 
-#include <map>
+#include <cstdio>
+#include <functional>
 #include <vector>
+#include "arena.h"
 #include "matrix.h"
 #include "raster.h"
 
+class MeshCache;
+class MeshCacheModel;
+class MeshFile;
+class ThreadPool;
+
 class Polygon {
     friend class Model;
 
     public:
         Polygon(Point *x, Point *y, Point *z);
         Polygon(Point *points[], int length);
+
+        // Construct a polygon whose corners are indices into a vertex buffer shared with other
+        // polygons. The buffers belong to the caller (usually a Model) and must outlive this polygon.
+        Polygon(int indices[], int length, Point *vertices, Point *transVertices);
         ~Polygon();
 
         // Clone this polygon, including any intermediate transformations applied.
         virtual Polygon *clone();
 
+        // Clone this polygon onto a shared vertex buffer, given the indices of each of our
+        // transformed points in that buffer.
+        virtual Polygon *cloneShared(int indices[], Point *vertices, Point *transVertices);
+
         // Undo any transformations applied to this polygon.
         virtual void reset();
 
-        // Perform an affine or perspective transformation on this polygon.
+        // Perform an affine or perspective transformation on this polygon. Vertices shared with
+        // a model are transformed by that model instead, so that each one is only touched once.
         void transform(Matrix *matrix);
 
-        // Perform a perspective transformation on this polygon given a projection matrix.
+        // Perform a perspective transformation on this polygon given a projection matrix. The same
+        // caveat for shared vertices as above applies.
         void project(Matrix *matrix);
 
-        // Perform a frustum cull on this polygon.
-        virtual void cull(Frustum *frustum);
+        // Perform a frustum cull on this polygon. If the polygon needs to be clipped, its clipped outline
+        // is allocated out of the scratch arena, which must not be reset until after this polygon is drawn.
+        // Only planes whose bit is set in planeMask are checked, the rest are known to contain the polygon.
+        virtual void cull(Frustum *frustum, ScratchArena *scratch, unsigned int planeMask);
 
         // Draw this model to the given surface.
         virtual void draw(Screen *screen);
 
+        // Whether this polygon is skipped by the screen when it faces away from the viewer, meaning
+        // a model can safely throw it away before clipping when it knows it faces away.
+        virtual bool isBackFaceCulled();
+
+        // How this polygon draws itself, so that a model whose polygons all draw the same way can draw
+        // them all in one go instead of asking each polygon in turn.
+        virtual int getDrawMode();
+
     protected:
-        Point **polyPoints;
+        void _setup(int indices[], int length);
+
+        // Whether we've been culled, clipped or had our highlights changed since we were last reset.
+        bool _isDirty();
+
+        // The untransformed and transformed vertices that our indices refer to. These are either
+        // owned by this polygon or shared with every other polygon in a model.
+        Point *vertices;
+        Point *transVertices;
+        bool ownsVertices;
+
+        int *indices;
         bool *highlights;
         int polyLength;
 
+        // Our outline, pointing at each of our corners in transVertices. This never changes.
+        Point **basePoints;
+
+        // The transformed (and culled) outline of this polygon. When we aren't clipped this is simply
+        // our base outline and highlights, otherwise it lives in a scratch arena.
         Point **transPoints;
         bool *transHighlights;
         int transPolyLength;
 
+        bool clipped;
         bool culled;
 };
 
@@ -49,36 +93,153 @@ class OccludedWireframePolygon : public Polygon {
         OccludedWireframePolygon(Point *x, Point *y, Point *z);
         OccludedWireframePolygon(Point *points[], int length);
 
+        OccludedWireframePolygon(int indices[], int length, Point *vertices, Point *transVertices);
+
         // Clone this exact class of polygon.
         virtual Polygon *clone();
+        virtual Polygon *cloneShared(int indices[], Point *vertices, Point *transVertices);
         virtual void draw(Screen *screen);
+        virtual bool isBackFaceCulled();
+        virtual int getDrawMode();
+};
+
+// Plain lines along highlighted edges, which a model can draw once for every polygon sharing an edge.
+#define DRAW_MODE_WIREFRAME 0
+
+// Filled in to hide what's behind, which a model hands to the screen all at once.
+#define DRAW_MODE_OCCLUDED 1
+
+// Polygons that don't all draw the same way, so each one draws itself.
+#define DRAW_MODE_MIXED -1
+
+#define CULL_ALL_PLANES 0xFFFFFFFF
+
+// How far past edge-on (as the cosine of the angle to the viewer) a polygon needs to face before
+// a model culls it without asking the screen. This covers facet normals that were rounded on export.
+#define BACKFACE_EPSILON 0.001
+
+// An axis-aligned bounding box along with a bounding sphere around its center, used to
+// accept or reject whole groups of polygons at once.
+class Bounds {
+    public:
+        Bounds();
+
+        // Grow the box to include a point.
+        void add(Point *point);
+
+        // Grow the sphere about the box's center to include a point. Call after the box is complete.
+        void addRadius(Point *point);
+
+        Point min;
+        Point max;
+        Point center;
+        double radius;
+        bool empty;
 };
 
-typedef std::vector<int> PolyOffset;
-typedef std::map<Point, PolyOffset> NormalMap;
+// A node in a model's bounding volume hierarchy. Leaf nodes own a run of polygons, interior
+// nodes have two children whose bounds are contained by this one.
+class BVHNode {
+    public:
+        Bounds bounds;
+        int left;
+        int right;
+        int start;
+        int end;
+};
 
-#define FLAGS_WIREFRAME 0x0
-#define FLAGS_OCCLUDED  0x1
+// An edge between two welded vertices, along with the range of edgeFaces that share it.
+class Edge {
+    public:
+        int first;
+        int second;
+        int start;
+        int length;
+
+        // The largest angle in degrees between the normals of any two polygons sharing this edge.
+        double angle;
+};
+
+// One polygon's use of an edge, given as the polygon and the index of the corner that starts the edge.
+class EdgeFace {
+    public:
+        int polygon;
+        int corner;
+};
+
+#define FLAGS_WIREFRAME  0x0
+#define FLAGS_OCCLUDED   0x1
+
+// Occluded, but only drawing the outline of the model and any creases sharper than the crease angle
+// instead of every polygon edge. This kicks in when the model is culled with a projection matrix.
+#define FLAGS_SILHOUETTE 0x2
+
+#define DEFAULT_CREASE_ANGLE 30.0
+
+// STL models with enough triangles get simpler levels of detail built when they are loaded, each with
+// a quarter of the triangles of the last, stopping before any would have fewer than LOD_MIN_TRIANGLES.
+#define LOD_MIN_TRIANGLES 256
+#define LOD_REDUCTION 4
+
+// How many pixels on average each triangle should cover before a simpler level of detail is drawn.
+#define DEFAULT_LOD_TRIANGLE_SIZE 4.0
+
+// How close STL corners need to be, in model units, to be welded into one vertex. Zero only welds corners
+// that are exactly the same.
+#define DEFAULT_WELD_DISTANCE 0.0
+
+// How long a model has spent in each stage in seconds, since it was loaded or its timings were cleared.
+class ModelTimings {
+    public:
+        ModelTimings();
+
+        double transform;
+        double cull;
+        double project;
+        double draw;
+};
 
 class Model {
+    friend class ModelLoader;
+    friend class AssemblyModel;
+
     public:
         Model(Polygon *polygons[], int length);
+        // Load a model from a file, which is either an STL, a Wavefront OBJ, a binary PLY or a mesh cache written
+        // by save. Polygons in OBJ and PLY files are kept as they are instead of being split into triangles.
         Model(const char *const modelFile, int flags);
+        // The same, but also welding STL corners within weldDistance of each other, for exporters that write
+        // the same corner out with slightly different coordinates depending on which triangle it is in.
+        Model(const char *const modelFile, int flags, double weldDistance);
         ~Model();
 
+        // Write this model, along with its levels of detail and any coalescing done so far, to a mesh cache
+        // that loads without any of the work that went into it. Returns false if it couldn't be written.
+        bool save(const char *const cacheFile);
+
         // Clone this model, including any intermediate transformations applied.
         Model *clone();
 
-        // Attempt to combine adjacent polygons into a single polygon for rendering prettiness.
+        // Attempt to combine adjacent polygons into a single polygon for rendering prettiness. Polygons
+        // are combined if they share an edge and their normals are within the given number of degrees
+        // of each other. With no tolerance (or a tolerance of zero), only identical normals are combined.
         void coalesce();
+        void coalesce(double degrees);
+
+        // Set how sharp in degrees the angle between two polygons needs to be for the edge between them
+        // to be drawn when drawing silhouettes.
+        void setCreaseAngle(double degrees);
 
-        // Undo any transformations applied to this model.
+        // Undo any transformations applied to this model. Our untransformed vertices are never modified, so
+        // this only needs to tidy up after polygons which were culled or clipped since the last reset.
         void reset();
 
-        // Return a point representing the origin of this mode.
+        // Return a point representing the origin of this mode. This comes from bounds calculated when the
+        // model was loaded, so after a rotation it is the center of the rotated bounding box instead.
         Point *getOrigin();
 
         // Return a point representing the maximum x, y and z distance between two furthest points on the model.
+        // The same caveat about rotations as above applies.
         Point *getDimensions();
 
         // Perform an affine or perspective transformation on this model.
@@ -87,17 +248,233 @@ class Model {
         // Perform a perspective transformation on this model given a projection matrix.
         void project(Matrix *matrix);
 
-        // Perform a frustum cull on this model given a set of planes making up a frustum.
+        // Perform a frustum cull on this model given a set of planes making up a frustum. Whole groups of
+        // polygons are accepted or rejected at once, and only polygons that straddle a plane get clipped.
+        // Given the projection matrix we will be projected with, polygons that the screen would skip for
+        // facing away from the viewer are culled first, so they are never clipped either. Which way they
+        // face comes from the normal order of the screen we will be drawn to, which shouldn't change before
+        // we are drawn. This is also where a level of detail is picked for the rest of the frame, based on
+        // how big we'll be on screen.
         void cull(Frustum *frustum);
+        void cull(Frustum *frustum, Matrix *projection, Screen *screen);
 
         // Draw this model to the given surface.
         void draw(Screen *screen);
 
+        // Set how many pixels on average each triangle facing the viewer should cover before a simpler level
+        // of detail is drawn instead. Smaller sizes keep more detail at the cost of frame time. This replaces
+        // any sizes set with setLODSize.
+        void setLODTriangleSize(double pixels);
+
+        // Set the largest size on screen in pixels, across our bounding sphere, that the given level of
+        // detail gets drawn at. Level zero is the full model and is drawn whenever no other level fits.
+        void setLODSize(int level, double pixels);
+
+        // Return how many levels of detail there are including the full model, and which one the last
+        // cull picked.
+        int getLODLength();
+        int getLOD();
+
+        // Set the threads that transforming, culling and projecting large models is split across, or NULL
+        // to do everything on the calling thread. Models share a pool with a thread for every core by default.
+        // Results are identical however the work ends up split.
+        void setThreadPool(ThreadPool *pool);
+
+        // Copy out how long we have spent in each stage so far, or start counting again from zero.
+        void getTimings(ModelTimings *timings);
+        void clearTimings();
+
+        // Return the fraction of triangle corners in our STL file that were welded into a vertex shared
+        // with other corners. Models that weren't loaded from an STL file return zero.
+        double getWeldRatio();
+
     private:
+        Model(Point *vertices, int vertexLength, int *indices, int length, int flags);
+        Model(MeshCache *cache, MeshCacheModel *model, int flags);
+        Model(MeshCache *cache, int flags);
+        Model(MeshFile *mesh, int flags);
+        Model(const float *coords, int vertexLength, const unsigned int *tris, const float *triNormals, int length, int flags);
+
+        void _loadCache(MeshCache *cache, MeshCacheModel *model, int flags);
+        void _loadCacheLevels(MeshCache *cache, int flags);
+        bool _saveCache(FILE *fp);
+        void _setupFrame();
+        void _loadMesh(MeshFile *mesh, int flags);
+        void _loadTriangles(const float *coords, int vertexLength, const unsigned int *tris, const float *triNormals, int length, int flags);
+        void _setupPolygons(int *indices, int *offsets, int length, int flags);
+        void _setupTriangles(int *indices, int length, int flags);
+        void _buildLODs(int *indices, int length, int flags);
+        double _getProjectedSize(Matrix *projection);
+        bool _isOutside(Frustum *frustum);
+        void _parallelFor(int length, const std::function<void(int, int)> &body);
+        void _setup();
+        void _prepareVertices();
+        void _buildEdges();
+        void _buildWireframe();
+        void _drawOccluded(Screen *screen);
+        void _buildBounds();
+        int _buildBVH(int *centroidOrder, Point *centroids, int start, int end);
+        void _getTransformedBox(Bounds *bounds, Point *min, Point *max);
+        double _getTransformedScale();
+        void _cullNode(int node, Frustum *frustum, unsigned int planeMask, double scale);
+        void _cullBackFaces(Matrix *projection, int normalOrder);
+        void _buildCreases();
+        void _markFeatureEdges();
+        bool _isFeatureEdge(Edge *edge, int polygon, int corner);
+        void _drawSilhouette(Screen *screen);
+
         Polygon **polygons;
         int modelLength;
 
-        NormalMap normalMap;
+        // Every unique vertex in this model, welded together so that polygons sharing a corner
+        // share a single point which is only transformed and projected once.
+        Point *vertices;
+        Point *transVertices;
+        int vertexLength;
+        double weldRatio;
+
+        // Whether transVertices holds anything from this frame yet. The first transformation after a reset
+        // reads straight from vertices, so there is never any need to copy them over. Transformations are
+        // put off until somebody needs the vertices, and projected ones can't be put off any more.
+        bool transformed;
+        bool pending;
+        bool projected;
+
+        // Whether the last cull found us entirely outside of the frustum, so there is nothing left to do.
+        bool outside;
+
+        // Polygons that were culled or clipped since the last reset, which are the only ones needing a reset.
+        int *dirtyPolygons;
+        int dirtyLength;
+
+
+        // Where clipped polygons get their outlines from, recycled every time we are reset.
+        ScratchArena *scratch;
+
+        // Every transformation applied since we were last reset, so that bounds calculated at load
+        // can be moved along with the model instead of being recalculated.
+        Matrix *modelMatrix;
+
+        // Our bounding volume hierarchy. The root node is always first, and each node refers to a
+        // range of bvhPolygons, which are indexes into polygons.
+        std::vector<BVHNode> bvh;
+        int *bvhPolygons;
+
+        // The normal of each polygon, in the same order as polygons.
+        Point *normals;
+
+        // Every unique edge in this model, and which polygons use it.
+        std::vector<Edge> edges;
+        std::vector<EdgeFace> edgeFaces;
+
+        // The edge that each polygon corner starts, with each polygon's corners starting at its offset.
+        std::vector<int> cornerEdges;
+        std::vector<int> cornerOffsets;
+
+        // How every one of our polygons draws. Plain wireframes draw each edge in wireEdges once instead of
+        // having every polygon sharing it draw it again, and only edges with a highlight on at least one side
+        // are in wireEdges. Occluded polygons have their outlines gathered into the draw arrays and handed to
+        // the screen in one batch.
+        int drawMode;
+        std::vector<int> wireEdges;
+        Point ***drawPoints;
+        bool **drawHighlights;
+        int *drawLengths;
+        bool *drawChecks;
+
+        // Whether we draw silhouettes and creases, and whether we know which way polygons face this frame.
+        bool silhouette;
+        bool silhouetteFrame;
+        double creaseAngle;
+        bool *frontFacing;
+
+        // Whether we culled back faces ourselves this frame, and which polygons are close enough to edge-on
+        // that the screen still has to check them.
+        bool facingFrame;
+        bool *checkFacing;
+
+        // Simpler versions of this model from most to least detailed, along with the largest size on screen
+        // each one is drawn at. Whichever version was picked this frame does all of the work.
+        std::vector<Model *> lods;
+        std::vector<double> lodSizes;
+        int lod;
+        Model *active;
+
+        // Where big loops get split up, and how long we've spent doing what.
+        ThreadPool *pool;
+        ModelTimings timings;
+};
+
+// Draws one model many times over, each copy with its own transformation. Copies take turns drawing
+// through the model, so however many there are, only one copy of its geometry and per-frame buffers exists.
+class InstancedModel {
+    public:
+        // Constructor, borrowing the model to draw. It must outlive us, and is reset by every draw.
+        InstancedModel(Model *model);
+
+        // Add a copy of the model, returning its index. Copies start out untransformed.
+        int addInstance();
+
+        // Return how many copies there are.
+        int getLength();
+
+        // Undo any transformations applied to every copy.
+        void reset();
+
+        // Perform an affine transformation on one copy, or on every copy at once.
+        void transform(int instance, Matrix *matrix);
+        void transform(Matrix *matrix);
+
+        // Cull, project and draw every copy in turn. Copies entirely outside of the frustum are rejected
+        // by their bounds without touching any vertices.
+        void draw(Screen *screen, Frustum *frustum, Matrix *projection);
+
+    private:
+        Model *model;
+        std::vector<Matrix> matrices;
+};
+
+// A model made of parts, one for every solid in an STL file, each with its own bounds and transformation.
+// Parts entirely outside of the frustum are rejected whole, and parts can be moved independently of each
+// other, so an assembly can be animated without having to split it into separate files first.
+class AssemblyModel {
+    public:
+        // Load every solid with any triangles in it from the given STL file as a part of its own. Any other
+        // kind of file, and STL files with a single solid, load as a single part.
+        AssemblyModel(const char *const modelFile, int flags);
+        // The same, but also welding STL corners within weldDistance of each other, the same as Model does.
+        AssemblyModel(const char *const modelFile, int flags, double weldDistance);
+        ~AssemblyModel();
+
+        // Return how many parts there are, and one of them. Parts belong to us, and are reset by every draw.
+        int getLength();
+        Model *getPart(int part);
+
+        // Coalesce every part, the same as Model::coalesce.
+        void coalesce();
+        void coalesce(double degrees);
+
+        // Return the center and size of the bounds around every part, as loaded.
+        Point *getOrigin();
+        Point *getDimensions();
+
+        // Undo any transformations applied to every part.
+        void reset();
+
+        // Perform an affine transformation on one part, or on every part at once. Like a model, each
+        // transformation goes on the outside of the ones before it, so a part moved on its own before the
+        // whole assembly is moved stays where it is relative to the rest.
+        void transform(int part, Matrix *matrix);
+        void transform(Matrix *matrix);
+
+        // Cull, project and draw every part in turn.
+        void draw(Screen *screen, Frustum *frustum, Matrix *projection);
+
+    private:
+        std::vector<Model *> parts;
+        std::vector<Matrix> matrices;
+        Point min;
+        Point max;
 };
 
 #endif
@@ -0,0 +1,60 @@
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "modelloader.h"
+#include "meshcache.h"
+#include "model.h"
+
+ModelLoader::ModelLoader(const char * const modelFile, int flags) : ModelLoader(modelFile, flags, NULL) {}
+
+ModelLoader::ModelLoader(const char * const modelFile, int flags, const std::function<void(Model *)> &prepare) {
+    this->modelFile = modelFile;
+    this->flags = flags;
+    this->prepare = prepare;
+    preview = NULL;
+    model = NULL;
+    done = false;
+
+    worker = std::thread(&ModelLoader::_load, this);
+}
+
+ModelLoader::~ModelLoader() {
+    // A model can't be abandoned halfway through loading, so this waits for it.
+    worker.join();
+
+    delete preview.exchange(NULL);
+    delete model.exchange(NULL);
+}
+
+Model *ModelLoader::takeModel() {
+    return model.exchange(NULL, std::memory_order_acquire);
+}
+
+Model *ModelLoader::takePreview() {
+    if (done.load(std::memory_order_acquire)) { return NULL; }
+    return preview.exchange(NULL, std::memory_order_acquire);
+}
+
+bool ModelLoader::isDone() {
+    return done.load(std::memory_order_acquire);
+}
+
+void ModelLoader::_load() {
+    // Only this thread gets nicer, not the whole process.
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), MODEL_LOADER_NICE);
+
+    // Mesh caches already hold their simplest level of detail, so it can go out before anything else.
+    {
+        MeshCache cache(modelFile.c_str());
+        if (cache.isValid() && cache.getLength() > 1) {
+            Model *coarse = new Model(&cache, cache.getModel(cache.getLength() - 1), flags);
+            if (prepare) { prepare(coarse); }
+            preview.store(coarse, std::memory_order_release);
+        }
+    }
+
+    Model *full = new Model(modelFile.c_str(), flags);
+    if (prepare) { prepare(full); }
+    model.store(full, std::memory_order_release);
+    done.store(true, std::memory_order_release);
+}
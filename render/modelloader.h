@@ -0,0 +1,54 @@
+#ifndef MODELLOADER_H
+#define MODELLOADER_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+class Model;
+
+// How much nicer than the render loop the loading thread is, so that it only gets the time left over
+// between frames instead of making them late.
+#define MODEL_LOADER_NICE 10
+
+// Loads a model on a thread of its own, so that whoever is drawing can keep drawing while it happens.
+// Models are handed over whole once they are ready, and nothing about them is touched by the loading
+// thread afterwards. Mesh caches also hand over their simplest level of detail first, which is ready
+// almost straight away and can be drawn until the full model turns up.
+class ModelLoader {
+    public:
+        // Start loading the given file, which can be anything the Model constructor takes. When given,
+        // prepare is run on the loading thread on the preview and the full model before either is handed
+        // over, for work like coalescing that would otherwise hold up a frame.
+        ModelLoader(const char * const modelFile, int flags);
+        ModelLoader(const char * const modelFile, int flags, const std::function<void(Model *)> &prepare);
+
+        // Wait for loading to finish, and delete anything that nobody took.
+        ~ModelLoader();
+
+        // Return the full model if it is ready, or NULL if it isn't yet. The caller owns the model, so it
+        // is only ever returned once.
+        Model *takeModel();
+
+        // Return the preview if there is one and the full model isn't ready yet, or NULL otherwise. The
+        // caller owns the preview, so it is only ever returned once.
+        Model *takePreview();
+
+        // Whether the full model is ready, whether or not it has been taken.
+        bool isDone();
+
+    private:
+        void _load();
+
+        std::string modelFile;
+        int flags;
+        std::function<void(Model *)> prepare;
+
+        std::atomic<Model *> preview;
+        std::atomic<Model *> model;
+        std::atomic<bool> done;
+        std::thread worker;
+};
+
+#endif
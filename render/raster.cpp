@@ -1,11 +1,18 @@
 #include <cstdio>
 #include <cstring>
 #include <cmath>
+#include <ctime>
 #include <limits>
 #include <unistd.h>
 #include "raster.h"
 #include "common.h"
 
+// How many pixels worth of slope to push unlit fills back by, and how much to push them back by regardless.
+// Lines truncate their endpoints to whole pixels while fills sample pixel centers, so a line can land up to
+// a pixel and a half away from the fill in each direction.
+#define UNLIT_SLOPE_BIAS 3.0
+#define UNLIT_DEPTH_BIAS 0.0001
+
 UV::UV(double reqU, double reqV) : u(reqU), v(reqV) {
     // Basically a struct with read-only members.
 }
@@ -132,6 +139,13 @@ Screen::Screen(int reqWidth, int reqHeight) : width(reqWidth), height(reqHeight)
     this->normalOrder = NORMAL_ORDER_CCW;
     this->maskScreen = 0;
     this->texScreen = 0;
+    this->frameRing = NULL;
+    this->frameRingOpened = false;
+    this->packedFrame = NULL;
+    this->lastPackedFrame = NULL;
+    this->lastPublished = 0;
+    this->lastVBlank = 0;
+    this->vblankWaited = false;
 }
 
 Screen::~Screen() {
@@ -145,6 +159,12 @@ Screen::~Screen() {
         delete this->texScreen;
         this->texScreen = 0;
     }
+    if (this->frameRing) {
+        frameRingClose(this->frameRing);
+        this->frameRing = NULL;
+    }
+    free(this->packedFrame);
+    free(this->lastPackedFrame);
 }
 
 void Screen::setNormalOrder(int normalOrder) {
@@ -156,6 +176,10 @@ void Screen::setNormalOrder(int normalOrder) {
     }
 }
 
+int Screen::getNormalOrder() {
+    return normalOrder;
+}
+
 void Screen::clear() {
     memset(pixBuf, 0, width * height);
 
@@ -165,20 +189,58 @@ void Screen::clear() {
 }
 
 void Screen::waitForVBlank() {
-    static unsigned long lastFrame = 0xFFFFFFFFFFFFFFFFL;
+    waitForVBlank(-1);
+}
+
+int Screen::waitForVBlank(int timeoutMicros) {
+    struct timespec deadline;
+    if (timeoutMicros >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeoutMicros / 1000000;
+        deadline.tv_nsec += (long)(timeoutMicros % 1000000) * 1000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    // The driver wakes us up directly when it can, which is both cheaper and more punctual than polling.
+    FrameRing *ring = _getFrameRing();
+    if (ring) {
+        uint32_t seen = vblankWaited ? (uint32_t)lastVBlank : frameRingRefreshes(ring);
+        uint32_t refreshes = frameRingWaitForRefresh(ring, seen, timeoutMicros >= 0 ? &deadline : NULL);
+
+        lastVBlank = refreshes;
+        vblankWaited = true;
+        return (int)(refreshes - seen);
+    }
 
     while( 1 ) {
-        unsigned long curFrame = lastFrame;
+        unsigned long curFrame = lastVBlank;
+        bool known = false;
 
         FILE *fp = fopen("/sign/lastframe", "rb");
         if (fp != NULL) {
-            (void)!fread(&curFrame, 1, sizeof(curFrame), fp);
+            known = fread(&curFrame, 1, sizeof(curFrame), fp) == sizeof(curFrame);
             fclose(fp);
         }
 
-        if (curFrame != lastFrame) {
-            lastFrame = curFrame;
-            return;
+        if (known && !vblankWaited) {
+            // Nothing to compare against yet, so wait for the next one from here.
+            lastVBlank = curFrame;
+            vblankWaited = true;
+        } else if (known && curFrame != lastVBlank) {
+            int skipped = (int)(curFrame - lastVBlank);
+            lastVBlank = curFrame;
+            return skipped;
+        }
+
+        if (timeoutMicros >= 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+                return 0;
+            }
         }
 
         // Give it a rest.
@@ -190,6 +252,8 @@ void Screen::renderFrame() {
     // This only makes sense if we are the right size. Otherwise we may be used for textures.
     if (width != SIGN_WIDTH || height != SIGN_HEIGHT) { return; }
 
+    if (_queueFrame(FRAME_PRESENT_NOW, 0)) { return; }
+
     FILE *fp = fopen("/sign/frame.bin", "wb");
     if (fp != NULL) {
         (void)!fwrite(pixBuf, 1, SIGN_WIDTH * SIGN_HEIGHT, fp);
@@ -197,6 +261,19 @@ void Screen::renderFrame() {
     }
 }
 
+bool Screen::renderFrameAt(unsigned long long presentMicros) {
+    return _queueFrame(FRAME_PRESENT_AT_TIME, (uint64_t)presentMicros * 1000ULL);
+}
+
+bool Screen::renderFrameOnRefresh(unsigned long refresh) {
+    return _queueFrame(FRAME_PRESENT_AT_REFRESH, (uint32_t)refresh);
+}
+
+unsigned long Screen::getRefreshCount() {
+    FrameRing *ring = _getFrameRing();
+    return ring ? frameRingRefreshes(ring) : 0;
+}
+
 Texture *Screen::renderTexture() {
     return new Texture(width, height, pixBuf);
 }
@@ -492,6 +569,35 @@ bool Screen::_isBackFacing(Point *first, Point *second, Point *third) {
     }
 }
 
+void Screen::_clearRect(Point *points[], int length) {
+    // Everything drawn for these points lands within their bounding box, so that's all that
+    // needs wiping, instead of the whole screen for every polygon.
+    double minX = points[0]->x;
+    double minY = points[0]->y;
+    double maxX = points[0]->x;
+    double maxY = points[0]->y;
+
+    for (int i = 1; i < length; i++) {
+        minX = MIN(minX, points[i]->x);
+        minY = MIN(minY, points[i]->y);
+        maxX = MAX(maxX, points[i]->x);
+        maxY = MAX(maxY, points[i]->y);
+    }
+
+    int startX = (int)MAX(floor(minX), 0.0);
+    int startY = (int)MAX(floor(minY), 0.0);
+    int endX = (int)MIN(ceil(maxX), (double)(width - 1));
+    int endY = (int)MIN(ceil(maxY), (double)(height - 1));
+    if (startX > endX) { return; }
+
+    for (int y = startY; y <= endY; y++) {
+        memset(&pixBuf[startX + (y * width)], 0, endX - startX + 1);
+        for (int x = startX; x <= endX; x++) {
+            zBuf[x + (y * width)] = std::numeric_limits<double>::infinity();
+        }
+    }
+}
+
 Screen *Screen::_getMaskScreen() {
     maskScreen = (maskScreen == NULL) ? new Screen(width, height) : maskScreen;
     return maskScreen;
@@ -502,13 +608,46 @@ Screen *Screen::_getTexScreen() {
     return texScreen;
 }
 
+FrameRing *Screen::_getFrameRing() {
+    if (!frameRingOpened) {
+        frameRing = frameRingOpen();
+        frameRingOpened = true;
+    }
+
+    return frameRing;
+}
+
+bool Screen::_queueFrame(uint32_t present, uint64_t presentAt) {
+    if (width != SIGN_WIDTH || height != SIGN_HEIGHT) { return false; }
+
+    FrameRing *ring = _getFrameRing();
+    if (!ring) { return false; }
+
+    if (!packedFrame) {
+        packedFrame = (unsigned char *)malloc(FRAME_PACKED_SIZE);
+        lastPackedFrame = (unsigned char *)malloc(FRAME_PACKED_SIZE);
+    }
+
+    // Pack it down, and let the ring send only the rows that changed since the last one.
+    framePack(pixBuf, packedFrame);
+    uint64_t frame = frameRingQueue(ring, packedFrame, lastPublished ? lastPackedFrame : NULL, lastPublished, present, presentAt);
+    if (!frame) { return false; }
+
+    lastPublished = frame;
+    unsigned char *swap = lastPackedFrame;
+    lastPackedFrame = packedFrame;
+    packedFrame = swap;
+    return true;
+}
+
 void Screen::drawOccludedTri(Point *first, Point *second, Point *third) {
     // Don't draw this if it is back-facing.
     if (_isBackFacing(first, second, third)) { return; }
 
     // First, we draw the border, so that we have the "texture" to pull from when we want to outline the triangle.
+    Point *points[3] = {first, second, third};
     Screen *mask = _getMaskScreen();
-    mask->clear();
+    mask->_clearRect(points, 3);
     mask->drawTri(first, second, third, true);
 
     // Now, draw the "texture".
@@ -520,14 +659,15 @@ void Screen::drawOccludedQuad(Point *first, Point *second, Point *third, Point *
     if (_isBackFacing(first, second, fourth)) { return; }
 
     // First, we draw the border, so that we have the "texture" to pull from when we want to outline the quad.
+    Point *points[4] = {first, second, third, fourth};
     Screen *mask = _getMaskScreen();
     Screen *tex = _getTexScreen();
 
-    mask->clear();
+    mask->_clearRect(points, 4);
     mask->drawTri(first, second, fourth, true);
     mask->drawTri(second, third, fourth, true);
 
-    tex->clear();
+    tex->_clearRect(points, 4);
     tex->drawQuad(first, second, third, fourth, true);
 
     // Now, draw the "texture" in two quads.
@@ -555,13 +695,13 @@ void Screen::drawOccludedPolygon(Point *points[], int length) {
     Screen *tex = _getTexScreen();
 
     // Draw the mask of which edges we need to include.
-    mask->clear();
+    mask->_clearRect(points, length);
     for (int i = 0; i < length - 2; i++) {
         mask->drawTri(points[i], points[i + 1], points[length - 1], true);
     }
 
     // Draw the outline.
-    tex->clear();
+    tex->_clearRect(points, length);
     for (int i = 0; i < length; i++) {
         int j = (i + 1) % length;
         tex->drawLine(points[i], points[j], true);
@@ -578,15 +718,16 @@ void Screen::drawOccludedTri(Point *first, Point *second, Point *third, bool dra
     if (_isBackFacing(first, second, third)) { return; }
 
     // First, we draw the border, so that we have the "texture" to pull from when we want to outline the triangle.
+    Point *points[3] = {first, second, third};
     Screen *tex = _getTexScreen();
-    tex->clear();
+    tex->_clearRect(points, 3);
     if (drawFirst) { tex->drawLine(first, second, true); }
     if (drawSecond) { tex->drawLine(second, third, true); }
     if (drawThird) { tex->drawLine(third, first, true); }
 
     // Now, highlight the triangle itself so we don't get jaggies around edges due to floating point error.
     Screen *mask = _getMaskScreen();
-    mask->clear();
+    mask->_clearRect(points, 3);
     mask->drawTri(first, second, third, true);
 
     // Now, draw the "texture".
@@ -598,8 +739,9 @@ void Screen::drawOccludedQuad(Point *first, Point *second, Point *third, Point *
     if (_isBackFacing(first, second, fourth)) { return; }
 
     // First, we draw the border, so that we have the "texture" to pull from when we want to outline the quad.
+    Point *points[4] = {first, second, third, fourth};
     Screen *tex = _getTexScreen();
-    tex->clear();
+    tex->_clearRect(points, 4);
     if (drawFirst) { tex->drawLine(first, second, true); }
     if (drawSecond) { tex->drawLine(second, third, true); }
     if (drawThird) { tex->drawLine(third, fourth, true); }
@@ -607,7 +749,7 @@ void Screen::drawOccludedQuad(Point *first, Point *second, Point *third, Point *
 
     // Now, highlight the triangles themselves we don't get jaggies around edges due to floating point error.
     Screen *mask = _getMaskScreen();
-    mask->clear();
+    mask->_clearRect(points, 4);
     mask->drawTri(first, second, fourth, true);
     mask->drawTri(second, third, fourth, true);
 
@@ -633,7 +775,7 @@ void Screen::drawOccludedPolygon(Point *points[], bool draws[], int length) {
 
     // First, we draw the border, so that we have the "texture" to pull from when we want to outline the shape.
     Screen *tex = _getTexScreen();
-    tex->clear();
+    tex->_clearRect(points, length);
 
     for (int i = 0; i < length; i++) {
         int j = (i + 1) % length;
@@ -644,7 +786,7 @@ void Screen::drawOccludedPolygon(Point *points[], bool draws[], int length) {
 
     // Highlight the mask of the polygons we'll draw so we don't get jaggies on edgse due to floating point rounding.
     Screen *mask = _getMaskScreen();
-    mask->clear();
+    mask->_clearRect(points, length);
 
     for (int i = 0; i < length - 2; i++) {
         mask->drawTri(points[i], points[i + 1], points[length - 1], true);
@@ -656,6 +798,98 @@ void Screen::drawOccludedPolygon(Point *points[], bool draws[], int length) {
     }
 }
 
+void Screen::drawOccludedPolygons(Point **points[], bool *draws[], int lengths[], bool checks[], int count) {
+    // Grab our scratch screens once up front, rather than for every polygon.
+    Screen *tex = _getTexScreen();
+    Screen *mask = _getMaskScreen();
+
+    for (int p = 0; p < count; p++) {
+        Point **polygon = points[p];
+        int length = lengths[p];
+        if (length < 3) { continue; }
+
+        // Only check which way this faces if whoever handed it to us doesn't already know.
+        if (checks[p] && _isBackFacing(polygon[0], polygon[1], polygon[length - 1])) { continue; }
+
+        // Same as drawOccludedPolygon from here on.
+        tex->_clearRect(polygon, length);
+        for (int i = 0; i < length; i++) {
+            if (draws[p][i]) {
+                tex->drawLine(polygon[i], polygon[(i + 1) % length], true);
+            }
+        }
+
+        mask->_clearRect(polygon, length);
+        for (int i = 0; i < length - 2; i++) {
+            mask->drawTri(polygon[i], polygon[i + 1], polygon[length - 1], true);
+        }
+
+        for (int i = 0; i < length - 2; i++) {
+            _drawOccludedTri(polygon[i], polygon[i + 1], polygon[length - 1], mask, tex);
+        }
+    }
+}
+
+void Screen::drawUnlitTri(Point *first, Point *second, Point *third) {
+    // Calculate the bounds.
+    int minX = (int)MIN(MIN(first->x, second->x), third->x);
+    int minY = (int)MIN(MIN(first->y, second->y), third->y);
+    int maxX = (int)MAX(MAX(first->x, second->x), third->x);
+    int maxY = (int)MAX(MAX(first->y, second->y), third->y);
+
+    if (minX >= width || maxX < 0) { return; }
+    if (minY >= height || maxY < 0) { return; }
+
+    // Since 1/W is linear in screen space, work out how fast it changes across the screen.
+    double ax = second->x - first->x;
+    double ay = second->y - first->y;
+    double aw = second->z - first->z;
+    double bx = third->x - first->x;
+    double by = third->y - first->y;
+    double bw = third->z - first->z;
+    double det = (ax * by) - (ay * bx);
+    if (det == 0.0) {
+        // Edge-on, so there's nothing to fill.
+        return;
+    }
+
+    double dwdx = ((aw * by) - (bw * ay)) / det;
+    double dwdy = ((bw * ax) - (aw * bx)) / det;
+    double slopeBias = UNLIT_SLOPE_BIAS * MAX(fabs(dwdx), fabs(dwdy));
+
+    for (int y = MAX(minY, 0); y <= MIN(maxY, height - 1); y++) {
+        for (int x = MAX(minX, 0); x <= MIN(maxX, width - 1); x++) {
+            // Work out where we are on the triangle, and make sure we stay within its bounds.
+            double px = (x + 0.5) - first->x;
+            double py = (y + 0.5) - first->y;
+            double u = ((px * by) - (py * bx)) / det;
+            double v = ((py * ax) - (px * ay)) / det;
+
+            if (u < 0.0 || v < 0.0 || (u + v) > 1.0) {
+                continue;
+            }
+
+            // 1/W is negative for anything in front of us, so pushing it back means moving towards zero.
+            double w = (first->z + (u * aw) + (v * bw)) * (1.0 - UNLIT_DEPTH_BIAS) + slopeBias;
+            if (w >= 0.0) {
+                continue;
+            }
+
+            drawPixel(x, y, w, false);
+        }
+    }
+}
+
+void Screen::drawUnlitPolygon(Point *points[], int length) {
+    // Don't draw this if it isn't at least a 3-poly.
+    if (length < 3) { return; }
+
+    // Draw the polygon in length-2 triangles.
+    for (int i = 0; i < length - 2; i++) {
+        drawUnlitTri(points[i], points[i + 1], points[length - 1]);
+    }
+}
+
 void Screen::drawTexturedCulledTri(Point *first, Point *second, Point *third, UV *firstTex, UV *secondTex, UV *thirdTex, Texture *tex) {
     // Don't draw this if it is back-facing.
     if (_isBackFacing(first, second, third)) { return; }
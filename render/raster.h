@@ -2,6 +2,7 @@
 #define RASTER_H
 
 #include "matrix.h"
+#include "framering.h"
 
 #define CLAMP_MODE_NORMAL 0
 #define CLAMP_MODE_MIRROR 1
@@ -46,6 +47,7 @@ class Screen {
         // Sets the normal order for backface culling. Defaults to counter-clockwise (CCW) which matches
         // the normal order for STL triangles.
         void setNormalOrder(int normalOrder);
+        int getNormalOrder();
 
         // Wipe the screen and the Z-buffer, setting all pixels to unlit and the Z-depth for each pixel to infinity.
         void clear();
@@ -54,9 +56,31 @@ class Screen {
         // the next frame.
         void waitForVBlank();
 
-        // Render the pixels represented by this screen to the physical screen attached to this device.
+        // Identical to the above, but gives up after timeoutMicros microseconds if that is not negative. Returns
+        // how many refreshes went by since the last time this screen waited for vblank, so anything more than one
+        // means frames were missed, or 0 if the timeout ran out first.
+        int waitForVBlank(int timeoutMicros);
+
+        // Render the pixels represented by this screen to the physical screen attached to this device. This hands
+        // the frame to the driver through shared memory, falling back to writing /sign/frame.bin when that isn't
+        // available.
         void renderFrame();
 
+        // Queue the pixels represented by this screen up to be shown on the physical screen at the given time in
+        // microseconds on CLOCK_MONOTONIC, instead of as soon as possible. Frames are shown in the order they are
+        // queued, so this lets rendering work ahead of the screen and lets precomputed animations play back with
+        // exact timing. Returns false if the queue is already full, in which case waiting for vblank and trying
+        // again will work once the screen catches up, or if there is no queue to go through.
+        bool renderFrameAt(unsigned long long presentMicros);
+
+        // Identical to the above, but the frame is shown from the given refresh onwards, as counted by
+        // getRefreshCount().
+        bool renderFrameOnRefresh(unsigned long refresh);
+
+        // How many refreshes the physical screen attached to this device has finished, or 0 if that can't be
+        // found out, which also means frames can't be queued.
+        unsigned long getRefreshCount();
+
         // Returns a texture representation of this screen, useful for rendering this screen onto a polygon
         // in another scene.
         Texture *renderTexture();
@@ -98,6 +122,18 @@ class Screen {
         void drawOccludedQuad(Point *first, Point *second, Point *third, Point *fourth, bool drawFirst, bool drawSecond, bool drawThird, bool drawFourth);
         void drawOccludedPolygon(Point *points[], bool draws[], int length);
 
+        // Draw a whole batch of occluded polygons in the order given, each with its own outline, highlighted edges and
+        // length as above. Polygons whose check flag is false are already known to face us, so they are drawn without
+        // checking again. This is how a model hands over everything it wants drawn in one go.
+        void drawOccludedPolygons(Point **points[], bool *draws[], int lengths[], bool checks[], int count);
+
+        // Fill in a triangle or arbitrary convex polygon with unlit pixels and no highlighted border, so that anything
+        // behind it is hidden. Unlike the above this draws regardless of which way the polygon faces. The depth written
+        // is pushed back by a little over a pixel's worth of the polygon's slope, so that lines drawn along its edges
+        // afterwards are never hidden by the polygon itself.
+        void drawUnlitTri(Point *first, Point *second, Point *third);
+        void drawUnlitPolygon(Point *points[], int length);
+
         // Draw a textured triangle, quad or arbitrary convex polygon with no edge intersection, using a supplied texture
         // and UV coordinates for the various points of the polygons, and respecting the Z-depth as represented on the points
         // by W which is 1/Z.
@@ -125,7 +161,10 @@ class Screen {
     private:
         Screen *_getMaskScreen();
         Screen *_getTexScreen();
+        FrameRing *_getFrameRing();
+        bool _queueFrame(uint32_t present, uint64_t presentAt);
         bool _getPixel(int x, int y);
+        void _clearRect(Point *points[], int length);
         bool _isBackFacing(Point *first, Point *second, Point *third);
         void _drawOccludedTri(Point *first, Point *second, Point *third, Screen *mask, Screen *tex);
 
@@ -134,6 +173,20 @@ class Screen {
         double *zBuf;
         Screen *maskScreen;
         Screen *texScreen;
+
+        // Opened the first time a frame is rendered or vblank is waited for, and NULL if it couldn't be.
+        FrameRing *frameRing;
+        bool frameRingOpened;
+
+        // The frame being packed up to go to the ring and the last one that went, so that only the rows that changed
+        // have to be sent. Both are allocated the first time a frame goes to the ring.
+        unsigned char *packedFrame;
+        unsigned char *lastPackedFrame;
+        uint64_t lastPublished;
+
+        // The refresh count as of the last vblank this screen waited for, if it has waited for one yet.
+        unsigned long lastVBlank;
+        bool vblankWaited;
 };
 
 #endif
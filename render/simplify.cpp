@@ -0,0 +1,414 @@
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include "simplify.h"
+#include "common.h"
+
+// How much more it costs to move a vertex away from the border of an open mesh than along the surface.
+#define SIMPLIFY_BOUNDARY_WEIGHT 1000.0
+
+// How far a triangle's normal is allowed to swing (as a cosine) when one of its corners is moved.
+#define SIMPLIFY_MIN_NORMAL_DOT 0.2
+
+Quadric::Quadric() {
+    a11 = 0.0; a12 = 0.0; a13 = 0.0; a14 = 0.0;
+    a22 = 0.0; a23 = 0.0; a24 = 0.0;
+    a33 = 0.0; a34 = 0.0;
+    a44 = 0.0;
+}
+
+void Quadric::addPlane(double a, double b, double c, double d, double weight) {
+    a11 += weight * a * a; a12 += weight * a * b; a13 += weight * a * c; a14 += weight * a * d;
+    a22 += weight * b * b; a23 += weight * b * c; a24 += weight * b * d;
+    a33 += weight * c * c; a34 += weight * c * d;
+    a44 += weight * d * d;
+}
+
+void Quadric::add(Quadric *other) {
+    a11 += other->a11; a12 += other->a12; a13 += other->a13; a14 += other->a14;
+    a22 += other->a22; a23 += other->a23; a24 += other->a24;
+    a33 += other->a33; a34 += other->a34;
+    a44 += other->a44;
+}
+
+double Quadric::error(Point *point) {
+    double x = point->x;
+    double y = point->y;
+    double z = point->z;
+
+    return (a11 * x * x) + (2.0 * a12 * x * y) + (2.0 * a13 * x * z) + (2.0 * a14 * x) +
+           (a22 * y * y) + (2.0 * a23 * y * z) + (2.0 * a24 * y) +
+           (a33 * z * z) + (2.0 * a34 * z) +
+           a44;
+}
+
+bool Quadric::optimal(Point *point) {
+    // The error is smallest where its gradient is zero, so solve for that using Cramer's rule.
+    double det = (a11 * ((a22 * a33) - (a23 * a23))) -
+                 (a12 * ((a12 * a33) - (a23 * a13))) +
+                 (a13 * ((a12 * a23) - (a22 * a13)));
+
+    // Flat or creased areas don't have a single best point, only a line or plane of them.
+    double scale = (a11 * a22 * a33) + 1e-30;
+    if (fabs(det) < 1e-9 * fabs(scale)) {
+        return false;
+    }
+
+    double bx = -a14;
+    double by = -a24;
+    double bz = -a34;
+
+    point->x = ((bx * ((a22 * a33) - (a23 * a23))) -
+                (a12 * ((by * a33) - (a23 * bz))) +
+                (a13 * ((by * a23) - (a22 * bz)))) / det;
+    point->y = ((a11 * ((by * a33) - (a23 * bz))) -
+                (bx * ((a12 * a33) - (a23 * a13))) +
+                (a13 * ((a12 * bz) - (by * a13)))) / det;
+    point->z = ((a11 * ((a22 * bz) - (by * a23))) -
+                (a12 * ((a12 * bz) - (by * a13))) +
+                (bx * ((a12 * a23) - (a22 * a13)))) / det;
+    return true;
+}
+
+static void _triangleNormal(Point *first, Point *second, Point *third, Point *normal) {
+    double ax = second->x - first->x;
+    double ay = second->y - first->y;
+    double az = second->z - first->z;
+    double bx = third->x - first->x;
+    double by = third->y - first->y;
+    double bz = third->z - first->z;
+
+    normal->x = (ay * bz) - (az * by);
+    normal->y = (az * bx) - (ax * bz);
+    normal->z = (ax * by) - (ay * bx);
+}
+
+Simplifier::Simplifier(Point *vertices, int vertexLength, int *indices, int length) {
+    positions.assign(vertices, vertices + vertexLength);
+    quadrics.resize(vertexLength);
+    versions.assign(vertexLength, 0);
+    removedVertices.assign(vertexLength, false);
+    vertexTriangles.resize(vertexLength);
+
+    triangles.assign(indices, indices + (length * 3));
+    removedTriangles.assign(length, false);
+    this->length = length;
+
+    // Every vertex starts out knowing about the plane of each triangle it is a corner of, weighted by
+    // that triangle's area so that slivers don't count for much.
+    std::unordered_map<unsigned long long, int> edgeCounts;
+    for (int i = 0; i < length; i++) {
+        int *tri = &triangles[i * 3];
+        Point normal;
+        _triangleNormal(&positions[tri[0]], &positions[tri[1]], &positions[tri[2]], &normal);
+
+        double area = sqrt((normal.x * normal.x) + (normal.y * normal.y) + (normal.z * normal.z));
+        if (area > 0.0) {
+            double a = normal.x / area;
+            double b = normal.y / area;
+            double c = normal.z / area;
+            double d = -((a * positions[tri[0]].x) + (b * positions[tri[0]].y) + (c * positions[tri[0]].z));
+
+            for (int j = 0; j < 3; j++) {
+                quadrics[tri[j]].addPlane(a, b, c, d, area / 2.0);
+            }
+        }
+
+        for (int j = 0; j < 3; j++) {
+            vertexTriangles[tri[j]].push_back(i);
+
+            int first = MIN(tri[j], tri[(j + 1) % 3]);
+            int second = MAX(tri[j], tri[(j + 1) % 3]);
+            edgeCounts[(((unsigned long long)first) << 32) | (unsigned long long)second]++;
+        }
+    }
+
+    // Edges along the border of an open mesh get a plane at right angles to their triangle, so that
+    // the border stays put instead of being eaten away.
+    for (int i = 0; i < length; i++) {
+        int *tri = &triangles[i * 3];
+        Point normal;
+        _triangleNormal(&positions[tri[0]], &positions[tri[1]], &positions[tri[2]], &normal);
+
+        for (int j = 0; j < 3; j++) {
+            int first = MIN(tri[j], tri[(j + 1) % 3]);
+            int second = MAX(tri[j], tri[(j + 1) % 3]);
+            if (edgeCounts[(((unsigned long long)first) << 32) | (unsigned long long)second] != 1) { continue; }
+
+            Point *start = &positions[tri[j]];
+            Point *end = &positions[tri[(j + 1) % 3]];
+            double ex = end->x - start->x;
+            double ey = end->y - start->y;
+            double ez = end->z - start->z;
+
+            double a = (ey * normal.z) - (ez * normal.y);
+            double b = (ez * normal.x) - (ex * normal.z);
+            double c = (ex * normal.y) - (ey * normal.x);
+            double planeLength = sqrt((a * a) + (b * b) + (c * c));
+            if (planeLength == 0.0) { continue; }
+
+            a /= planeLength;
+            b /= planeLength;
+            c /= planeLength;
+            double d = -((a * start->x) + (b * start->y) + (c * start->z));
+            double weight = SIMPLIFY_BOUNDARY_WEIGHT * ((ex * ex) + (ey * ey) + (ez * ez));
+
+            quadrics[tri[j]].addPlane(a, b, c, d, weight);
+            quadrics[tri[(j + 1) % 3]].addPlane(a, b, c, d, weight);
+        }
+    }
+
+    // Now, work out what collapsing every edge would cost.
+    for (auto it = edgeCounts.begin(); it != edgeCounts.end(); it++) {
+        _addCollapse((int)(it->first >> 32), (int)(it->first & 0xFFFFFFFF));
+    }
+
+    _compact();
+}
+
+bool Simplifier::_compareCollapse(const Collapse &first, const Collapse &second) {
+    // We want the cheapest collapse at the top of the heap.
+    return first.cost > second.cost;
+}
+
+void Simplifier::_addCollapse(int first, int second) {
+    Quadric quadric = quadrics[first];
+    quadric.add(&quadrics[second]);
+
+    Collapse collapse;
+    collapse.first = first;
+    collapse.second = second;
+    collapse.firstVersion = versions[first];
+    collapse.secondVersion = versions[second];
+
+    Point *start = &positions[first];
+    Point *end = &positions[second];
+    Point middle((start->x + end->x) / 2.0, (start->y + end->y) / 2.0, (start->z + end->z) / 2.0);
+
+    // Nearly flat areas can have a best point that is wildly far away, so only trust it nearby.
+    double ex = end->x - start->x;
+    double ey = end->y - start->y;
+    double ez = end->z - start->z;
+    double edgeLengthSquared = (ex * ex) + (ey * ey) + (ez * ez);
+
+    bool found = quadric.optimal(&collapse.target);
+    if (found) {
+        double dx = collapse.target.x - middle.x;
+        double dy = collapse.target.y - middle.y;
+        double dz = collapse.target.z - middle.z;
+        found = ((dx * dx) + (dy * dy) + (dz * dz)) <= edgeLengthSquared;
+    }
+
+    if (found) {
+        collapse.cost = quadric.error(&collapse.target);
+    } else {
+        // Pick the best of either end or the middle of the edge instead.
+        collapse.target = *start;
+        collapse.cost = quadric.error(start);
+
+        double cost = quadric.error(end);
+        if (cost < collapse.cost) {
+            collapse.target = *end;
+            collapse.cost = cost;
+        }
+
+        cost = quadric.error(&middle);
+        if (cost < collapse.cost) {
+            collapse.target = middle;
+            collapse.cost = cost;
+        }
+    }
+
+    heap.push_back(collapse);
+    std::push_heap(heap.begin(), heap.end(), _compareCollapse);
+}
+
+bool Simplifier::_isManifold(int first, int second) {
+    // Collapsing an edge is only safe if the only vertices both ends share are the opposite corners
+    // of the triangles along that edge. Otherwise we would pinch the surface together.
+    std::vector<int> neighbours;
+    int shared = 0;
+
+    for (size_t i = 0; i < vertexTriangles[first].size(); i++) {
+        int t = vertexTriangles[first][i];
+        if (removedTriangles[t]) { continue; }
+
+        int *tri = &triangles[t * 3];
+        bool hasSecond = (tri[0] == second) || (tri[1] == second) || (tri[2] == second);
+        shared += hasSecond ? 1 : 0;
+
+        for (int j = 0; j < 3; j++) {
+            if (tri[j] != first && tri[j] != second) {
+                neighbours.push_back(tri[j]);
+            }
+        }
+    }
+
+    std::sort(neighbours.begin(), neighbours.end());
+    neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+
+    std::vector<int> common;
+    for (size_t i = 0; i < vertexTriangles[second].size(); i++) {
+        int t = vertexTriangles[second][i];
+        if (removedTriangles[t]) { continue; }
+
+        int *tri = &triangles[t * 3];
+        for (int j = 0; j < 3; j++) {
+            if (tri[j] != first && tri[j] != second && std::binary_search(neighbours.begin(), neighbours.end(), tri[j])) {
+                common.push_back(tri[j]);
+            }
+        }
+    }
+
+    std::sort(common.begin(), common.end());
+    common.erase(std::unique(common.begin(), common.end()), common.end());
+
+    return shared > 0 && (int)common.size() <= shared;
+}
+
+bool Simplifier::_isFlipped(int vertex, int other, Point *target) {
+    for (size_t i = 0; i < vertexTriangles[vertex].size(); i++) {
+        int t = vertexTriangles[vertex][i];
+        if (removedTriangles[t]) { continue; }
+
+        // Triangles along the edge itself are going away.
+        int *tri = &triangles[t * 3];
+        if (tri[0] == other || tri[1] == other || tri[2] == other) { continue; }
+
+        Point *corners[3];
+        Point *moved[3];
+        for (int j = 0; j < 3; j++) {
+            corners[j] = &positions[tri[j]];
+            moved[j] = (tri[j] == vertex) ? target : corners[j];
+        }
+
+        Point before;
+        Point after;
+        _triangleNormal(corners[0], corners[1], corners[2], &before);
+        _triangleNormal(moved[0], moved[1], moved[2], &after);
+
+        double beforeLength = sqrt((before.x * before.x) + (before.y * before.y) + (before.z * before.z));
+        double afterLength = sqrt((after.x * after.x) + (after.y * after.y) + (after.z * after.z));
+        if (beforeLength == 0.0) { continue; }
+        if (afterLength == 0.0) { return true; }
+
+        double dot = ((before.x * after.x) + (before.y * after.y) + (before.z * after.z)) / (beforeLength * afterLength);
+        if (dot < SIMPLIFY_MIN_NORMAL_DOT) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Simplifier::_collapse(Collapse *collapse) {
+    int first = collapse->first;
+    int second = collapse->second;
+
+    // Move the surviving vertex, and have it remember everything the other one did.
+    positions[first] = collapse->target;
+    quadrics[first].add(&quadrics[second]);
+    removedVertices[second] = true;
+    versions[first]++;
+
+    // Triangles along the edge disappear, the rest of the other vertex's triangles become ours.
+    for (size_t i = 0; i < vertexTriangles[second].size(); i++) {
+        int t = vertexTriangles[second][i];
+        if (removedTriangles[t]) { continue; }
+
+        int *tri = &triangles[t * 3];
+        if (tri[0] == first || tri[1] == first || tri[2] == first) {
+            removedTriangles[t] = true;
+            length--;
+            continue;
+        }
+
+        for (int j = 0; j < 3; j++) {
+            if (tri[j] == second) {
+                tri[j] = first;
+            }
+        }
+        vertexTriangles[first].push_back(t);
+    }
+    vertexTriangles[second].clear();
+
+    // Tidy up our own list, and work out the new cost of collapsing every edge we're now part of.
+    std::vector<int> live;
+    std::vector<int> neighbours;
+    for (size_t i = 0; i < vertexTriangles[first].size(); i++) {
+        int t = vertexTriangles[first][i];
+        if (removedTriangles[t]) { continue; }
+        live.push_back(t);
+
+        for (int j = 0; j < 3; j++) {
+            if (triangles[(t * 3) + j] != first) {
+                neighbours.push_back(triangles[(t * 3) + j]);
+            }
+        }
+    }
+    vertexTriangles[first].swap(live);
+
+    std::sort(neighbours.begin(), neighbours.end());
+    neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+    for (size_t i = 0; i < neighbours.size(); i++) {
+        _addCollapse(first, neighbours[i]);
+    }
+}
+
+void Simplifier::simplify(int length) {
+    while (this->length > length && !heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), _compareCollapse);
+        Collapse collapse = heap.back();
+        heap.pop_back();
+
+        // Skip anything made out of date by an earlier collapse.
+        if (removedVertices[collapse.first] || removedVertices[collapse.second]) { continue; }
+        if (versions[collapse.first] != collapse.firstVersion) { continue; }
+        if (versions[collapse.second] != collapse.secondVersion) { continue; }
+
+        // Skip anything that would fold the surface over or pinch it together. If a neighbour
+        // changes later this edge gets another chance.
+        if (!_isManifold(collapse.first, collapse.second)) { continue; }
+        if (_isFlipped(collapse.first, collapse.second, &collapse.target)) { continue; }
+        if (_isFlipped(collapse.second, collapse.first, &collapse.target)) { continue; }
+
+        _collapse(&collapse);
+    }
+
+    _compact();
+}
+
+void Simplifier::_compact() {
+    std::vector<int> remap(positions.size(), -1);
+    outVertices.clear();
+    outIndices.clear();
+
+    for (size_t t = 0; t < removedTriangles.size(); t++) {
+        if (removedTriangles[t]) { continue; }
+
+        for (int j = 0; j < 3; j++) {
+            int vertex = triangles[(t * 3) + j];
+            if (remap[vertex] < 0) {
+                remap[vertex] = outVertices.size();
+                outVertices.push_back(positions[vertex]);
+            }
+            outIndices.push_back(remap[vertex]);
+        }
+    }
+}
+
+int Simplifier::getLength() {
+    return length;
+}
+
+int Simplifier::getVertexLength() {
+    return outVertices.size();
+}
+
+Point *Simplifier::getVertices() {
+    return outVertices.empty() ? NULL : &outVertices[0];
+}
+
+int *Simplifier::getIndices() {
+    return outIndices.empty() ? NULL : &outIndices[0];
+}
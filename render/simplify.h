@@ -0,0 +1,85 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include <vector>
+#include "matrix.h"
+
+// The sum of squared distances to a set of planes, as a symmetric 4x4 matrix. Used to measure
+// how far a vertex has wandered from the surface it was originally part of.
+class Quadric {
+    public:
+        // Constructor (makes the empty quadric).
+        Quadric();
+
+        // Add the plane ax + by + cz + d = 0, scaled by a weight.
+        void addPlane(double a, double b, double c, double d, double weight);
+
+        // Combine with another quadric.
+        void add(Quadric *other);
+
+        // Return the error of placing a vertex at the given point.
+        double error(Point *point);
+
+        // Find the point with the least error, returning false if there isn't a unique one.
+        bool optimal(Point *point);
+
+    private:
+        double a11, a12, a13, a14;
+        double a22, a23, a24;
+        double a33, a34;
+        double a44;
+};
+
+// Simplifies a triangle mesh by repeatedly collapsing whichever edge moves the surface the least,
+// in the style of Garland and Heckbert. Simplification can be continued from where it left off,
+// so a chain of ever simpler meshes costs the same as building the simplest one.
+class Simplifier {
+    public:
+        // Constructor, taking a copy of the vertices and triangles given, three indices per triangle.
+        Simplifier(Point *vertices, int vertexLength, int *indices, int length);
+
+        // Collapse edges until there are no more than the given number of triangles left, or until no
+        // more edges can be collapsed without folding the mesh over itself.
+        void simplify(int length);
+
+        // The simplified mesh, with unused vertices removed. Pointers are valid until the next simplify.
+        int getLength();
+        int getVertexLength();
+        Point *getVertices();
+        int *getIndices();
+
+    private:
+        class Collapse {
+            public:
+                double cost;
+                int first;
+                int second;
+                int firstVersion;
+                int secondVersion;
+                Point target;
+        };
+
+        static bool _compareCollapse(const Collapse &first, const Collapse &second);
+        void _addCollapse(int first, int second);
+        bool _isManifold(int first, int second);
+        bool _isFlipped(int vertex, int other, Point *target);
+        void _collapse(Collapse *collapse);
+        void _compact();
+
+        std::vector<Point> positions;
+        std::vector<Quadric> quadrics;
+        std::vector<int> versions;
+        std::vector<bool> removedVertices;
+        std::vector<std::vector<int> > vertexTriangles;
+
+        std::vector<int> triangles;
+        std::vector<bool> removedTriangles;
+        int length;
+
+        std::vector<Collapse> heap;
+
+        std::vector<Point> outVertices;
+        std::vector<int> outIndices;
+};
+
+#endif
@@ -6,12 +6,18 @@
 #include "raster.h"
 #include "common.h"
 
+// How many frames to average stage timings over.
+#define STAGE_TIMING_FRAMES 300
+
 int main (int argc, char *argv[]) {
     printf("Running STL model tests...\n");
 
     Screen *screen = new Screen(SIGN_WIDTH, SIGN_HEIGHT);
     int count = 0;
 
+    // How many frames the model's timings have been counting since they were last cleared.
+    int timedFrames = 0;
+
     // Load the model.
     Model *model = new Model("testmodel.stl", FLAGS_OCCLUDED);
     model->coalesce();
@@ -51,8 +57,8 @@ int main (int argc, char *argv[]) {
         model->transform(effectsMatrix);
         delete effectsMatrix;
 
-        // Cull any polygons outside of our frustum.
-        model->cull(frustum);
+        // Cull any polygons outside of our frustum, or facing away from us.
+        model->cull(frustum, viewMatrix, screen);
 
         // Move the cube to where it should go.
         model->project(viewMatrix);
@@ -69,6 +75,23 @@ int main (int argc, char *argv[]) {
 
         // Keep track of location.
         count++;
+
+        // Every so often, show where the time is going.
+        timedFrames++;
+        if (timedFrames == STAGE_TIMING_FRAMES) {
+            ModelTimings timings;
+            model->getTimings(&timings);
+            model->clearTimings();
+
+            printf(
+                "Average us per frame: transform %.1f, cull %.1f, project %.1f, draw %.1f\n",
+                (timings.transform * 1000000.0) / timedFrames,
+                (timings.cull * 1000000.0) / timedFrames,
+                (timings.project * 1000000.0) / timedFrames,
+                (timings.draw * 1000000.0) / timedFrames
+            );
+            timedFrames = 0;
+        }
     }
 
     delete frustum;
@@ -128,10 +128,19 @@
 #define __H__STL_READER
 
 #include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <exception>
 #include <fstream>
 #include <sstream>
+#include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #ifdef STL_READER_NO_EXCEPTIONS
   #define STL_READER_THROW(msg) return false;
@@ -147,6 +156,26 @@
 
 namespace stl_reader {
 
+/// Tells how far welding got with the triangle corners of a stl file
+struct WeldStats {
+  /// the number of triangle corners read from the file
+  size_t numCorners;
+  /// the number of vertices left after merging corners with equal coordinates
+  size_t numExactVrts;
+  /// the number of vertices left after also merging those within the weld epsilon
+  size_t numVrts;
+
+  WeldStats () : numCorners(0), numExactVrts(0), numVrts(0) {}
+
+  /// returns the fraction of corners which were merged into another one
+  double ratio () const
+  {
+    if(numCorners == 0)
+      return 0;
+    return 1.0 - static_cast<double>(numVrts) / static_cast<double>(numCorners);
+  }
+};
+
 /// Reads an ASCII or binary stl file into several arrays
 /** Reads a stl file and writes its coordinates, normals and triangle-corner-indices
  * to the provided containers. It also fills a container solidRangesOut, which
@@ -154,6 +183,10 @@ namespace stl_reader {
  *
  * Double vertex entries are removed on the fly, so that triangle corners with
  * equal coordinates are represented by a single coordinate entry in coordsOut.
+ * Given a weld epsilon, vertices closer to each other than that are merged as
+ * well, which catches corners that exporters wrote out with slightly different
+ * coordinates. Triangles which lose a corner that way are removed along with
+ * their normals.
  * 
  *
  * \param filename  [in] The name of the file which shall be read
@@ -186,6 +219,16 @@ namespace stl_reader {
  *                              The type TIndexContainer should have the same interface
  *                              as std::vector<size_t>.
  *
+ * \param weldEpsilon [in] Vertices at most this far from each other are merged into
+ *                         one. Each vertex is merged into the first vertex before it
+ *                         that is close enough and wasn't merged itself, so no vertex
+ *                         moves further than this and the result only depends on the
+ *                         file. With the default of 0, only exactly equal corners are
+ *                         merged.
+ *
+ * \param statsOut  [out] If given, it is filled with how many corners were read and
+ *                        how many vertices are left of them.
+ *
  * \returns true if the file was successfully read into the provided container.
  */
 template <class TNumberContainer1, class TNumberContainer2,
@@ -194,7 +237,9 @@ bool ReadStlFile(const char* filename,
                  TNumberContainer1& coordsOut,
                  TNumberContainer2& normalsOut,
                  TIndexContainer1& trisOut,
-                 TIndexContainer2& solidRangesOut);
+                 TIndexContainer2& solidRangesOut,
+                 double weldEpsilon = 0,
+                 WeldStats* statsOut = NULL);
 
 
 /// Reads an ASCII stl file into several arrays
@@ -207,7 +252,9 @@ bool ReadStlFile_ASCII(const char* filename,
                        TNumberContainer1& coordsOut,
                        TNumberContainer2& normalsOut,
                        TIndexContainer1& trisOut,
-                       TIndexContainer2& solidRangesOut);
+                       TIndexContainer2& solidRangesOut,
+                       double weldEpsilon = 0,
+                       WeldStats* statsOut = NULL);
 
 /// Reads a binary stl file into several arrays
 /** \copydetails ReadStlFile
@@ -220,7 +267,9 @@ bool ReadStlFile_BINARY(const char* filename,
                         TNumberContainer1& coordsOut,
                         TNumberContainer2& normalsOut,
                         TIndexContainer1& trisOut,
-                        TIndexContainer2& solidRangesOut);
+                        TIndexContainer2& solidRangesOut,
+                        double weldEpsilon = 0,
+                        WeldStats* statsOut = NULL);
 
 /// Determines whether a stl file has ASCII format
 /** The underlying mechanism is simply checks whether the provided file starts
@@ -242,20 +291,20 @@ public:
 
   /// initializes the mesh from the stl-file specified through filename
   /** \{ */
-  StlMesh (const char* filename)
+  StlMesh (const char* filename, double weldEpsilon = 0)
   {
-    read_file (filename);
+    read_file (filename, weldEpsilon);
   }
 
-  StlMesh (const std::string& filename)
+  StlMesh (const std::string& filename, double weldEpsilon = 0)
   {
-    read_file (filename);
+    read_file (filename, weldEpsilon);
   }
   /** \} */
 
   /// fills the mesh with the contents of the specified stl-file
   /** \{ */
-  bool read_file (const char* filename)
+  bool read_file (const char* filename, double weldEpsilon = 0)
   {
     bool res = false;
 
@@ -263,7 +312,7 @@ public:
     try {
     #endif
 
-    res = ReadStlFile (filename, coords, normals, tris, solids);
+    res = ReadStlFile (filename, coords, normals, tris, solids, weldEpsilon, &weldStats);
 
     #ifndef STL_READER_NO_EXCEPTIONS
     } catch (std::exception& e) {
@@ -275,15 +324,16 @@ public:
       normals.clear ();
       tris.clear ();
       solids.clear ();
+      weldStats = WeldStats ();
       STL_READER_THROW (e.what());
     }
 
     return res;
   }
 
-  bool read_file (const std::string& filename)
+  bool read_file (const std::string& filename, double weldEpsilon = 0)
   {
-    return read_file (filename.c_str());
+    return read_file (filename.c_str(), weldEpsilon);
   }
   /** \} */
 
@@ -400,11 +450,18 @@ public:
     return &solids[0];
   }
 
+  /// returns how many corners were read and how many vertices are left of them
+  const WeldStats& weld_stats () const
+  {
+    return weldStats;
+  }
+
 private:
   std::vector<TNumber>  coords;
   std::vector<TNumber>  normals;
   std::vector<TIndex>   tris;
   std::vector<TIndex>   solids;
+  WeldStats             weldStats;
 };
 
 
@@ -415,96 +472,409 @@ private:
 
 namespace stl_reader_impl {
 
-  // a coordinate triple with an additional index. The index is required
-  // for RemoveDoubles, so that triangles can be reindexed properly.
-  template <typename number_t, typename index_t>
-  struct CoordWithIndex {
-    number_t data[3];
-    index_t index;
+  // a read-only mapping of a whole file into memory, which is released again
+  // once it goes out of scope. 'ok' is false if the file couldn't be mapped.
+  struct MappedFile {
+    const char* data;
+    size_t size;
+    bool ok;
 
-    bool operator == (const CoordWithIndex& c) const
+    MappedFile (const char* filename) : data(NULL), size(0), ok(false)
     {
-      return (c[0] == data[0]) && (c[1] == data[1]) && (c[2] == data[2]);
+      int fd = open(filename, O_RDONLY);
+      if(fd < 0)
+        return;
+
+      struct stat st;
+      if(fstat(fd, &st) == 0){
+        size = static_cast<size_t>(st.st_size);
+        if(size == 0)
+          ok = true;
+        else{
+          void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+          if(mapped != MAP_FAILED){
+            madvise(mapped, size, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(mapped);
+            ok = true;
+          }
+        }
+      }
+      close(fd);
+    }
+
+    ~MappedFile ()
+    {
+      if(data)
+        munmap(const_cast<char*>(data), size);
+    }
+
+    // lets the kernel drop every whole page in front of 'upTo', which is
+    // already read and won't be looked at again. They stay cached on disk,
+    // but stop counting towards our resident memory.
+    void release (const char* upTo)
+    {
+      size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+      size_t length = static_cast<size_t>(upTo - data) / pageSize * pageSize;
+      if(length > 0)
+        madvise(const_cast<char*>(data), length, MADV_DONTNEED);
     }
+  };
+
+  // merges corners with exactly the same position as they come in, so that
+  // every position only ends up in 'coordsOut' once. Only the indices of the
+  // unique positions are hashed, which keeps the working set to a fraction
+  // of what sorting every corner takes.
+  template <class TNumberContainer, class TIndex>
+  struct VertexWelder {
+    typedef typename TNumberContainer::value_type number_t;
+
+    TNumberContainer& coords;
+    std::vector<TIndex> slots;
+    size_t numVrts;
 
-    bool operator != (const CoordWithIndex& c) const
+    VertexWelder (TNumberContainer& coordsOut, size_t expectedVrts) :
+      coords(coordsOut),
+      numVrts(0)
     {
-      return (c[0] != data[0]) || (c[1] != data[1]) || (c[2] != data[2]);
+      size_t numSlots = 1024;
+      while(numSlots < expectedVrts * 2)
+        numSlots *= 2;
+      slots.assign(numSlots, EmptySlot());
+      coords.reserve(expectedVrts * 3);
     }
 
-    bool operator < (const CoordWithIndex& c) const
+    static TIndex EmptySlot ()
     {
-      return (data[0] < c[0])
-          || (data[0] == c[0] && data[1] < c[1])
-          || (data[0] == c[0] && data[1] == c[1] && data[2] < c[2]);
+      return static_cast<TIndex>(-1);
     }
 
-    inline number_t& operator [] (const size_t i)   {return data[i];}
-    inline number_t operator [] (const size_t i) const  {return data[i];}
+    static size_t Hash (const number_t* p)
+    {
+      size_t hash = 0;
+      for(size_t i = 0; i < 3; ++i){
+      //  0 and -0 are the same position, so they have to hash the same too
+        float value = static_cast<float>(p[i]);
+        if(value == 0)
+          value = 0;
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        hash = (hash ^ bits) * 0x9E3779B97F4A7C15ull;
+      }
+      return hash ^ (hash >> 29);
+    }
+
+    // returns the index of the given position, adding it if it is new.
+    TIndex add (const number_t* p)
+    {
+      size_t mask = slots.size() - 1;
+      size_t slot = Hash(p) & mask;
+      while(slots[slot] != EmptySlot()){
+        const number_t* q = &coords[slots[slot] * 3];
+        if(q[0] == p[0] && q[1] == p[1] && q[2] == p[2])
+          return slots[slot];
+        slot = (slot + 1) & mask;
+      }
+
+      TIndex index = static_cast<TIndex>(numVrts++);
+      slots[slot] = index;
+      for(size_t i = 0; i < 3; ++i)
+        coords.push_back(p[i]);
+
+      if(numVrts * 2 > slots.size())
+        grow();
+      return index;
+    }
+
+    void grow ()
+    {
+      slots.assign(slots.size() * 2, EmptySlot());
+      size_t mask = slots.size() - 1;
+      for(size_t i = 0; i < numVrts; ++i){
+        size_t slot = Hash(&coords[i * 3]) & mask;
+        while(slots[slot] != EmptySlot())
+          slot = (slot + 1) & mask;
+        slots[slot] = static_cast<TIndex>(i);
+      }
+    }
   };
 
-  // sorts the array coordsWithIndexInOut and copies unique indices to coordsOut.
-  // Triangle-corners are re-indexed on the fly and degenerated triangles are removed.
-  template <class TNumberContainer, class TIndexContainer>
-  void RemoveDoubles (TNumberContainer& uniqueCoordsOut,
-                      TIndexContainer& trisInOut,
-                      std::vector <CoordWithIndex<
-                        typename TNumberContainer::value_type,
-                        typename TIndexContainer::value_type> >
-                        &coordsWithIndexInOut)
+  // calls body(begin, end) for contiguous ranges covering [0, length), each
+  // on a thread of its own, as long as there is enough work to go around.
+  template <class TBody>
+  void ParallelFor (size_t length, const TBody& body)
   {
-    using namespace std;
+    const size_t minChunk = 1 << 14;
+    size_t numThreads = std::thread::hardware_concurrency();
+    if(numThreads > length / minChunk)
+      numThreads = length / minChunk;
+    if(numThreads < 2){
+      body(0, length);
+      return;
+    }
 
-    typedef typename TNumberContainer::value_type number_t;
-    typedef typename TIndexContainer::value_type  index_t;
-
-    sort (coordsWithIndexInOut.begin(), coordsWithIndexInOut.end());
-  
-  //  first count unique indices
-    index_t numUnique = 1;
-    for(size_t i = 1; i < coordsWithIndexInOut.size(); ++i){
-      if(coordsWithIndexInOut[i] != coordsWithIndexInOut[i - 1])
-        ++numUnique;
+    size_t chunk = (length + numThreads - 1) / numThreads;
+    std::vector<std::thread> threads;
+    for(size_t begin = chunk; begin < length; begin += chunk){
+      size_t end = std::min(begin + chunk, length);
+      threads.push_back(std::thread([&body, begin, end] () {body(begin, end);}));
     }
 
-    uniqueCoordsOut.resize (numUnique * 3);
-    vector<index_t> newIndex (coordsWithIndexInOut.size());
-
-  //  copy unique coordinates to 'uniqueCoordsOut' and create an index-map
-  //  'newIndex', which allows to re-index triangles later on.
-    index_t curInd = 0;
-    newIndex[0] = 0;
-    for(index_t i = 0; i < 3; ++i)
-      uniqueCoordsOut[i] = coordsWithIndexInOut[0][i];
-
-    for(size_t i = 1; i < coordsWithIndexInOut.size(); ++i){
-      const CoordWithIndex <number_t, index_t> c = coordsWithIndexInOut[i];
-      if(c != coordsWithIndexInOut[i - 1]){
-        ++curInd;
-        for(index_t j = 0; j < 3; ++j)
-          uniqueCoordsOut[curInd * 3 + j] = coordsWithIndexInOut[i][j];
+    body(0, chunk);
+    for(size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+  }
+
+  // returns the cell of a grid with the given spacing that a coordinate is in,
+  // and which neighboring cell, -1 or 1, the coordinate is closer to.
+  inline int64_t CellOf (double coord, double spacing, int64_t& side)
+  {
+    const double limit = 4.0e18;
+    double pos = coord / spacing;
+    double cell = std::floor(pos);
+    side = (pos - cell < 0.5) ? -1 : 1;
+    if(!(cell > -limit))
+      return static_cast<int64_t>(-limit);
+    if(!(cell < limit))
+      return static_cast<int64_t>(limit);
+    return static_cast<int64_t>(cell);
+  }
+
+  inline size_t HashCell (int64_t x, int64_t y, int64_t z)
+  {
+    uint64_t hash = static_cast<uint64_t>(x) * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ static_cast<uint64_t>(y)) * 0xC2B2AE3D27D4EB4Full;
+    hash = (hash ^ static_cast<uint64_t>(z)) * 0x165667B19E3779F9ull;
+    return static_cast<size_t>(hash ^ (hash >> 32));
+  }
+
+  // merges vertices at most 'epsilon' apart. Every vertex is merged into the
+  // first vertex before it which is close enough and was kept itself, so the
+  // result only depends on the order of the vertices and never on how the
+  // search was split between threads. Triangles left with fewer than three
+  // different corners are removed along with their normals, and the solid
+  // ranges are moved to match.
+  template <class TNumberContainer1, class TNumberContainer2,
+            class TIndexContainer1, class TIndexContainer2>
+  void WeldNearbyVertices (double epsilon,
+                           TNumberContainer1& coordsInOut,
+                           TNumberContainer2& normalsInOut,
+                           TIndexContainer1& trisInOut,
+                           TIndexContainer2& solidRangesInOut)
+  {
+    using namespace std;
+
+    typedef typename TIndexContainer1::value_type index_t;
+
+    const size_t numVrts = coordsInOut.size() / 3;
+    if(numVrts == 0 || !(epsilon > 0))
+      return;
+
+  //  vertices go into a grid of cells twice 'epsilon' wide, so anything close
+  //  enough to a vertex is in its own cell or the ones on the side of the cell
+  //  it is closer to, which makes 8 cells. Cells are hashed into buckets, each
+  //  listing its vertices in order.
+    size_t numBuckets = 1;
+    while(numBuckets < numVrts)
+      numBuckets *= 2;
+    const size_t mask = numBuckets - 1;
+
+    vector<int64_t> cells(numVrts * 3);
+    vector<int64_t> sides(numVrts * 3);
+    vector<size_t> buckets(numVrts);
+    ParallelFor(numVrts, [&] (size_t begin, size_t end) {
+      for(size_t i = begin; i < end; ++i){
+        int64_t* c = &cells[i * 3];
+        for(size_t j = 0; j < 3; ++j)
+          c[j] = CellOf(coordsInOut[i * 3 + j], 2 * epsilon, sides[i * 3 + j]);
+        buckets[i] = HashCell(c[0], c[1], c[2]) & mask;
       }
+    });
+
+    vector<index_t> bucketStart(numBuckets + 1, 0);
+    for(size_t i = 0; i < numVrts; ++i)
+      ++bucketStart[buckets[i] + 1];
+    for(size_t i = 0; i < numBuckets; ++i)
+      bucketStart[i + 1] += bucketStart[i];
 
-      newIndex[c.index] = static_cast<index_t> (curInd);
+    vector<index_t> bucketVrts(numVrts);
+    {
+      vector<index_t> fill(bucketStart.begin(), bucketStart.end() - 1);
+      for(size_t i = 0; i < numVrts; ++i)
+        bucketVrts[fill[buckets[i]]++] = static_cast<index_t>(i);
     }
 
-  //  re-index triangles, so that they refer to 'uniqueCoordsOut'
-  //  make sure to only add triangles which refer to three different indices
-    index_t numUniqueTriInds = 0;
-    for(index_t i = 0; i < trisInOut.size(); i+=3){
-      int ni[3];
-      for(int j = 0; j < 3; ++j)
-        ni[j] = newIndex[trisInOut[i+j]];
-
-      if((ni[0] != ni[1]) && (ni[0] != ni[2]) && (ni[1] != ni[2])){
-        for(int j = 0; j < 3; ++j)
-          trisInOut[numUniqueTriInds + j] = ni[j];
-        numUniqueTriInds += 3;
+  //  returns the first vertex close enough to vertex i, which may be i
+  //  itself, skipping those which weren't kept if 'kept' is given.
+    const double epsilonSq = epsilon * epsilon;
+    auto findFirstClose = [&] (size_t i, const vector<char>* kept) -> size_t {
+      const int64_t* c = &cells[i * 3];
+      const int64_t* side = &sides[i * 3];
+      size_t first = i;
+
+      for(int64_t dx = 0; dx < 2; ++dx)
+      for(int64_t dy = 0; dy < 2; ++dy)
+      for(int64_t dz = 0; dz < 2; ++dz){
+        size_t bucket = HashCell(c[0] + dx * side[0], c[1] + dy * side[1],
+                                 c[2] + dz * side[2]) & mask;
+        for(index_t k = bucketStart[bucket]; k < bucketStart[bucket + 1]; ++k){
+          size_t j = bucketVrts[k];
+          if(j >= first)
+            break;
+          if(kept && !(*kept)[j])
+            continue;
+
+          double distSq = 0;
+          for(size_t l = 0; l < 3; ++l){
+            double d = coordsInOut[i * 3 + l] - coordsInOut[j * 3 + l];
+            distSq += d * d;
+          }
+          if(distSq <= epsilonSq){
+            first = j;
+            break;
+          }
+        }
+      }
+      return first;
+    };
+
+  //  the search for the first close vertex is where the work is, and can be
+  //  done for every vertex at once
+    vector<index_t> firstClose(numVrts);
+    ParallelFor(numVrts, [&] (size_t begin, size_t end) {
+      for(size_t i = begin; i < end; ++i)
+        firstClose[i] = static_cast<index_t>(findFirstClose(i, NULL));
+    });
+
+  //  going through in order, a vertex with nothing close before it is kept.
+  //  Only when the first close vertex was merged itself does the search have
+  //  to be done again, looking at kept vertices alone.
+    vector<char> kept(numVrts, 0);
+    for(size_t i = 0; i < numVrts; ++i){
+      size_t first = firstClose[i];
+      if(first != i && !kept[first]){
+        first = findFirstClose(i, &kept);
+        firstClose[i] = static_cast<index_t>(first);
+      }
+      kept[i] = (first == i);
+    }
+
+  //  pack the vertices which are left to the front
+    vector<index_t> newIndex(numVrts);
+    size_t numUnique = 0;
+    for(size_t i = 0; i < numVrts; ++i){
+      if(kept[i]){
+        for(size_t j = 0; j < 3; ++j)
+          coordsInOut[numUnique * 3 + j] = coordsInOut[i * 3 + j];
+        newIndex[i] = static_cast<index_t>(numUnique++);
+      }
+      else
+        newIndex[i] = newIndex[firstClose[i]];
+    }
+    coordsInOut.resize(numUnique * 3);
+
+  //  re-index triangles, keeping only those which still refer to three
+  //  different vertices
+    const size_t numTris = trisInOut.size() / 3;
+    size_t numKept = 0;
+    size_t solid = 0;
+    for(size_t t = 0; t < numTris; ++t){
+      while(solid < solidRangesInOut.size() && solidRangesInOut[solid] <= t)
+        solidRangesInOut[solid++] = static_cast<typename TIndexContainer2::value_type>(numKept);
+
+      index_t corners[3];
+      for(size_t j = 0; j < 3; ++j)
+        corners[j] = newIndex[trisInOut[t * 3 + j]];
+
+      if(corners[0] != corners[1] && corners[0] != corners[2] && corners[1] != corners[2]){
+        for(size_t j = 0; j < 3; ++j){
+          trisInOut[numKept * 3 + j] = corners[j];
+          normalsInOut[numKept * 3 + j] = normalsInOut[t * 3 + j];
+        }
+        ++numKept;
       }
     }
+    for(; solid < solidRangesInOut.size(); ++solid)
+      solidRangesInOut[solid] = static_cast<typename TIndexContainer2::value_type>(numKept);
 
-    if(numUniqueTriInds < trisInOut.size())
-      trisInOut.resize (numUniqueTriInds);
+    trisInOut.resize(numKept * 3);
+    normalsInOut.resize(numKept * 3);
+  }
+
+  // welds vertices within 'epsilon' of each other, once every corner has been
+  // read and welded exactly, and fills in 'statsOut' if there is one.
+  template <class TNumberContainer1, class TNumberContainer2,
+            class TIndexContainer1, class TIndexContainer2>
+  void FinishWelding (double epsilon,
+                      size_t numCorners,
+                      TNumberContainer1& coordsInOut,
+                      TNumberContainer2& normalsInOut,
+                      TIndexContainer1& trisInOut,
+                      TIndexContainer2& solidRangesInOut,
+                      WeldStats* statsOut)
+  {
+    size_t numExactVrts = coordsInOut.size() / 3;
+    WeldNearbyVertices (epsilon, coordsInOut, normalsInOut, trisInOut, solidRangesInOut);
+
+    if(statsOut){
+      statsOut->numCorners = numCorners;
+      statsOut->numExactVrts = numExactVrts;
+      statsOut->numVrts = coordsInOut.size() / 3;
+    }
+  }
+
+  // a token of a line, pointing straight into the mapped file.
+  struct Token {
+    const char* begin;
+    const char* end;
+
+    bool equals (const char* str) const
+    {
+      size_t len = strlen(str);
+      return static_cast<size_t>(end - begin) == len && memcmp(begin, str, len) == 0;
+    }
+  };
+
+  inline bool IsSpace (char c)
+  {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+  }
+
+  // finds the next token in [cur, lineEnd) and moves cur past it. Returns
+  // false if the line has no more tokens.
+  inline bool NextToken (const char*& cur, const char* lineEnd, Token& tok)
+  {
+    while(cur < lineEnd && IsSpace(*cur))
+      ++cur;
+    if(cur == lineEnd)
+      return false;
+
+    tok.begin = cur;
+    while(cur < lineEnd && !IsSpace(*cur))
+      ++cur;
+    tok.end = cur;
+    return true;
+  }
+
+  // reads the next token in [cur, lineEnd) as a number, the same way atof
+  // would but without needing a terminated string, and moves cur past it.
+  // A token that isn't a number comes out as zero. Returns false if the line
+  // has no more tokens.
+  inline bool NextNumber (const char*& cur, const char* lineEnd, double& value)
+  {
+    while(cur < lineEnd && IsSpace(*cur))
+      ++cur;
+    if(cur == lineEnd)
+      return false;
+
+    const char* begin = cur;
+    if(lineEnd - begin > 1 && *begin == '+' && begin[1] != '-')
+      ++begin;
+
+    value = 0;
+    cur = std::from_chars(begin, lineEnd, value).ptr;
+    while(cur < lineEnd && !IsSpace(*cur))
+      ++cur;
+    return true;
   }
 }// end of namespace stl_reader_impl
 
@@ -515,12 +885,16 @@ bool ReadStlFile(const char* filename,
                  TNumberContainer1& coordsOut,
                  TNumberContainer2& normalsOut,
                  TIndexContainer1& trisOut,
-                 TIndexContainer2& solidRangesOut)
+                 TIndexContainer2& solidRangesOut,
+                 double weldEpsilon,
+                 WeldStats* statsOut)
 {
   if(StlFileHasASCIIFormat(filename))
-    return ReadStlFile_ASCII(filename, coordsOut, normalsOut, trisOut, solidRangesOut);
+    return ReadStlFile_ASCII(filename, coordsOut, normalsOut, trisOut, solidRangesOut,
+                             weldEpsilon, statsOut);
   else
-    return ReadStlFile_BINARY(filename, coordsOut, normalsOut, trisOut, solidRangesOut);
+    return ReadStlFile_BINARY(filename, coordsOut, normalsOut, trisOut, solidRangesOut,
+                              weldEpsilon, statsOut);
 }
 
 
@@ -530,7 +904,9 @@ bool ReadStlFile_ASCII(const char* filename,
                        TNumberContainer1& coordsOut,
                        TNumberContainer2& normalsOut,
                        TIndexContainer1& trisOut,
-                       TIndexContainer2& solidRangesOut)
+                       TIndexContainer2& solidRangesOut,
+                       double weldEpsilon,
+                       WeldStats* statsOut)
 {
   using namespace std;
   using namespace stl_reader_impl;
@@ -543,92 +919,105 @@ bool ReadStlFile_ASCII(const char* filename,
   trisOut.clear();
   solidRangesOut.clear();
 
-  ifstream in(filename);
-  STL_READER_COND_THROW(!in, "Couldn't open file " << filename);
+  MappedFile file(filename);
+  STL_READER_COND_THROW(!file.ok, "Couldn't open file " << filename);
 
-  vector<CoordWithIndex <number_t, index_t> > coordsWithIndex;
+//  corners are welded as they are read. Facets are typically a few hundred
+//  bytes long, with about half as many vertices as there are facets.
+  VertexWelder <TNumberContainer1, index_t> welder(coordsOut, file.size / 512);
+  size_t numCorners = 0;
 
-  string buffer;
-  vector<string> tokens;
+//  lines are tokenized in place, straight out of the mapped file, and only
+//  as far as their keyword needs.
   int lineCount = 1;
-  int maxNumTokens = 0;
   size_t numFaceVrts = 0;
+  index_t corners[3];
+  number_t normal[3] = {0, 0, 0};
+
+  const char* cur = file.data;
+  const char* fileEnd = file.data + file.size;
 
-  while(!(in.eof() || in.fail()))
+  while(cur < fileEnd)
   {
-  //  read the line and tokenize.
-  //  In order to reuse memory in between lines, 'tokens' won't be cleared.
-  //  Instead we count the number of tokens using 'tokenCount'.
-    getline(in, buffer);
-
-    istringstream line(buffer);
-    int tokenCount = 0;
-    while(!(line.eof() || line.fail())){
-      if(tokenCount >= maxNumTokens){
-        maxNumTokens = tokenCount + 1;
-        tokens.resize(maxNumTokens);
-      }
-      line >> tokens[tokenCount];
-      ++tokenCount;
-    }
+    const char* lineEnd = static_cast<const char*>(memchr(cur, '\n', fileEnd - cur));
+    if(!lineEnd)
+      lineEnd = fileEnd;
 
-    if(tokenCount > 0)
+    Token tok;
+    if(NextToken(cur, lineEnd, tok))
     {
-      string& tok = tokens[0];
-      if(tok.compare("vertex") == 0){
-        if(tokenCount < 4){
-          STL_READER_THROW("ERROR while reading from " << filename <<
-            ": vertex not specified correctly in line " << lineCount);
-        }
-        
+      if(tok.equals("vertex")){
       //  read the position
-        CoordWithIndex <number_t, index_t> c;
-        for(size_t i = 0; i < 3; ++i)
-          c[i] = static_cast<number_t> (atof(tokens[i+1].c_str()));
-        c.index = static_cast<index_t>(coordsWithIndex.size());
-        coordsWithIndex.push_back(c);
+        number_t c[3];
+        for(size_t i = 0; i < 3; ++i){
+          double value;
+          if(!NextNumber(cur, lineEnd, value)){
+            STL_READER_THROW("ERROR while reading from " << filename <<
+              ": vertex not specified correctly in line " << lineCount);
+          }
+          c[i] = static_cast<number_t> (value);
+        }
+        if(numFaceVrts < 3)
+          corners[numFaceVrts] = welder.add(c);
         ++numFaceVrts;
+        ++numCorners;
       }
-      else if(tok.compare("facet") == 0)
+      else if(tok.equals("facet"))
       {
-        STL_READER_COND_THROW(tokenCount < 5,
+        Token normalTok;
+        bool complete = NextToken(cur, lineEnd, normalTok);
+        for(size_t i = 0; complete && i < 3; ++i)
+          complete = NextToken(cur, lineEnd, tok);
+
+        STL_READER_COND_THROW(!complete,
           "ERROR while reading from " << filename <<
           ": triangle not specified correctly in line " << lineCount);
         
-        STL_READER_COND_THROW(tokens[1].compare("normal") != 0,
+        STL_READER_COND_THROW(!normalTok.equals("normal"),
           "ERROR while reading from " << filename <<
           ": Missing normal specifier in line " << lineCount);
         
       //  read the normal
-        for(size_t i = 0; i < 3; ++i)
-          normalsOut.push_back (static_cast<number_t> (atof(tokens[i+2].c_str())));
+        cur = normalTok.end;
+        for(size_t i = 0; i < 3; ++i){
+          double value;
+          NextNumber(cur, lineEnd, value);
+          normal[i] = static_cast<number_t> (value);
+        }
 
         numFaceVrts = 0;
       }
-      else if(tok.compare("outer") == 0){
-        STL_READER_COND_THROW ((tokenCount < 2) || (tokens[1].compare("loop") != 0),
+      else if(tok.equals("outer")){
+        STL_READER_COND_THROW (!NextToken(cur, lineEnd, tok) || !tok.equals("loop"),
           "ERROR while reading from " << filename <<
           ": expecting outer loop in line " << lineCount);
       }
-      else if(tok.compare("endfacet") == 0){
+      else if(tok.equals("endfacet")){
         STL_READER_COND_THROW(numFaceVrts != 3,
           "ERROR while reading from " << filename <<
           ": bad number of vertices specified for face in line " << lineCount);
 
-        trisOut.push_back(static_cast<index_t> (coordsWithIndex.size() - 3));
-        trisOut.push_back(static_cast<index_t> (coordsWithIndex.size() - 2));
-        trisOut.push_back(static_cast<index_t> (coordsWithIndex.size() - 1));
+      //  only keep triangles which refer to three different vertices, along
+      //  with their normals
+        if(corners[0] != corners[1] && corners[0] != corners[2] && corners[1] != corners[2]){
+          for(size_t i = 0; i < 3; ++i){
+            normalsOut.push_back (normal[i]);
+            trisOut.push_back (corners[i]);
+          }
+        }
       }
-      else if(tok.compare("solid") == 0){
+      else if(tok.equals("solid")){
         solidRangesOut.push_back(static_cast<index_t> (trisOut.size() / 3));
       }
     }
+    cur = lineEnd + 1;
     lineCount++;
   }
 
   solidRangesOut.push_back(static_cast<index_t> (trisOut.size() / 3));
 
-  RemoveDoubles (coordsOut, trisOut, coordsWithIndex);
+  FinishWelding (weldEpsilon, numCorners, coordsOut, normalsOut, trisOut,
+                 solidRangesOut, statsOut);
 
   return true;
 }
@@ -640,7 +1029,9 @@ bool ReadStlFile_BINARY(const char* filename,
                         TNumberContainer1& coordsOut,
                         TNumberContainer2& normalsOut,
                         TIndexContainer1& trisOut,
-                        TIndexContainer2& solidRangesOut)
+                        TIndexContainer2& solidRangesOut,
+                        double weldEpsilon,
+                        WeldStats* statsOut)
 {
   using namespace std;
   using namespace stl_reader_impl;
@@ -653,48 +1044,64 @@ bool ReadStlFile_BINARY(const char* filename,
   trisOut.clear();
   solidRangesOut.clear();
 
-  ifstream in(filename, ios::binary);
-  STL_READER_COND_THROW(!in, "Couldnt open file " << filename);
+  MappedFile file(filename);
+  STL_READER_COND_THROW(!file.ok, "Couldnt open file " << filename);
 
-  char stl_header[80];
-  in.read(stl_header, 80);
-  STL_READER_COND_THROW(!in, "Error while parsing binary stl header in file " << filename);
+  STL_READER_COND_THROW(file.size < 80, "Error while parsing binary stl header in file " << filename);
 
   unsigned int numTris = 0;
-  in.read((char*)&numTris, 4);
-  STL_READER_COND_THROW(!in, "Couldnt determine number of triangles in binary stl file " << filename);
-
-  vector<CoordWithIndex <number_t, index_t> > coordsWithIndex;
-
-  for(unsigned int tri = 0; tri < numTris; ++tri){
+  STL_READER_COND_THROW(file.size < 84, "Couldnt determine number of triangles in binary stl file " << filename);
+  memcpy(&numTris, file.data + 80, 4);
+
+//  every record is 50 bytes: a normal, three corners and two bytes nobody
+//  uses. Make sure they are all there before going through them.
+  const size_t recordSize = 50;
+  STL_READER_COND_THROW((file.size - 84) / recordSize < numTris,
+    "Error while parsing trianlge in binary stl file " << filename);
+
+//  records are read straight out of the mapping and turned into unique
+//  vertices and triangles as we go. Most closed meshes have about half as
+//  many vertices as triangles.
+  normalsOut.reserve(static_cast<size_t>(numTris) * 3);
+  trisOut.reserve(static_cast<size_t>(numTris) * 3);
+  VertexWelder <TNumberContainer1, index_t> welder(coordsOut, numTris / 2);
+
+  const size_t releaseInterval = 1 << 22;
+  const char* record = file.data + 84;
+  const char* released = file.data;
+
+  for(unsigned int tri = 0; tri < numTris; ++tri, record += recordSize){
     float d[12];
-    in.read((char*)d, 12 * 4);
-    STL_READER_COND_THROW(!in, "Error while parsing trianlge in binary stl file " << filename);
-
-    for(int i = 0; i < 3; ++i)
-      normalsOut.push_back (d[i]);
+    memcpy(d, record, sizeof(d));
 
-    for(size_t ivrt = 1; ivrt < 4; ++ivrt){
-      CoordWithIndex <number_t, index_t> c;
+    index_t corners[3];
+    for(size_t ivrt = 0; ivrt < 3; ++ivrt){
+      number_t c[3];
       for(size_t i = 0; i < 3; ++i)
-        c[i] = d[ivrt * 3 + i];
-      c.index = static_cast<index_t>(coordsWithIndex.size());
-      coordsWithIndex.push_back(c);
+        c[i] = d[(ivrt + 1) * 3 + i];
+      corners[ivrt] = welder.add(c);
     }
 
-    trisOut.push_back(static_cast<index_t> (coordsWithIndex.size() - 3));
-    trisOut.push_back(static_cast<index_t> (coordsWithIndex.size() - 2));
-    trisOut.push_back(static_cast<index_t> (coordsWithIndex.size() - 1));
+  //  only keep triangles which refer to three different vertices, along
+  //  with their normals
+    if(corners[0] != corners[1] && corners[0] != corners[2] && corners[1] != corners[2]){
+      for(size_t i = 0; i < 3; ++i){
+        normalsOut.push_back (d[i]);
+        trisOut.push_back (corners[i]);
+      }
+    }
 
-    char addData[2];
-    in.read(addData, 2);
-    STL_READER_COND_THROW(!in, "Error while parsing additional triangle data in binary stl file " << filename);
+    if(static_cast<size_t>(record - released) > releaseInterval){
+      file.release(record);
+      released = record;
+    }
   }
 
   solidRangesOut.push_back(0);
   solidRangesOut.push_back(static_cast<index_t> (trisOut.size() / 3));
 
-  RemoveDoubles (coordsOut, trisOut, coordsWithIndex);
+  FinishWelding (weldEpsilon, static_cast<size_t>(numTris) * 3, coordsOut,
+                 normalsOut, trisOut, solidRangesOut, statsOut);
 
   return true;
 }
@@ -1,32 +1,77 @@
 #include <cstdio>
 #include <cmath>
+#include <cstdlib>
 #include <cstring>
 #include "matrix.h"
 #include "model.h"
+#include "modelloader.h"
 #include "raster.h"
+#include "threadpool.h"
 #include "common.h"
 
+// How many frames to average stage timings over.
+#define STAGE_TIMING_FRAMES 300
+
 int main (int argc, char *argv[]) {
     printf("Running STL model tests...\n");
 
     Screen *screen = new Screen(SIGN_WIDTH, SIGN_HEIGHT);
     int count = 0;
 
-    // Load the model.
-    Model *model = new Model("testmodel.stl", FLAGS_WIREFRAME);
-    model->coalesce();
-    Point *origin = model->getOrigin();
+    // How many frames the model's timings have been counting since they were last cleared, which starts over
+    // whenever a new model is swapped in.
+    int timedFrames = 0;
+
+    // Optionally run on a pool of a given size instead of the shared one, so that the timings above can be
+    // compared across thread counts. Zero does everything on this thread.
+    ThreadPool *pool = NULL;
+    int threads = argc > 2 ? atoi(argv[2]) : -1;
+    if (threads > 0) {
+        pool = new ThreadPool(threads);
+    }
 
-    Point *dimensions = model->getDimensions();
-    double maxDimension = MAX(MAX(dimensions->x, dimensions->y), dimensions->z) / 2.25;
-    delete dimensions;
+    // Load the model in the background, so that we can keep drawing frames while it loads.
+    ModelLoader *loader = new ModelLoader(argc > 1 ? argv[1] : "testmodel.stl", FLAGS_WIREFRAME, [](Model *loaded) {
+        loaded->coalesce();
+    });
+    Model *model = NULL;
+    Point *origin = NULL;
+    double maxDimension = 1.0;
 
     // Set up a simple frustum for culling.
     Frustum *frustum = new Frustum(SIGN_WIDTH, SIGN_HEIGHT, 60.0, 1.0, 1000.0);
 
     while ( 1 ) {
+        // Swap in the full model as soon as it is ready, showing a preview until then if there is one.
+        Model *loaded = loader->takeModel();
+        if (loaded == NULL && model == NULL) {
+            loaded = loader->takePreview();
+        }
+        if (loaded != NULL) {
+            delete model;
+            delete origin;
+            model = loaded;
+            origin = model->getOrigin();
+            model->clearTimings();
+            timedFrames = 0;
+            if (threads >= 0) {
+                model->setThreadPool(pool);
+            }
+
+            Point *dimensions = model->getDimensions();
+            maxDimension = MAX(MAX(dimensions->x, dimensions->y), dimensions->z) / 2.25;
+            delete dimensions;
+        }
+
         // Set up our pixel buffer.
         screen->clear();
+        if (model == NULL) {
+            // Nothing to draw yet, but the sign should still get frames.
+            screen->waitForVBlank();
+            screen->renderFrame();
+            count++;
+            continue;
+        }
         model->reset();
 
         // Set up the view matrix.
@@ -51,8 +96,8 @@ int main (int argc, char *argv[]) {
         model->transform(effectsMatrix);
         delete effectsMatrix;
 
-        // Cull any polygons outside of our frustum.
-        model->cull(frustum);
+        // Cull any polygons outside of our frustum, or facing away from us.
+        model->cull(frustum, viewMatrix, screen);
 
         // Move the cube to where it should go.
         model->project(viewMatrix);
@@ -69,11 +114,31 @@ int main (int argc, char *argv[]) {
 
         // Keep track of location.
         count++;
+
+        // Every so often, show where the time is going.
+        timedFrames++;
+        if (timedFrames == STAGE_TIMING_FRAMES) {
+            ModelTimings timings;
+            model->getTimings(&timings);
+            model->clearTimings();
+
+            printf(
+                "Average us per frame: transform %.1f, cull %.1f, project %.1f, draw %.1f\n",
+                (timings.transform * 1000000.0) / timedFrames,
+                (timings.cull * 1000000.0) / timedFrames,
+                (timings.project * 1000000.0) / timedFrames,
+                (timings.draw * 1000000.0) / timedFrames
+            );
+            timedFrames = 0;
+        }
     }
 
     delete frustum;
+    delete origin;
     delete model;
+    delete loader;
     delete screen;
+    delete pool;
     printf("Done!\n");
 
     return 0;
@@ -0,0 +1,106 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int threads) {
+    running = false;
+    body = 0;
+    length = 0;
+    chunkSize = 1;
+    next = 0;
+    busy = 0;
+    generation = 0;
+    stopping = false;
+
+    // The caller is one of the threads, so it only needs help from the rest.
+    for (int i = 1; i < threads; i++) {
+        workers.push_back(std::thread(&ThreadPool::_work, this));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+int ThreadPool::getThreads() {
+    return workers.size() + 1;
+}
+
+void ThreadPool::parallelFor(int length, int chunkSize, const std::function<void(int, int)> &body) {
+    if (length <= 0) { return; }
+
+    if (workers.empty() || length <= chunkSize) {
+        // Not worth waking anybody up for.
+        body(0, length);
+        return;
+    }
+
+    // The pool is somebody else's for now, and they would much rather we didn't wait for them.
+    if (running.exchange(true, std::memory_order_acquire)) {
+        body(0, length);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        this->body = &body;
+        this->length = length;
+        this->chunkSize = chunkSize;
+        next = 0;
+        busy = workers.size();
+        generation++;
+    }
+    wake.notify_all();
+
+    _runChunks();
+
+    // Everybody has to be done with body before it goes out of scope.
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this] { return busy == 0; });
+    this->body = 0;
+    running.store(false, std::memory_order_release);
+}
+
+void ThreadPool::_runChunks() {
+    for (;;) {
+        int start = next.fetch_add(chunkSize);
+        if (start >= length) { return; }
+
+        int end = (length - start) < chunkSize ? length : start + chunkSize;
+        (*body)(start, end);
+    }
+}
+
+void ThreadPool::_work() {
+    unsigned int seen = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this, seen] { return stopping || generation != seen; });
+            if (stopping) { return; }
+            seen = generation;
+        }
+
+        _runChunks();
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            busy--;
+            if (busy == 0) {
+                done.notify_one();
+            }
+        }
+    }
+}
+
+ThreadPool *ThreadPool::getShared() {
+    static ThreadPool shared(std::thread::hardware_concurrency() > 0 ? std::thread::hardware_concurrency() : 1);
+    return &shared;
+}
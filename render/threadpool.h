@@ -0,0 +1,55 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A handful of threads that split loops between themselves. Work is handed out a chunk at a time
+// from a shared cursor, so threads that finish early keep taking chunks from the rest instead of
+// sitting idle, and which thread runs a chunk never changes what the chunk computes.
+class ThreadPool {
+    public:
+        // Constructor, running loops across the given number of threads including the caller's.
+        ThreadPool(int threads);
+        ~ThreadPool();
+
+        // Return how many threads loops are run across, including the caller's.
+        int getThreads();
+
+        // Call body with every range [start, end) of at most chunkSize indexes covering [0, length),
+        // returning once all of them are done. The calling thread helps out. Only one loop runs across
+        // the pool at a time, so any thread that starts one while another is running, including from
+        // inside body, just runs its whole loop itself.
+        void parallelFor(int length, int chunkSize, const std::function<void(int, int)> &body);
+
+        // Return a pool with a thread for every core, shared by everybody who doesn't need their own.
+        static ThreadPool *getShared();
+
+    private:
+        void _work();
+        void _runChunks();
+
+        // Whether somebody is running a loop across the pool right now.
+        std::atomic<bool> running;
+
+        std::vector<std::thread> workers;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+
+        // The loop currently being run, and which run of a loop it is so that workers can tell a
+        // new one from the one they just finished.
+        const std::function<void(int, int)> *body;
+        int length;
+        int chunkSize;
+        std::atomic<int> next;
+        int busy;
+        unsigned int generation;
+        bool stopping;
+};
+
+#endif